@@ -1,3 +1,3 @@
 TEMPLATE = subdirs
 
-SUBDIRS = QtSimpleChatClient QtSimpleChatServer QtSimpleChatServerThreaded
+SUBDIRS = QtSimpleChatClient QtSimpleChatServer QtSimpleChatServerThreaded QtSimpleChatBench
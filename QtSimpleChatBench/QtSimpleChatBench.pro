@@ -0,0 +1,42 @@
+QT += core network
+QT -= gui
+
+TARGET = chatbench
+# minimal c++ version is c++11
+CONFIG *= c++17
+CONFIG *= warn_on
+CONFIG *= release
+CONFIG *= console
+CONFIG -= app_bundle
+
+TEMPLATE = app
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+CONFIG(release, debug|release):BUILD_DIR = release
+CONFIG(debug, debug|release):BUILD_DIR = debug
+
+DESTDIR = $$BUILD_DIR
+OBJECTS_DIR = $$BUILD_DIR/build
+RCC_DIR = $$BUILD_DIR/build
+MOC_DIR = $$BUILD_DIR/build
+
+# the protocol types and the parser are shared with the threaded server
+CHAT_SERVER_DIR = $$PWD/../QtSimpleChatServerThreaded
+INCLUDEPATH += $$CHAT_SERVER_DIR
+
+SOURCES += \
+    benchmain.cpp \
+    benchmark.cpp \
+    benchclient.cpp \
+    clientgroup.cpp \
+    $$CHAT_SERVER_DIR/chatmessage.cpp \
+    $$CHAT_SERVER_DIR/messageparser.cpp
+
+HEADERS += \
+    benchmark.h \
+    benchclient.h \
+    clientgroup.h \
+    $$CHAT_SERVER_DIR/chatmessage.h \
+    $$CHAT_SERVER_DIR/enums.h \
+    $$CHAT_SERVER_DIR/messageparser.h
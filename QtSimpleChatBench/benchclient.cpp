@@ -0,0 +1,141 @@
+#include "benchclient.h"
+#include <QElapsedTimer>
+
+qint64 benchNow()
+{
+    static const QElapsedTimer clock = []() {
+        QElapsedTimer timer;
+        timer.start();
+        return timer;
+    }();
+    return clock.nsecsElapsed();
+}
+
+BenchClient::BenchClient(int index, const QString &runTag, BenchStats *stats, QObject *parent)
+    : QObject(parent)
+    , m_index(index)
+    , m_uid(uidFor(runTag, index))
+    , m_stats(stats)
+    , m_socket(this)
+    , m_writer(&m_socket)
+{
+    connect(&m_socket, &QTcpSocket::connected, this, &BenchClient::login);
+    connect(&m_socket, &QTcpSocket::readyRead, this, &BenchClient::receiveData);
+    connect(&m_socket, &QTcpSocket::disconnected, this, [this]() {
+        if (m_ready) {
+            m_ready = false;
+            ++m_stats->errors;
+        }
+    });
+#if (QT_VERSION < QT_VERSION_CHECK(5, 15, 0))
+    connect(&m_socket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, [this]() {
+#else
+    connect(&m_socket, &QAbstractSocket::errorOccurred, this, [this]() {
+#endif
+        if (!m_ready)
+            fail(m_socket.errorString());
+    });
+}
+
+QString BenchClient::uidFor(const QString &runTag, int index)
+{
+    return QStringLiteral("bench-%1-%2").arg(runTag).arg(index);
+}
+
+QString BenchClient::uid() const
+{
+    return m_uid;
+}
+
+bool BenchClient::isReady() const
+{
+    return m_ready;
+}
+
+void BenchClient::connectToServer(const QHostAddress &address, quint16 port)
+{
+    m_socket.connectToHost(address, port);
+}
+
+void BenchClient::disconnectFromServer()
+{
+    m_ready = false;
+    if (m_socket.state() == QAbstractSocket::ConnectedState)
+        m_writer.endArray();
+    m_socket.disconnectFromHost();
+}
+
+void BenchClient::login()
+{
+    m_writer.startArray();
+    m_writer.startMap(3);
+    m_writer.append(DataType);
+    m_writer.append(QLatin1String("login"));
+    m_writer.append(UserName);
+    m_writer.append(m_uid);
+    m_writer.append(UserUid);
+    m_writer.append(m_uid);
+    m_writer.endMap();
+}
+
+void BenchClient::sendMessage(const QString &receiverUid, const QString &padding)
+{
+    Q_ASSERT(m_ready);
+    // the latency is measured from here to the parsing on the receiving client
+    m_writer.startMap(3);
+    m_writer.append(DataType);
+    m_writer.append(QLatin1String("message"));
+    m_writer.append(ReceiverUid);
+    m_writer.append(receiverUid);
+    m_writer.append(Text);
+    m_writer.append(QString::number(benchNow()) + QLatin1Char(' ') + padding);
+    m_writer.endMap();
+    ++m_stats->sent;
+}
+
+// Reports the client once, the errors following a rejected login or a parse error are not counted again
+void BenchClient::fail(const QString &reason)
+{
+    if (m_settled)
+        return;
+    m_settled = true;
+    emit failed(reason);
+}
+
+void BenchClient::receiveData()
+{
+    m_parser.append(m_socket.readAll());
+    for (;;) {
+        switch (m_parser.next(&m_received)) {
+            case MessageParser::Message: {
+                const QString type = m_received.string(DataType);
+                if (type == QLatin1String("message")) {
+                    const QString text = m_received.string(Text);
+                    bool ok = false;
+                    const qint64 sentAt = text.left(text.indexOf(QLatin1Char(' '))).toLongLong(&ok);
+                    if (ok) {
+                        ++m_stats->delivered;
+                        m_stats->latencies.append(benchNow() - sentAt);
+                    }
+                } else if (type == QLatin1String("login") && !m_ready) {
+                    if (m_received.boolean(Success)) {
+                        m_ready = true;
+                        m_settled = true;
+                        emit ready();
+                    } else {
+                        fail(m_received.string(Reason));
+                    }
+                }
+                break;
+            }
+            case MessageParser::NeedMoreData:
+            case MessageParser::EndOfStream:
+                return;
+            case MessageParser::Error:
+                ++m_stats->errors;
+                fail(m_parser.errorString());
+                m_socket.abort();
+                return;
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef BENCHCLIENT_H
+#define BENCHCLIENT_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QCborStreamWriter>
+#include <QVector>
+
+#include "enums.h"
+#include "chatmessage.h"
+#include "messageparser.h"
+
+// Monotonic clock shared by every thread of the benchmark, in nanoseconds
+qint64 benchNow();
+
+// Counters of a group of clients, only touched by the thread of the group
+struct BenchStats
+{
+    quint64 sent{0};
+    quint64 delivered{0};
+    quint64 errors{0};
+    QVector<qint64> latencies; // ns, one sample per delivered message
+};
+
+// Simulated client speaking the same protocol as ServerWorker:
+// an indefinite CBOR array of maps keyed by Type in both directions.
+// The messages it sends carry their send time, every delivery adds a latency sample to the stats
+class BenchClient : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(BenchClient)
+public:
+    explicit BenchClient(int index, const QString &runTag, BenchStats *stats, QObject *parent = nullptr);
+    static QString uidFor(const QString &runTag, int index);
+    QString uid() const;
+    bool isReady() const;
+    void connectToServer(const QHostAddress &address, quint16 port);
+    void disconnectFromServer();
+    void sendMessage(const QString &receiverUid, const QString &padding);
+signals:
+    void ready();
+    void failed(const QString &reason);
+private:
+    void login();
+    void receiveData();
+    void fail(const QString &reason);
+
+    const int m_index;
+    const QString m_uid;
+    BenchStats *m_stats;
+    QTcpSocket m_socket;
+    QCborStreamWriter m_writer;
+    MessageParser m_parser;
+    ChatMessage m_received;
+    bool m_ready{false};
+    bool m_settled{false}; // ready() or failed() was emitted
+};
+
+#endif // BENCHCLIENT_H
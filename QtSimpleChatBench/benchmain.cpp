@@ -0,0 +1,65 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QThread>
+
+#include "benchmark.h"
+#include "enums.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("chatbench"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral("Load generator for chatserver."));
+    parser.addHelpOption();
+    QCommandLineOption hostOption(QStringLiteral("host"), QStringLiteral("Server address (default 127.0.0.1)."),
+                                  QStringLiteral("address"), QStringLiteral("127.0.0.1"));
+    QCommandLineOption portOption(QStringLiteral("port"), QStringLiteral("Server port (default %1).").arg(SERVER_PORT),
+                                  QStringLiteral("port"), QString::number(SERVER_PORT));
+    QCommandLineOption clientsOption(QStringLiteral("clients"), QStringLiteral("Simulated clients (default 1000)."),
+                                     QStringLiteral("count"), QStringLiteral("1000"));
+    QCommandLineOption threadsOption(QStringLiteral("threads"), QStringLiteral("Threads running the clients (default: ideal thread count)."),
+                                     QStringLiteral("count"), QString::number(QThread::idealThreadCount()));
+    QCommandLineOption connectBatchOption(QStringLiteral("connect-batch"), QStringLiteral("Connections opened per thread every 10 ms (default 50)."),
+                                          QStringLiteral("count"), QStringLiteral("50"));
+    QCommandLineOption connectTimeoutOption(QStringLiteral("connect-timeout"), QStringLiteral("Seconds allowed for the logins (default 60)."),
+                                            QStringLiteral("seconds"), QStringLiteral("60"));
+    QCommandLineOption durationOption(QStringLiteral("duration"), QStringLiteral("Seconds of traffic (default 10)."),
+                                      QStringLiteral("seconds"), QStringLiteral("10"));
+    QCommandLineOption rateOption(QStringLiteral("rate"), QStringLiteral("Messages per client and second (default 1)."),
+                                  QStringLiteral("rate"), QStringLiteral("1"));
+    QCommandLineOption privateOption(QStringLiteral("private-ratio"), QStringLiteral("Share of private messages, the rest are broadcasts (default 0.5)."),
+                                     QStringLiteral("ratio"), QStringLiteral("0.5"));
+    QCommandLineOption payloadOption(QStringLiteral("payload"), QStringLiteral("Bytes of text in every message (default 64)."),
+                                     QStringLiteral("bytes"), QStringLiteral("64"));
+    QCommandLineOption pidOption(QStringLiteral("server-pid"), QStringLiteral("Sample the resident memory of this process."),
+                                 QStringLiteral("pid"));
+    parser.addOptions({hostOption, portOption, clientsOption, threadsOption, connectBatchOption, connectTimeoutOption,
+                       durationOption, rateOption, privateOption, payloadOption, pidOption});
+    parser.process(a);
+
+    BenchOptions options;
+    options.address = QHostAddress(parser.value(hostOption));
+    options.port = quint16(parser.value(portOption).toUInt());
+    options.clients = qMax(1, parser.value(clientsOption).toInt());
+    options.threads = qMax(1, parser.value(threadsOption).toInt());
+    options.connectBatch = qMax(1, parser.value(connectBatchOption).toInt());
+    options.connectTimeout = qMax(1, parser.value(connectTimeoutOption).toInt());
+    options.duration = qMax(1, parser.value(durationOption).toInt());
+    options.rate = qMax(0.0, parser.value(rateOption).toDouble());
+    options.privateRatio = qBound(0.0, parser.value(privateOption).toDouble(), 1.0);
+    options.payloadSize = qMax(0, parser.value(payloadOption).toInt());
+    options.serverPid = parser.value(pidOption).toLongLong();
+    options.runTag = QString::number(QCoreApplication::applicationPid());
+    if (options.address.isNull()) {
+        qCritical() << "Invalid address" << parser.value(hostOption);
+        return 1;
+    }
+
+    Benchmark benchmark(options);
+    QObject::connect(&benchmark, &Benchmark::finished, &a, &QCoreApplication::exit, Qt::QueuedConnection);
+    benchmark.start();
+    return a.exec();
+}
@@ -0,0 +1,171 @@
+#include "benchmark.h"
+#include <QFile>
+#include <QTextStream>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+
+// time left to the messages still in flight when the traffic stops
+constexpr int DRAIN_TIME = 1000; // ms
+constexpr int RSS_SAMPLE_INTERVAL = 250; // ms
+
+// Resident set size of a process in KiB, -1 when it cannot be read
+static qint64 residentSetSize(qint64 pid)
+{
+    QFile status(QStringLiteral("/proc/%1/status").arg(pid));
+    if (!status.open(QIODevice::ReadOnly | QIODevice::Text))
+        return -1;
+    for (QByteArray line = status.readLine(); !line.isEmpty(); line = status.readLine()) {
+        if (line.startsWith("VmRSS:"))
+            return line.mid(6).trimmed().split(' ').value(0).toLongLong();
+    }
+    return -1;
+}
+
+static double percentile(const QVector<qint64> &sorted, double p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    const int index = qBound(0, int(std::ceil(p * sorted.size())) - 1, sorted.size() - 1);
+    return sorted.at(index) / 1e6; // ms
+}
+
+Benchmark::Benchmark(const BenchOptions &options, QObject *parent)
+    : QObject(parent)
+    , m_options(options)
+{
+    m_phaseTimer.setSingleShot(true);
+    m_rssTimer.setInterval(RSS_SAMPLE_INTERVAL);
+    connect(&m_rssTimer, &QTimer::timeout, this, &Benchmark::sampleRss);
+}
+
+Benchmark::~Benchmark()
+{
+    for (QThread *thread : qAsConst(m_threads)) {
+        thread->quit();
+        thread->wait();
+    }
+}
+
+template <typename Method>
+void Benchmark::invokeOnGroups(Method method)
+{
+    for (ClientGroup *group : qAsConst(m_groups))
+        QMetaObject::invokeMethod(group, method, Qt::QueuedConnection);
+}
+
+void Benchmark::start()
+{
+    const int threadCount = qBound(1, m_options.threads, m_options.clients);
+    for (int i = 0; i < threadCount; ++i) {
+        const int first = m_options.clients * i / threadCount;
+        const int last = m_options.clients * (i + 1) / threadCount;
+        QThread *thread = new QThread(this);
+        ClientGroup *group = new ClientGroup(m_options, first, last - first);
+        group->moveToThread(thread);
+        connect(thread, &QThread::finished, group, &QObject::deleteLater);
+        connect(group, &ClientGroup::clientReady, this, &Benchmark::clientReady);
+        connect(group, &ClientGroup::clientFailed, this, &Benchmark::clientFailed);
+        m_threads.append(thread);
+        m_groups.append(group);
+        thread->start();
+    }
+    if (m_options.serverPid > 0) {
+        sampleRss();
+        m_rssTimer.start();
+    }
+    connect(&m_phaseTimer, &QTimer::timeout, this, &Benchmark::connectTimedOut);
+    m_phaseTimer.start(m_options.connectTimeout * 1000);
+    m_connectClock.start();
+    invokeOnGroups(&ClientGroup::connectClients);
+}
+
+void Benchmark::clientReady()
+{
+    if (++m_ready + m_failed == m_options.clients)
+        startTraffic();
+}
+
+void Benchmark::clientFailed(const QString &reason)
+{
+    // only the first failures, a server that is not running fails every client
+    if (m_failed < 10)
+        QTextStream(stderr) << "Client failed: " << reason << '\n';
+    if (m_ready + ++m_failed == m_options.clients)
+        startTraffic();
+}
+
+void Benchmark::connectTimedOut()
+{
+    QTextStream(stderr) << "Only " << m_ready << " of " << m_options.clients
+                        << " clients logged in after " << m_options.connectTimeout << " s\n";
+    startTraffic();
+}
+
+void Benchmark::startTraffic()
+{
+    if (m_trafficStarted)
+        return;
+    m_trafficStarted = true;
+    m_phaseTimer.disconnect();
+    m_phaseTimer.stop();
+    m_connectSeconds = m_connectClock.nsecsElapsed() / 1e9;
+    if (m_ready == 0) {
+        QTextStream(stderr) << "No client could log in\n";
+        emit finished(1);
+        return;
+    }
+    invokeOnGroups(&ClientGroup::startTraffic);
+    m_trafficClock.start();
+    connect(&m_phaseTimer, &QTimer::timeout, this, &Benchmark::stopTraffic);
+    m_phaseTimer.start(m_options.duration * 1000);
+}
+
+void Benchmark::stopTraffic()
+{
+    invokeOnGroups(&ClientGroup::stopTraffic);
+    m_trafficSeconds = m_trafficClock.nsecsElapsed() / 1e9;
+    m_phaseTimer.disconnect();
+    connect(&m_phaseTimer, &QTimer::timeout, this, &Benchmark::report);
+    m_phaseTimer.start(DRAIN_TIME);
+}
+
+void Benchmark::sampleRss()
+{
+    m_peakRss = qMax(m_peakRss, residentSetSize(m_options.serverPid));
+}
+
+void Benchmark::report()
+{
+    m_rssTimer.stop();
+    BenchStats total;
+    for (ClientGroup *group : qAsConst(m_groups)) {
+        BenchStats stats;
+        QMetaObject::invokeMethod(group, [group, &stats]() { stats = group->stats(); }, Qt::BlockingQueuedConnection);
+        total.sent += stats.sent;
+        total.delivered += stats.delivered;
+        total.errors += stats.errors;
+        total.latencies += stats.latencies;
+    }
+    invokeOnGroups(&ClientGroup::disconnectClients);
+    std::sort(total.latencies.begin(), total.latencies.end());
+
+    QTextStream out(stdout);
+    out.setRealNumberNotation(QTextStream::FixedNotation);
+    out.setRealNumberPrecision(2);
+    out << "clients:       " << m_ready << " logged in, " << m_failed << " failed" << '\n';
+    out << "connect rate:  " << m_ready / qMax(m_connectSeconds, 1e-9) << " logins/s ("
+        << m_connectSeconds << " s)" << '\n';
+    out << "sent:          " << total.sent << " messages, " << total.sent / m_trafficSeconds << " msg/s" << '\n';
+    out << "delivered:     " << total.delivered << " messages, " << total.delivered / m_trafficSeconds << " msg/s" << '\n';
+    out << "latency (ms):  p50 " << percentile(total.latencies, 0.5)
+        << "  p99 " << percentile(total.latencies, 0.99)
+        << "  p999 " << percentile(total.latencies, 0.999)
+        << "  max " << percentile(total.latencies, 1.0) << '\n';
+    out << "errors:        " << total.errors << '\n';
+    if (m_options.serverPid > 0) {
+        const qint64 rss = residentSetSize(m_options.serverPid);
+        out << "server RSS:    " << rss / 1024.0 << " MiB, peak " << m_peakRss / 1024.0 << " MiB" << '\n';
+    }
+    emit finished(total.errors == 0 ? 0 : 2);
+}
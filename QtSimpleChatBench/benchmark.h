@@ -0,0 +1,50 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QVector>
+
+#include "clientgroup.h"
+
+class QThread;
+
+// Drives a run: connects and logs in every client, sends traffic for the configured
+// duration, lets the last deliveries arrive and prints the results
+class Benchmark : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(Benchmark)
+public:
+    explicit Benchmark(const BenchOptions &options, QObject *parent = nullptr);
+    ~Benchmark();
+    void start();
+signals:
+    void finished(int exitCode);
+private:
+    void clientReady();
+    void clientFailed(const QString &reason);
+    void connectTimedOut();
+    void startTraffic();
+    void stopTraffic();
+    void report();
+    void sampleRss();
+    template <typename Method> void invokeOnGroups(Method method);
+
+    const BenchOptions m_options;
+    QVector<QThread *> m_threads;
+    QVector<ClientGroup *> m_groups;
+    int m_ready{0};
+    int m_failed{0};
+    bool m_trafficStarted{false};
+    QElapsedTimer m_connectClock;
+    double m_connectSeconds{0};
+    QElapsedTimer m_trafficClock;
+    double m_trafficSeconds{0};
+    QTimer m_phaseTimer;
+    QTimer m_rssTimer;
+    qint64 m_peakRss{-1};
+};
+
+#endif // BENCHMARK_H
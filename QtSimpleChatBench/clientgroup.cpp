@@ -0,0 +1,89 @@
+#include "clientgroup.h"
+
+// period of the connection and sending ticks
+constexpr int TICK_INTERVAL = 10; // ms
+
+ClientGroup::ClientGroup(const BenchOptions &options, int firstIndex, int count, QObject *parent)
+    : QObject(parent)
+    , m_options(options)
+    , m_firstIndex(firstIndex)
+    , m_count(count)
+    , m_padding(options.payloadSize, QLatin1Char('x'))
+    , m_timer(this)
+    , m_random(quint32(firstIndex + 1))
+{
+    m_timer.setInterval(TICK_INTERVAL);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, &QTimer::timeout, this, &ClientGroup::tick);
+}
+
+BenchStats ClientGroup::stats() const
+{
+    return m_stats;
+}
+
+void ClientGroup::connectClients()
+{
+    m_clients.reserve(m_count);
+    m_timer.start();
+}
+
+void ClientGroup::startTraffic()
+{
+    m_sending = true;
+    m_credit = 0;
+    // the connection phase is not part of the results
+    m_stats = BenchStats();
+    m_stats.latencies.reserve(int(qMin(m_options.rate * m_count * m_options.duration * 2, 1e7)));
+}
+
+void ClientGroup::stopTraffic()
+{
+    m_sending = false;
+}
+
+void ClientGroup::disconnectClients()
+{
+    m_timer.stop();
+    for (BenchClient *client : qAsConst(m_clients))
+        client->disconnectFromServer();
+}
+
+void ClientGroup::tick()
+{
+    if (m_connected < m_count)
+        connectBatch();
+    if (m_sending)
+        sendBatch();
+}
+
+void ClientGroup::connectBatch()
+{
+    const int last = qMin(m_connected + m_options.connectBatch, m_count);
+    for (; m_connected < last; ++m_connected) {
+        BenchClient *client = new BenchClient(m_firstIndex + m_connected, m_options.runTag, &m_stats, this);
+        connect(client, &BenchClient::ready, this, &ClientGroup::clientReady);
+        connect(client, &BenchClient::failed, this, &ClientGroup::clientFailed);
+        m_clients.append(client);
+        client->connectToServer(m_options.address, m_options.port);
+    }
+}
+
+void ClientGroup::sendBatch()
+{
+    if (m_clients.isEmpty())
+        return;
+    m_credit += m_options.rate * m_count * TICK_INTERVAL / 1000.0;
+    for (; m_credit >= 1; m_credit -= 1) {
+        BenchClient *sender = m_clients.at(int(m_random.bounded(quint32(m_clients.size()))));
+        if (!sender->isReady())
+            continue;
+        if (m_random.generateDouble() < m_options.privateRatio) {
+            // any client of the run, not only the ones of this group
+            const int receiver = int(m_random.bounded(quint32(m_options.clients)));
+            sender->sendMessage(BenchClient::uidFor(m_options.runTag, receiver), m_padding);
+        } else {
+            sender->sendMessage(QStringLiteral("all"), m_padding);
+        }
+    }
+}
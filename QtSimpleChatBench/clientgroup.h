@@ -0,0 +1,63 @@
+#ifndef CLIENTGROUP_H
+#define CLIENTGROUP_H
+
+#include <QObject>
+#include <QHostAddress>
+#include <QRandomGenerator>
+#include <QTimer>
+#include <QVector>
+
+#include "benchclient.h"
+
+struct BenchOptions
+{
+    QHostAddress address{QHostAddress::LocalHost};
+    quint16 port{0};
+    int clients{1000};
+    int threads{1};
+    int connectBatch{50};      // connections opened per group and tick
+    int connectTimeout{60};    // s
+    int duration{10};          // s
+    double rate{1.0};          // messages per client and second
+    double privateRatio{0.5};  // share of private messages, the rest is broadcast
+    int payloadSize{64};       // bytes of padding in every message
+    qint64 serverPid{0};       // 0 when the server RSS is not sampled
+    QString runTag;            // makes the user names unique between runs
+};
+
+// Clients run by one thread of the benchmark. Every tick it opens the next batch of
+// connections or, once the traffic is started, sends its share of the message rate
+class ClientGroup : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ClientGroup)
+public:
+    explicit ClientGroup(const BenchOptions &options, int firstIndex, int count, QObject *parent = nullptr);
+    BenchStats stats() const;
+public slots:
+    void connectClients();
+    void startTraffic();
+    void stopTraffic();
+    void disconnectClients();
+signals:
+    void clientReady();
+    void clientFailed(const QString &reason);
+private:
+    void tick();
+    void connectBatch();
+    void sendBatch();
+
+    const BenchOptions m_options;
+    const int m_firstIndex;
+    const int m_count;
+    const QString m_padding;
+    QVector<BenchClient *> m_clients;
+    int m_connected{0};
+    bool m_sending{false};
+    double m_credit{0}; // messages owed to the rate
+    QTimer m_timer;
+    QRandomGenerator m_random;
+    BenchStats m_stats;
+};
+
+#endif // CLIENTGROUP_H
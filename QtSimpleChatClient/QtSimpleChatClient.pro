@@ -7,15 +7,29 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 
 CONFIG += debug_and_release
+CONFIG *= c++17
+
+# the protocol types and the parser are shared with the threaded server
+CHAT_SERVER_DIR = $$PWD/../QtSimpleChatServerThreaded
+INCLUDEPATH += $$CHAT_SERVER_DIR
 
 SOURCES += \
     clientmain.cpp \
     chatwindow.cpp \
-    chatclient.cpp
+    chatclient.cpp \
+    chathistorymodel.cpp \
+    messagecache.cpp \
+    $$CHAT_SERVER_DIR/chatmessage.cpp \
+    $$CHAT_SERVER_DIR/messageparser.cpp
 
 FORMS += \
     chatwindow.ui
 
 HEADERS += \
     chatwindow.h \
-    chatclient.h
+    chatclient.h \
+    chathistorymodel.h \
+    messagecache.h \
+    $$CHAT_SERVER_DIR/chatmessage.h \
+    $$CHAT_SERVER_DIR/enums.h \
+    $$CHAT_SERVER_DIR/messageparser.h
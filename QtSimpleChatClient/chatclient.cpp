@@ -1,148 +1,429 @@
 #include "chatclient.h"
+#include "messagecache.h"
 #include <QTcpSocket>
-#include <QDataStream>
-#include <QJsonParseError>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonValue>
+#include <QCborStreamWriter>
+#include <QUuid>
+#include <QDateTime>
+#include <QRandomGenerator>
+
+// the first delay before reconnecting, it doubles with every failed attempt up to the maximum
+constexpr int INITIAL_RECONNECT_DELAY = 500; // ms
+constexpr int MAX_RECONNECT_DELAY = 30000; // ms
+// attempts before the client gives up and reports the disconnection
+constexpr int MAX_RECONNECT_ATTEMPTS = 12;
+// a connection not established by then is abandoned
+constexpr int CONNECT_TIMEOUT = 10000; // ms
 
 ChatClient::ChatClient(QObject *parent)
     : QObject(parent)
     , m_clientSocket(new QTcpSocket(this))
     , m_loggedIn(false)
+    , m_uid(QUuid::createUuid().toString(QUuid::WithoutBraces))
+    , m_cache(nullptr)
+    , m_historySince(0)
+    , m_catchingUp(false)
+    , m_receivedFrames(0)
+    , m_framesBeforeResume(0)
+    , m_rosterVersion(0)
+    , m_port(0)
+    , m_autoReconnect(false)
+    , m_reconnecting(false)
+    , m_reconnectAttempt(0)
+    , m_initialReconnectDelay(INITIAL_RECONNECT_DELAY)
+    , m_maxReconnectDelay(MAX_RECONNECT_DELAY)
+    , m_maxReconnectAttempts(MAX_RECONNECT_ATTEMPTS)
 {
-    // Forward the connected and disconnected signals
-    connect(m_clientSocket, &QTcpSocket::connected, this, &ChatClient::connected);
-    connect(m_clientSocket, &QTcpSocket::disconnected, this, &ChatClient::disconnected);
+    // Start a new stream on every connection, then forward the signal
+    connect(m_clientSocket, &QTcpSocket::connected, this, &ChatClient::onConnected);
+    // a dropped connection is reopened, the disconnected signal is only forwarded if it is not
+    connect(m_clientSocket, &QTcpSocket::disconnected, this, &ChatClient::onDisconnected);
     // connect readyRead() to the slot that will take care of reading the data in
     connect(m_clientSocket, &QTcpSocket::readyRead, this, &ChatClient::onReadyRead);
-    // Forward the error signal, QOverload is necessary as error() is overloaded, see the Qt docs 
+    // Forward the error signal, QOverload is necessary as error() is overloaded, see the Qt docs
 #if (QT_VERSION < QT_VERSION_CHECK(5, 15, 0))
-    connect(m_clientSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &ChatClient::error);
+    connect(m_clientSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &ChatClient::onError);
 #else
-    connect(m_clientSocket, &QAbstractSocket::errorOccurred, this, &ChatClient::error);
+    connect(m_clientSocket, &QAbstractSocket::errorOccurred, this, &ChatClient::onError);
 #endif
-    // Reset the m_loggedIn variable when we disconnec. Since the operation is trivial we use a lambda instead of creating another slot
-    connect(m_clientSocket, &QTcpSocket::disconnected, this, [this]()->void{m_loggedIn = false;});
+    m_connectTimer.setSingleShot(true);
+    m_connectTimer.setInterval(CONNECT_TIMEOUT);
+    connect(&m_connectTimer, &QTimer::timeout, this, &ChatClient::connectTimedOut);
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, &QTimer::timeout, this, &ChatClient::reconnect);
+}
+
+ChatClient::~ChatClient() = default;
+
+// The received messages are added to the cache, and after login only those the cache
+// does not have yet are asked for
+void ChatClient::setCache(MessageCache *cache)
+{
+    m_cache = cache;
+}
+
+// Delays in ms: the first one, doubled after every failed attempt up to maxDelay,
+// and the attempts made before the disconnection is reported
+void ChatClient::setReconnectPolicy(int initialDelay, int maxDelay, int maxAttempts)
+{
+    m_initialReconnectDelay = qMax(1, initialDelay);
+    m_maxReconnectDelay = qMax(m_initialReconnectDelay, maxDelay);
+    m_maxReconnectAttempts = qMax(0, maxAttempts);
+}
+
+void ChatClient::setConnectTimeout(int msecs)
+{
+    m_connectTimer.setInterval(msecs);
+}
+
+void ChatClient::onConnected()
+{
+    m_connectTimer.stop();
+    // the whole connection is a single CBOR array, it is opened once and every message is a map in it
+    m_writer.reset(new QCborStreamWriter(m_clientSocket));
+    m_writer->startArray();
+    m_parser.reset();
+    m_receivedFrames = 0;
+    if (!m_reconnecting) {
+        emit connected();
+        return;
+    }
+    // back after a drop: take the session over if the server still keeps it, log in again otherwise
+    if (m_sessionToken.isEmpty())
+        login(m_userName);
+    else
+        resumeSession();
+}
+
+void ChatClient::onDisconnected()
+{
+    // what the session got so far, a resume asks for what follows. The attempts that never
+    // got the session back leave it unchanged
+    if (m_loggedIn)
+        m_framesBeforeResume = m_receivedFrames;
+    // Reset the m_loggedIn variable when we disconnect and drop the stream of the connection
+    m_loggedIn = false;
+    m_writer.reset();
+    m_connectTimer.stop();
+    if (m_autoReconnect)
+        scheduleReconnect();
+    else
+        emit disconnected();
+}
+
+void ChatClient::onError(QAbstractSocket::SocketError socketError)
+{
+    // the attempt is over, it must not time out as well
+    m_connectTimer.stop();
+    if (!m_autoReconnect) {
+        emit error(socketError);
+        return;
+    }
+    // a failed attempt never connected, no disconnected signal follows
+    if (m_clientSocket->state() == QAbstractSocket::UnconnectedState)
+        scheduleReconnect();
+}
+
+void ChatClient::connectTimedOut()
+{
+    m_clientSocket->abort();
+    if (m_autoReconnect)
+        scheduleReconnect();
+    else
+        emit error(QAbstractSocket::SocketTimeoutError);
+}
+
+// Waits before the next attempt. The delay grows exponentially and is jittered,
+// so the clients of a restarted server do not all come back at the same moment
+void ChatClient::scheduleReconnect()
+{
+    if (m_reconnectTimer.isActive())
+        return;
+    if (m_reconnectAttempt >= m_maxReconnectAttempts) {
+        // give up, the user has to connect again
+        m_autoReconnect = false;
+        m_reconnecting = false;
+        m_reconnectAttempt = 0;
+        emit disconnected();
+        return;
+    }
+    ++m_reconnectAttempt;
+    const int ceiling = int(qMin<qint64>(m_maxReconnectDelay,
+                                         qint64(m_initialReconnectDelay) << qMin(m_reconnectAttempt - 1, 20)));
+    const int delay = ceiling / 2 + QRandomGenerator::global()->bounded(ceiling / 2 + 1);
+    m_reconnectTimer.start(delay);
+    emit reconnecting(m_reconnectAttempt, delay);
+}
+
+void ChatClient::reconnect()
+{
+    m_reconnecting = true;
+    m_connectTimer.start();
+    m_clientSocket->connectToHost(m_address, m_port);
+}
+
+// Asks the server for the suspended session, with the number of frames we got from it
+void ChatClient::resumeSession()
+{
+    m_writer->startMap(3);
+    m_writer->append(DataType);
+    m_writer->append(QLatin1String("resume"));
+    m_writer->append(SessionToken);
+    m_writer->append(m_sessionToken);
+    m_writer->append(ReceivedFrames);
+    m_writer->append(m_framesBeforeResume);
+    m_writer->endMap();
 }
 
 void ChatClient::login(const QString &userName)
 {
-    if (m_clientSocket->state() == QAbstractSocket::ConnectedState) { // if the client is connected
-        // create a QDataStream operating on the socket
-        QDataStream clientStream(m_clientSocket);
-        // set the version so that programs compiled with different versions of Qt can agree on how to serialise
-        clientStream.setVersion(QDataStream::Qt_5_7);
-        // Create the JSON we want to send
-        QJsonObject message;
-        message[QStringLiteral("type")] = QStringLiteral("login");
-        message[QStringLiteral("username")] = userName;
-        // send the JSON using QDataStream
-        clientStream << QJsonDocument(message).toJson(QJsonDocument::Compact);
+    if (!m_writer) // the client is not connected
+        return;
+    m_userName = userName;
+    // a client that still knows a version of the user list only needs the changes since then
+    m_writer->startMap(m_rosterVersion ? 4 : 3);
+    m_writer->append(DataType);
+    m_writer->append(QLatin1String("login"));
+    m_writer->append(UserName);
+    m_writer->append(userName);
+    m_writer->append(UserUid);
+    m_writer->append(m_uid);
+    if (m_rosterVersion) {
+        m_writer->append(RosterVersion);
+        m_writer->append(m_rosterVersion);
     }
+    m_writer->endMap();
 }
 
 void ChatClient::sendMessage(const QString &text)
 {
-    if (text.isEmpty())
+    if (text.isEmpty() || !m_writer)
         return; // We don't send empty messages
-    // create a QDataStream operating on the socket
-    QDataStream clientStream(m_clientSocket);
-    // set the version so that programs compiled with different versions of Qt can agree on how to serialise
-    clientStream.setVersion(QDataStream::Qt_5_7);
-    // Create the JSON we want to send
-    QJsonObject message;
-    message[QStringLiteral("type")] = QStringLiteral("message");
-    message[QStringLiteral("text")] = text;
-    // send the JSON using QDataStream
-    clientStream << QJsonDocument(message).toJson();
+    m_writer->startMap(2);
+    m_writer->append(DataType);
+    m_writer->append(QLatin1String("message"));
+    m_writer->append(Text);
+    m_writer->append(text);
+    m_writer->endMap();
+    // the server does not send our messages back, they are cached as they are sent
+    if (m_cache)
+        m_cache->append(0, QDateTime::currentMSecsSinceEpoch(), m_uid, text, true);
+}
+
+// Asks for the stored messages following since, the reply may only bring the first ones
+void ChatClient::requestHistory(quint64 since)
+{
+    if (!m_writer)
+        return;
+    m_historySince = since;
+    m_writer->startMap(2);
+    m_writer->append(DataType);
+    m_writer->append(QLatin1String("history"));
+    m_writer->append(Sequence);
+    m_writer->append(since);
+    m_writer->endMap();
 }
 
 void ChatClient::disconnectFromHost()
 {
+    // the user wants to leave, the client does not come back
+    m_autoReconnect = false;
+    m_reconnecting = false;
+    m_reconnectAttempt = 0;
+    m_reconnectTimer.stop();
+    m_connectTimer.stop();
+    if (m_clientSocket->state() != QAbstractSocket::ConnectedState) {
+        // still connecting, or waiting to reconnect
+        m_clientSocket->abort();
+        emit disconnected();
+        return;
+    }
+    // close the array so the server sees the end of the stream
+    if (m_writer)
+        m_writer->endArray();
     m_clientSocket->disconnectFromHost();
 }
 
-void ChatClient::jsonReceived(const QJsonObject &docObj)
+void ChatClient::messageReceivedFromServer(const ChatMessage &message)
 {
     // actions depend on the type of message
-    const auto typeVal = docObj.value(QLatin1String("type")).toString();
-    if (typeVal == QLatin1String("login") && !m_loggedIn) { //It's a login message
-        // the success field will contain the result of our attempt to login
-        const QJsonValue resultVal = docObj.value(QLatin1String("success"));
-        if (resultVal.isNull() || !resultVal.isBool())
+    const QString type = message.string(DataType);
+    if (type == QLatin1String("login") && !m_loggedIn) { //It's a login message
+        if (!message.contains(Success))
             return; // the message had no success field so we ignore
-        const bool loginSuccess = resultVal.toBool();
-        if (loginSuccess) {
+        if (message.boolean(Success)) {
+            m_loggedIn = true;
+            // the reply has the whole user list, unless the one we know only needs the changes that follow
+            if (message.contains(Users)) {
+                m_users.clear();
+                updateUsers(message, false);
+            }
+            m_rosterVersion = quint64(message.integer(RosterVersion));
+            // from now on a dropped connection is opened again
+            m_autoReconnect = true;
+            m_reconnecting = false;
+            m_reconnectAttempt = 0;
             // we logged in succesfully and we notify it via the loggedIn signal
             emit loggedIn();
+            // fetch what was said since the cache stopped being complete, an empty cache starts from now
+            m_catchingUp = m_cache && m_cache->contiguousSequence() != 0;
+            if (m_catchingUp)
+                requestHistory(m_cache->contiguousSequence());
+        } else {
+            // the login attempt failed, we notify the reason of the failure via the loginError signal.
+            // A silent login after a drop is not retried, the user chooses another name
+            m_autoReconnect = false;
+            m_reconnecting = false;
+            emit loginError(message.string(Reason));
         }
-        else {
-            // the login attempt failed, we extract the reason of the failure from the JSON
-            // and notify it via the loginError signal
-            emit loginError(docObj.value(QLatin1String("reason")).toString());
+    } else if (type == QLatin1String("login") && m_loggedIn) {
+        // the whole list again, when the server no longer has the changes we missed
+        if (message.boolean(Success))
+            replaceUsers(message);
+    } else if (type == QLatin1String("message")) { //It's a chat message
+        const QString text = message.string(Text);
+        const QString sender = message.string(SenderName);
+        const quint64 sequence = message.contains(Sequence) ? quint64(message.integer(Sequence)) : 0;
+        if (text.isEmpty() || sender.isEmpty()) {
+            // not a message to show
+        } else if (m_cache && sequence != 0 && (m_cache->contains(sequence)
+                   || (m_catchingUp && m_cache->sentFrom(message.string(SenderUid))))) {
+            // the history repeats a message we have, or one of ours, cached when sent.
+            // Only the history brings ours back, the live ones need no lookup
+        } else {
+            if (m_cache && sequence != 0)
+                m_cache->append(sequence, message.integer(Timestamp), sender, text, false);
+            // we notify a new message was received via the messageReceived signal,
+            // one from the history may be older than those already shown
+            emit messageReceived(sender, text, sequence);
         }
-    } else if (typeVal == QLatin1String("message")) { //It's a chat message
-        // we extract the text field containing the chat text
-        const auto textVal = docObj.value(QLatin1String("text")).toString();
-        // we extract the sender field containing the username of the sender
-        const auto senderVal = docObj.value(QLatin1String("sender")).toString();
-        if (!textVal.isEmpty() && !senderVal.isEmpty())
-            // we notify a new message was received via the messageReceived signal
-            emit messageReceived(senderVal, textVal);
-    } else if (typeVal == QLatin1String("newuser")) { // A user joined the chat
-        // we extract the username of the new user
-        const auto usernameVal = docObj.value(QLatin1String("username")).toString();
-        if (!usernameVal.isEmpty())
+        // once caught up, the live messages leave no gap behind them
+        if (m_cache && sequence != 0 && !m_catchingUp)
+            m_cache->setContiguousSequence(sequence);
+    } else if (type == QLatin1String("history")) {
+        // the reply ends a page of history: every message up to resume that we may read has been sent.
+        // Ask for the next one until we have caught up
+        const quint64 resume = quint64(message.integer(Sequence));
+        if (m_cache && message.boolean(Success))
+            m_cache->setContiguousSequence(resume);
+        if (message.boolean(Success) && resume > m_historySince
+                && resume < quint64(message.integer(LatestSequence)))
+            requestHistory(resume);
+        else
+            m_catchingUp = false;
+    } else if (type == QLatin1String("roster") || type == QLatin1String("presence")) {
+        // the users that joined, left or changed since the version we know
+        updateUsers(message, true);
+        m_rosterVersion = quint64(message.integer(RosterVersion));
+    } else if (type == QLatin1String("newuser")) { // A user joined the chat
+        const QString userName = message.string(UserName);
+        const QString uid = message.string(UserUid);
+        if (!userName.isEmpty() && uid != m_uid && !m_users.contains(uid)) {
+            m_users.insert(uid, userName);
             // we notify of the new user via the userJoined signal
-            emit userJoined(usernameVal);
-    } else if (typeVal == QLatin1String("userdisconnected")) { // A user left the chat
-         // we extract the username of the new user
-        const auto usernameVal = docObj.value(QLatin1String("username")).toString();
-        if (!usernameVal.isEmpty())
+            emit userJoined(userName);
+        }
+    } else if (type == QLatin1String("userdisconnected")) { // A user left the chat
+        const QString userName = message.string(UserName);
+        if (m_users.remove(message.string(UserUid)) && !userName.isEmpty())
             // we notify of the user disconnection the userLeft signal
-            emit userLeft(usernameVal);
+            emit userLeft(userName);
+    } else if (type == QLatin1String("resume")) {
+        if (message.boolean(Success)) {
+            // the server goes on counting from what we told it, the reply included
+            m_receivedFrames += m_framesBeforeResume;
+            m_sessionToken = message.string(SessionToken);
+            m_loggedIn = true;
+            m_reconnecting = false;
+            m_reconnectAttempt = 0;
+            // the missed frames follow, the UI carries on as after a login
+            emit loggedIn();
+        } else {
+            // the session is gone, log in again with the same name
+            m_sessionToken.clear();
+            login(m_userName);
+        }
+    } else if (type == QLatin1String("session")) {
+        // the token lets a new connection take this session over
+        m_sessionToken = message.string(SessionToken);
+    } else {
+        // a message of another type was received so we just ignore it
+    }
+    // every change of the user list has its own version, the list is only known up to a gap
+    if (message.contains(RosterVersion) && quint64(message.integer(RosterVersion)) == m_rosterVersion + 1)
+        m_rosterVersion = quint64(message.integer(RosterVersion));
+}
+
+// Takes the whole list of a roster message in place of ours, the differences are notified
+void ChatClient::replaceUsers(const ChatMessage &message)
+{
+    const QHash<QString, QString> previous = m_users;
+    m_users.clear();
+    updateUsers(message, false);
+    for (auto it = previous.cbegin(); it != previous.cend(); ++it) {
+        if (!m_users.contains(it.key()))
+            emit userLeft(it.value());
     }
-    else {
-        // a message with no type was received so we just ignore it
+    for (auto it = m_users.cbegin(); it != m_users.cend(); ++it) {
+        if (!previous.contains(it.key()))
+            emit userJoined(it.value());
+    }
+    m_rosterVersion = quint64(message.integer(RosterVersion));
+}
+
+// Applies the Users ("name\nuid\nstatus") and RemovedUsers (uid) of a roster message
+void ChatClient::updateUsers(const ChatMessage &message, bool notify)
+{
+    const QStringList users = message.list(Users);
+    for (const QString &user : users) {
+        const QStringList fields = user.split(QLatin1Char('\n'));
+        if (fields.size() < 2 || fields.at(1) == m_uid)
+            continue;
+        const bool known = m_users.contains(fields.at(1));
+        m_users.insert(fields.at(1), fields.at(0));
+        if (notify && !known)
+            emit userJoined(fields.at(0));
+    }
+    const QStringList removed = message.list(RemovedUsers);
+    for (const QString &uid : removed) {
+        const QString userName = m_users.take(uid);
+        if (notify && !userName.isEmpty())
+            emit userLeft(userName);
     }
 }
 
 void ChatClient::connectToServer(const QHostAddress &address, quint16 port)
 {
+    // a new connection asked by the user starts a new session
+    m_address = address;
+    m_port = port;
+    m_autoReconnect = false;
+    m_reconnecting = false;
+    m_reconnectAttempt = 0;
+    m_reconnectTimer.stop();
+    m_sessionToken.clear();
+    m_connectTimer.start();
     m_clientSocket->connectToHost(address, port);
 }
 
 void ChatClient::onReadyRead()
 {
-    // prepare a container to hold the UTF-8 encoded JSON we receive from the socket
-    QByteArray jsonData;
-    // create a QDataStream operating on the socket
-    QDataStream socketStream(m_clientSocket);
-    // set the version so that programs compiled with different versions of Qt can agree on how to serialise
-    socketStream.setVersion(QDataStream::Qt_5_7);
-    // start an infinite loop
+    // the parser keeps the partial message of the previous chunk, the new data completes it
+    m_parser.append(m_clientSocket->readAll());
     for (;;) {
-        // we start a transaction so we can revert to the previous state in case we try to read more data than is available on the socket
-        socketStream.startTransaction();
-        // we try to read the JSON data
-        socketStream >> jsonData;
-        if (socketStream.commitTransaction()) {
-            // we successfully read some data
-            // we now need to make sure it's in fact a valid JSON
-            QJsonParseError parseError;
-            // we try to create a json document with the data we received
-            const QJsonDocument jsonDoc = QJsonDocument::fromJson(jsonData, &parseError);
-            if (parseError.error == QJsonParseError::NoError) {
-                // if the data was indeed valid JSON
-                if (jsonDoc.isObject()) // and is a JSON object
-                    jsonReceived(jsonDoc.object()); // parse the JSON
-            }
-            // loop and try to read more JSONs if they are available
-        } else {
-            // the read failed, the socket goes automatically back to the state it was in before the transaction started
-            // we just exit the loop and wait for more data to become available
+        switch (m_parser.next(&m_received)) {
+        case MessageParser::Message:
+            // every frame is counted, the server needs the count to resume the session
+            ++m_receivedFrames;
+            messageReceivedFromServer(m_received);
             break;
+        case MessageParser::NeedMoreData:
+        case MessageParser::EndOfStream:
+            // wait for more data to become available
+            return;
+        case MessageParser::Error:
+            // the stream can not be trusted anymore
+            m_clientSocket->abort();
+            return;
         }
     }
 }
@@ -3,34 +3,81 @@
 
 #include <QObject>
 #include <QTcpSocket>
-class QHostAddress;
-class QJsonDocument;
+#include <QHostAddress>
+#include <QHash>
+#include <QTimer>
+#include <QScopedPointer>
+#include "chatmessage.h"
+#include "messageparser.h"
+class QCborStreamWriter;
+class MessageCache;
 class ChatClient : public QObject
 {
     Q_OBJECT
     Q_DISABLE_COPY(ChatClient)
 public:
     explicit ChatClient(QObject *parent = nullptr);
+    ~ChatClient();
+    void setCache(MessageCache *cache);
+    void setReconnectPolicy(int initialDelay, int maxDelay, int maxAttempts);
+    void setConnectTimeout(int msecs);
 public slots:
     void connectToServer(const QHostAddress &address, quint16 port);
     void login(const QString &userName);
     void sendMessage(const QString &text);
     void disconnectFromHost();
 private slots:
+    void onConnected();
+    void onDisconnected();
+    void onError(QAbstractSocket::SocketError socketError);
     void onReadyRead();
+    void connectTimedOut();
+    void reconnect();
 signals:
     void connected();
     void loggedIn();
     void loginError(const QString &reason);
     void disconnected();
-    void messageReceived(const QString &sender, const QString &text);
+    void messageReceived(const QString &sender, const QString &text, quint64 sequence);
     void error(QAbstractSocket::SocketError socketError);
     void userJoined(const QString &username);
     void userLeft(const QString &username);
+    void reconnecting(int attempt, int delay);
 private:
     QTcpSocket *m_clientSocket;
     bool m_loggedIn;
-    void jsonReceived(const QJsonObject &doc);
+    // the stream of the current connection: one CBOR array, one map per message
+    QScopedPointer<QCborStreamWriter> m_writer;
+    MessageParser m_parser;
+    ChatMessage m_received;
+    QString m_uid;
+    QString m_userName;
+    MessageCache *m_cache;
+    quint64 m_historySince;
+    bool m_catchingUp; // the history since the last login is still being fetched
+    QString m_sessionToken;
+    quint64 m_receivedFrames;
+    quint64 m_framesBeforeResume;
+    quint64 m_rosterVersion;
+    QHash<QString, QString> m_users; // user name by uid
+    void messageReceivedFromServer(const ChatMessage &message);
+    void updateUsers(const ChatMessage &message, bool notify);
+    void replaceUsers(const ChatMessage &message);
+    void requestHistory(quint64 since);
+    void resumeSession();
+    void scheduleReconnect();
+
+    // automatic reconnection, once logged in the client comes back by itself when the connection drops
+    QHostAddress m_address;
+    quint16 m_port;
+    QTimer m_connectTimer;
+    QTimer m_reconnectTimer;
+    bool m_autoReconnect;
+    bool m_reconnecting; // the current connection was opened by the client itself
+    int m_reconnectAttempt;
+    int m_initialReconnectDelay;
+    int m_maxReconnectDelay;
+    int m_maxReconnectAttempts;
 };
 
 #endif // CHATCLIENT_H
@@ -0,0 +1,330 @@
+#include "chathistorymodel.h"
+#include <QBrush>
+#include <QFont>
+
+// rows kept unless the settings say otherwise
+constexpr int DEFAULT_RETENTION = 5000;
+constexpr int MIN_RETENTION = 100;
+// new rows are inserted at most once per frame
+constexpr int FLUSH_INTERVAL = 16; // ms
+// older messages asked to the source at once
+constexpr int FETCH_PAGE = 100;
+
+ChatHistoryModel::ChatHistoryModel(QObject *parent)
+    : QAbstractListModel(parent)
+    , m_ring(DEFAULT_RETENTION)
+{
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FLUSH_INTERVAL);
+    connect(&m_flushTimer, &QTimer::timeout, this, &ChatHistoryModel::flush);
+}
+
+int ChatHistoryModel::retention() const
+{
+    return m_ring.size();
+}
+
+// Keeps the newest rows that fit
+void ChatHistoryModel::setRetention(int rows)
+{
+    rows = qMax(rows, MIN_RETENTION);
+    if (rows == m_ring.size())
+        return;
+    flush();
+    beginResetModel();
+    QVector<Row> ring(rows);
+    int first = qMax(0, m_count - rows);
+    // a message is not kept without the name above it
+    while (first < m_count && row(first).kind == Incoming)
+        ++first;
+    for (int i = first; i < m_count; ++i)
+        ring[i - first] = row(i);
+    m_ring = ring;
+    m_head = 0;
+    m_count -= first;
+    endResetModel();
+}
+
+// position is where the source ends, the messages before it are older than the model
+void ChatHistoryModel::setSource(ChatHistorySource *source, quint64 position)
+{
+    m_source = source;
+    m_sourcePosition = source ? position : 0;
+}
+
+void ChatHistoryModel::addMessage(const QString &sender, const QString &text, quint64 sequence)
+{
+    if (sequence != 0 && sequence < m_lastSequence) {
+        // a message missed while offline, fetched after newer ones came
+        insertMessage(sender, text, sequence);
+        return;
+    }
+    if (sequence != 0)
+        m_lastSequence = sequence;
+    appendRows(&m_pending, &m_lastSender, HistoryMessage{sender, text, false, sequence});
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+void ChatHistoryModel::addOwnMessage(const QString &text)
+{
+    appendRows(&m_pending, &m_lastSender, HistoryMessage{QString(), text, true});
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+void ChatHistoryModel::addUserJoined(const QString &userName)
+{
+    enqueue(Joined, userName);
+}
+
+void ChatHistoryModel::addUserLeft(const QString &userName)
+{
+    enqueue(Left, userName);
+}
+
+// The next message shows the name of its sender again, e.g. after the connection was lost
+void ChatHistoryModel::breakSenderBlock()
+{
+    m_lastSender.clear();
+}
+
+bool ChatHistoryModel::canFetchOlder() const
+{
+    return m_source && m_sourcePosition > 0 && m_count < m_ring.size();
+}
+
+// Prepends a page of older messages, returns the number of rows inserted
+int ChatHistoryModel::fetchOlder()
+{
+    if (!canFetchOlder())
+        return 0;
+    const QVector<HistoryMessage> messages =
+            m_source->messagesBefore(&m_sourcePosition, qMin(FETCH_PAGE, m_ring.size() - m_count));
+    QVector<Row> rows;
+    rows.reserve(messages.size() * 2);
+    QString lastSender;
+    for (const HistoryMessage &message : messages)
+        appendRows(&rows, &lastSender, message);
+    if (rows.isEmpty())
+        return 0;
+
+    // the first row repeats the name above the last fetched message
+    if (m_count > 0 && !lastSender.isEmpty() && row(0).kind == Sender && row(0).text == lastSender) {
+        beginRemoveRows(QModelIndex(), 0, 0);
+        m_ring[m_head] = Row();
+        m_head = (m_head + 1) % m_ring.size();
+        --m_count;
+        endRemoveRows();
+    }
+    // the names added may not fit, the oldest messages go then
+    const int room = m_ring.size() - m_count;
+    if (rows.size() > room) {
+        int excess = rows.size() - room;
+        while (excess < rows.size() && rows.at(excess).kind == Incoming)
+            ++excess;
+        rows.remove(0, excess);
+        if (rows.isEmpty())
+            return 0;
+    }
+
+    const int count = rows.size();
+    beginInsertRows(QModelIndex(), 0, count - 1);
+    m_head = (m_head - count + m_ring.size()) % m_ring.size();
+    for (int i = 0; i < count; ++i)
+        m_ring[(m_head + i) % m_ring.size()] = rows.at(i);
+    m_count += count;
+    endInsertRows();
+    return count;
+}
+
+int ChatHistoryModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_count;
+}
+
+QVariant ChatHistoryModel::data(const QModelIndex &index, int role) const
+{
+    if (!index.isValid() || index.row() >= m_count)
+        return QVariant();
+    const Row &line = row(index.row());
+    switch (role) {
+    case Qt::DisplayRole:
+        switch (line.kind) {
+        case Sender:
+            return QString(line.text + QLatin1Char(':'));
+        case Joined:
+            return tr("%1 Joined the Chat").arg(line.text);
+        case Left:
+            return tr("%1 Left the Chat").arg(line.text);
+        default:
+            return line.text;
+        }
+    case Qt::TextAlignmentRole:
+        if (line.kind == Outgoing)
+            return int(Qt::AlignRight | Qt::AlignVCenter);
+        if (line.kind == Joined || line.kind == Left)
+            return int(Qt::AlignCenter);
+        return int(Qt::AlignLeft | Qt::AlignVCenter);
+    case Qt::FontRole:
+        if (line.kind == Sender) {
+            QFont boldFont;
+            boldFont.setBold(true);
+            return boldFont;
+        }
+        return QVariant();
+    case Qt::ForegroundRole:
+        if (line.kind == Joined)
+            return QBrush(Qt::blue);
+        if (line.kind == Left)
+            return QBrush(Qt::red);
+        return QVariant();
+    default:
+        return QVariant();
+    }
+}
+
+const ChatHistoryModel::Row &ChatHistoryModel::row(int index) const
+{
+    return m_ring.at((m_head + index) % m_ring.size());
+}
+
+void ChatHistoryModel::enqueue(Kind kind, const QString &text)
+{
+    m_pending.append(Row{text, kind, 0});
+    m_lastSender.clear();
+    if (!m_flushTimer.isActive())
+        m_flushTimer.start();
+}
+
+// Inserts the queued rows at once, the oldest rows make room for them
+void ChatHistoryModel::flush()
+{
+    m_flushTimer.stop();
+    if (m_pending.isEmpty())
+        return;
+    const int capacity = m_ring.size();
+    if (m_pending.size() > capacity) {
+        int excess = m_pending.size() - capacity;
+        while (excess < m_pending.size() && m_pending.at(excess).kind == Incoming)
+            ++excess;
+        m_pending.remove(0, excess);
+    }
+    const int overflow = m_count + m_pending.size() - capacity;
+    if (overflow > 0)
+        dropFront(overflow);
+
+    if (!m_pending.isEmpty()) {
+        beginInsertRows(QModelIndex(), m_count, m_count + m_pending.size() - 1);
+        for (const Row &line : qAsConst(m_pending))
+            m_ring[(m_head + m_count++) % capacity] = line;
+        endInsertRows();
+    }
+    m_pending.clear();
+    emit rowsFlushed();
+}
+
+// Removes at least count rows from the top, and the messages left without their name
+void ChatHistoryModel::dropFront(int count)
+{
+    count = qMin(count, m_count);
+    while (count < m_count && row(count).kind == Incoming)
+        ++count;
+    if (count == 0)
+        return;
+    beginRemoveRows(QModelIndex(), 0, count - 1);
+    for (int i = 0; i < count; ++i)
+        m_ring[(m_head + i) % m_ring.size()] = Row();
+    m_head = (m_head + count) % m_ring.size();
+    m_count -= count;
+    endRemoveRows();
+}
+
+// Puts a message before the received ones with a higher sequence at the end of the chat,
+// under the name of its sender unless it joins a block of theirs
+void ChatHistoryModel::insertMessage(const QString &sender, const QString &text, quint64 sequence)
+{
+    flush();
+    int position = m_count;
+    for (int i = m_count - 1; i >= 0; --i) {
+        const Row &line = row(i);
+        if (line.kind != Incoming || line.sequence == 0)
+            continue;
+        if (line.sequence == sequence)
+            return; // already shown
+        if (line.sequence < sequence)
+            break;
+        position = i;
+    }
+    if (position == m_count) {
+        // the newer messages are no longer kept
+        appendRows(&m_pending, &m_lastSender, HistoryMessage{sender, text, false, sequence});
+        flush();
+        return;
+    }
+
+    // position is a received message, it may be the first of its block or not
+    const QString next = senderOf(position);
+    QVector<Row> rows;
+    int at = position;
+    if (next == sender) {
+        rows.append(Row{text, Incoming, sequence});
+    } else if (position > 0 && row(position - 1).kind == Sender) {
+        at = position - 1;
+        if (at == 0 || row(at - 1).kind != Incoming || senderOf(at - 1) != sender)
+            rows.append(Row{sender, Sender, 0});
+        rows.append(Row{text, Incoming, sequence});
+    } else {
+        // the block is split, its messages after this one get their name again
+        rows.append(Row{sender, Sender, 0});
+        rows.append(Row{text, Incoming, sequence});
+        if (!next.isEmpty())
+            rows.append(Row{next, Sender, 0});
+    }
+
+    const int capacity = m_ring.size();
+    const int overflow = m_count + rows.size() - capacity;
+    if (overflow > 0) {
+        const int before = m_count;
+        dropFront(overflow);
+        at -= before - m_count;
+        if (at < 0)
+            return; // older than everything kept
+    }
+    const int count = rows.size();
+    beginInsertRows(QModelIndex(), at, at + count - 1);
+    for (int i = m_count - 1; i >= at; --i)
+        m_ring[(m_head + i + count) % capacity] = row(i);
+    for (int i = 0; i < count; ++i)
+        m_ring[(m_head + at + i) % capacity] = rows.at(i);
+    m_count += count;
+    endInsertRows();
+}
+
+// The name above the received message at index
+QString ChatHistoryModel::senderOf(int index) const
+{
+    for (int i = index; i >= 0; --i) {
+        const Row &line = row(i);
+        if (line.kind == Sender)
+            return line.text;
+        if (line.kind != Incoming)
+            break;
+    }
+    return QString();
+}
+
+// The rows of a message: its text, after the name of the sender if the previous row is not theirs
+void ChatHistoryModel::appendRows(QVector<Row> *rows, QString *lastSender, const HistoryMessage &message)
+{
+    if (message.outgoing) {
+        rows->append(Row{message.text, Outgoing, 0});
+        lastSender->clear();
+        return;
+    }
+    if (*lastSender != message.sender) {
+        rows->append(Row{message.sender, Sender, 0});
+        *lastSender = message.sender;
+    }
+    rows->append(Row{message.text, Incoming, message.sequence});
+}
@@ -0,0 +1,84 @@
+#ifndef CHATHISTORYMODEL_H
+#define CHATHISTORYMODEL_H
+
+#include <QAbstractListModel>
+#include <QTimer>
+#include <QVector>
+
+struct HistoryMessage
+{
+    QString sender;
+    QString text;
+    bool outgoing; // sent by this client
+    quint64 sequence; // given by the server, 0 if unknown
+};
+
+// Where the messages older than the model come from, e.g. a local cache
+class ChatHistorySource
+{
+public:
+    virtual ~ChatHistorySource() = default;
+    // Up to count messages before *position, oldest first.
+    // *position moves to the first one returned, 0 once there is nothing older
+    virtual QVector<HistoryMessage> messagesBefore(quint64 *position, int count) = 0;
+};
+
+// The lines shown in the chat view, kept in a ring buffer of retention() rows:
+// the oldest rows make way for the new ones.
+// New rows are queued and inserted together at most once every FLUSH_INTERVAL ms,
+// rowsFlushed() tells the view when to scroll.
+// fetchOlder() prepends a page of older messages from the source while there is room.
+// A received message older than the last one shown is put back in sequence order
+class ChatHistoryModel : public QAbstractListModel
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ChatHistoryModel)
+public:
+    explicit ChatHistoryModel(QObject *parent = nullptr);
+    int retention() const;
+    void setRetention(int rows);
+    void setSource(ChatHistorySource *source, quint64 position);
+    void addMessage(const QString &sender, const QString &text, quint64 sequence = 0);
+    void addOwnMessage(const QString &text);
+    void addUserJoined(const QString &userName);
+    void addUserLeft(const QString &userName);
+    void breakSenderBlock();
+    bool canFetchOlder() const;
+    int fetchOlder();
+    int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &index, int role = Qt::DisplayRole) const override;
+signals:
+    void rowsFlushed();
+private:
+    enum Kind : quint8 {
+        Sender,   // the name above the messages of a user
+        Incoming,
+        Outgoing,
+        Joined,
+        Left
+    };
+    struct Row {
+        QString text;
+        Kind kind;
+        quint64 sequence; // of the Incoming rows, 0 if unknown
+    };
+    const Row &row(int index) const;
+    void enqueue(Kind kind, const QString &text);
+    void flush();
+    void dropFront(int count);
+    void insertMessage(const QString &sender, const QString &text, quint64 sequence);
+    QString senderOf(int index) const;
+    static void appendRows(QVector<Row> *rows, QString *lastSender, const HistoryMessage &message);
+
+    QVector<Row> m_ring;
+    int m_head{0};
+    int m_count{0};
+    QVector<Row> m_pending;
+    QString m_lastSender; // sender of the last row, queued ones included, empty after any other row
+    QTimer m_flushTimer;
+    quint64 m_lastSequence{0}; // highest sequence appended
+    ChatHistorySource *m_source{nullptr};
+    quint64 m_sourcePosition{0};
+};
+
+#endif // CHATHISTORYMODEL_H
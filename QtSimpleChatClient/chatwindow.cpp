@@ -1,32 +1,52 @@
 #include "chatwindow.h"
 #include "ui_chatwindow.h"
 #include "chatclient.h"
-#include <QStandardItemModel>
+#include "enums.h"
+#include "chathistorymodel.h"
+#include "messagecache.h"
+#include <QScrollBar>
 #include <QInputDialog>
 #include <QMessageBox>
 #include <QHostAddress>
 #include <QSettings>
-
-constexpr int SERVER_PORT = 1967;
+#include <QStandardPaths>
+#include <QTimer>
 
 ChatWindow::ChatWindow(QWidget *parent)
     : QWidget(parent)
     , ui(new Ui::ChatWindow) // create the elements defined in the .ui file
     , m_chatClient(new ChatClient(this)) // create the chat client
-    , m_chatModel(new QStandardItemModel(this)) // create the model to hold the messages
+    , m_chatModel(new ChatHistoryModel(this)) // create the model to hold the messages
+    , m_messageCache(new MessageCache) // create the local copy of the chat
 {
     // set up of the .ui file
     ui->setupUi(this);
-    // the model for the messages will have 1 column
-    m_chatModel->insertColumn(0);
-    // set the model as the data source vor the list view
+    // the number of lines kept can be changed in the settings
+    QSettings se;
+    m_chatModel->setRetention(se.value(QStringLiteral("history_retention"), m_chatModel->retention()).toInt());
+    // set the model as the data source vor the list view, every line has the same height
+    ui->chatView->setUniformItemSizes(true);
     ui->chatView->setModel(m_chatModel);
+    // scroll the view once for every batch of new lines
+    connect(m_chatModel, &ChatHistoryModel::rowsFlushed, ui->chatView, &QListView::scrollToBottom);
+    // load older messages when the view reaches the top
+    connect(ui->chatView->verticalScrollBar(), &QScrollBar::valueChanged, this, &ChatWindow::chatScrolled);
+    // show the end of the previous chat right away, only the last page of the cache is read
+    const QString cacheFile = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation)
+            + QStringLiteral("/messages.cache");
+    if (m_messageCache->open(cacheFile)) {
+        m_chatClient->setCache(m_messageCache);
+        m_chatModel->setSource(m_messageCache, m_messageCache->end());
+        m_chatModel->fetchOlder();
+        QTimer::singleShot(0, ui->chatView, &QListView::scrollToBottom);
+    }
     // connect the signals from the chat client to the slots in this ui
     connect(m_chatClient, &ChatClient::connected, this, &ChatWindow::connectedToServer);
     connect(m_chatClient, &ChatClient::loggedIn, this, &ChatWindow::loggedIn);
     connect(m_chatClient, &ChatClient::loginError, this, &ChatWindow::loginFailed);
     connect(m_chatClient, &ChatClient::messageReceived, this, &ChatWindow::messageReceived);
     connect(m_chatClient, &ChatClient::disconnected, this, &ChatWindow::disconnectedFromServer);
+    connect(m_chatClient, &ChatClient::reconnecting, this, &ChatWindow::reconnecting);
     connect(m_chatClient, &ChatClient::error, this, &ChatWindow::error);
     connect(m_chatClient, &ChatClient::userJoined, this, &ChatWindow::userJoined);
     connect(m_chatClient, &ChatClient::userLeft, this, &ChatWindow::userLeft);
@@ -41,6 +61,8 @@ ChatWindow::~ChatWindow()
 {
     // delete the elements created from the .ui file
     delete ui;
+    m_chatClient->setCache(nullptr);
+    delete m_messageCache;
 }
 
 void ChatWindow::attemptConnection()
@@ -91,8 +113,7 @@ void ChatWindow::loggedIn()
     ui->sendButton->setEnabled(true);
     ui->messageEdit->setEnabled(true);
     ui->chatView->setEnabled(true);
-    // clear the user name record
-    m_lastUserName.clear();
+    ui->messageEdit->setPlaceholderText(QString());
 }
 
 void ChatWindow::loginFailed(const QString &reason)
@@ -104,36 +125,11 @@ void ChatWindow::loginFailed(const QString &reason)
     connectedToServer();
 }
 
-void ChatWindow::messageReceived(const QString &sender, const QString &text)
+void ChatWindow::messageReceived(const QString &sender, const QString &text, quint64 sequence)
 {
-    // store the index of the new row to append to the model containing the messages
-    int newRow = m_chatModel->rowCount();
-    // we display a line containing the username only if it's different from the last username we displayed
-    if (m_lastUserName != sender) {
-        // store the last displayed username
-        m_lastUserName = sender;
-        // create a bold default font
-        QFont boldFont;
-        boldFont.setBold(true);
-        // insert 2 row, one for the message and one for the username
-        m_chatModel->insertRows(newRow, 2);
-        // store the username in the model
-        m_chatModel->setData(m_chatModel->index(newRow, 0), sender + QLatin1Char(':'));
-        // set the alignment for the username
-        m_chatModel->setData(m_chatModel->index(newRow, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
-        // set the for the username
-        m_chatModel->setData(m_chatModel->index(newRow, 0), boldFont, Qt::FontRole);
-        ++newRow;
-    } else {
-        // insert a row for the message
-        m_chatModel->insertRow(newRow);
-    }
-    // store the message in the model
-    m_chatModel->setData(m_chatModel->index(newRow, 0), text);
-    // set the alignment for the message
-    m_chatModel->setData(m_chatModel->index(newRow, 0), int(Qt::AlignLeft | Qt::AlignVCenter), Qt::TextAlignmentRole);
-    // scroll the view to display the new message
-    ui->chatView->scrollToBottom();
+    // the model shows the name of the sender above the first of their messages in a row,
+    // a message fetched late goes back to its place
+    m_chatModel->addMessage(sender, text, sequence);
 }
 
 void ChatWindow::sendMessage()
@@ -141,20 +137,9 @@ void ChatWindow::sendMessage()
     // we use the client to send the message that the user typed
     m_chatClient->sendMessage(ui->messageEdit->text());
     // now we add the message to the list
-    // store the index of the new row to append to the model containing the messages
-    const int newRow = m_chatModel->rowCount();
-    // insert a row for the message
-    m_chatModel->insertRow(newRow);
-    // store the message in the model
-    m_chatModel->setData(m_chatModel->index(newRow, 0), ui->messageEdit->text());
-    // set the alignment for the message
-    m_chatModel->setData(m_chatModel->index(newRow, 0), int(Qt::AlignRight | Qt::AlignVCenter), Qt::TextAlignmentRole);
+    m_chatModel->addOwnMessage(ui->messageEdit->text());
     // clear the content of the message editor
     ui->messageEdit->clear();
-    // scroll the view to display the new message
-    ui->chatView->scrollToBottom();
-    // reset the last printed username
-    m_lastUserName.clear();
 }
 
 void ChatWindow::disconnectedFromServer()
@@ -165,46 +150,34 @@ void ChatWindow::disconnectedFromServer()
     // disable the ui to send and display messages
     ui->sendButton->setEnabled(false);
     ui->messageEdit->setEnabled(false);
+    ui->messageEdit->setPlaceholderText(QString());
     ui->chatView->setEnabled(false);
+    // the messages of the next session do not continue the last block
+    m_chatModel->breakSenderBlock();
     // enable the button to connect to the server again
     ui->connectButton->setEnabled(true);
-    // reset the last printed username
-    m_lastUserName.clear();
+}
+
+void ChatWindow::reconnecting(int attempt, int delay)
+{
+    // the client comes back by itself, no need to bother the user with a message box
+    ui->sendButton->setEnabled(false);
+    ui->messageEdit->setEnabled(false);
+    m_chatModel->breakSenderBlock();
+    ui->messageEdit->setPlaceholderText(tr("Connection lost, reconnecting in %1 s (attempt %2)")
+                                        .arg((delay + 999) / 1000).arg(attempt));
 }
 
 void ChatWindow::userJoined(const QString &username)
 {
-    // store the index of the new row to append to the model containing the messages
-    const int newRow = m_chatModel->rowCount();
-    // insert a row
-    m_chatModel->insertRow(newRow);
-    // store in the model the message to comunicate a user joined
-    m_chatModel->setData(m_chatModel->index(newRow, 0), tr("%1 Joined the Chat").arg(username));
-    // set the alignment for the text
-    m_chatModel->setData(m_chatModel->index(newRow, 0), Qt::AlignCenter, Qt::TextAlignmentRole);
-    // set the color for the text
-    m_chatModel->setData(m_chatModel->index(newRow, 0), QBrush(Qt::blue), Qt::ForegroundRole);
-    // scroll the view to display the new message
-    ui->chatView->scrollToBottom();
-    // reset the last printed username
-    m_lastUserName.clear();
+    // the model shows a line to comunicate a user joined
+    m_chatModel->addUserJoined(username);
 }
+
 void ChatWindow::userLeft(const QString &username)
 {
-    // store the index of the new row to append to the model containing the messages
-    const int newRow = m_chatModel->rowCount();
-    // insert a row
-    m_chatModel->insertRow(newRow);
-    // store in the model the message to comunicate a user left
-    m_chatModel->setData(m_chatModel->index(newRow, 0), tr("%1 Left the Chat").arg(username));
-    // set the alignment for the text
-    m_chatModel->setData(m_chatModel->index(newRow, 0), Qt::AlignCenter, Qt::TextAlignmentRole);
-    // set the color for the text
-    m_chatModel->setData(m_chatModel->index(newRow, 0), QBrush(Qt::red), Qt::ForegroundRole);
-    // scroll the view to display the new message
-    ui->chatView->scrollToBottom();
-    // reset the last printed username
-    m_lastUserName.clear();
+    // the model shows a line to comunicate a user left
+    m_chatModel->addUserLeft(username);
 }
 
 void ChatWindow::error(QAbstractSocket::SocketError socketError)
@@ -234,7 +207,7 @@ void ChatWindow::error(QAbstractSocket::SocketError socketError)
         break;
     case QAbstractSocket::SocketTimeoutError:
         QMessageBox::warning(this, tr("Error"), tr("Operation timed out"));
-        return;
+        break;
     case QAbstractSocket::ProxyConnectionTimeoutError:
         QMessageBox::critical(this, tr("Error"), tr("Proxy timed out"));
         break;
@@ -266,6 +239,15 @@ void ChatWindow::error(QAbstractSocket::SocketError socketError)
     ui->sendButton->setEnabled(false);
     ui->messageEdit->setEnabled(false);
     ui->chatView->setEnabled(false);
-    // reset the last printed username
-    m_lastUserName.clear();
+}
+
+void ChatWindow::chatScrolled(int value)
+{
+    if (value != ui->chatView->verticalScrollBar()->minimum() || !m_chatModel->canFetchOlder())
+        return;
+    // the older lines go above the top one, it stays where it is
+    const QModelIndex top = ui->chatView->indexAt(QPoint(0, 0));
+    const int inserted = m_chatModel->fetchOlder();
+    if (inserted > 0 && top.isValid())
+        ui->chatView->scrollTo(m_chatModel->index(top.row() + inserted), QAbstractItemView::PositionAtTop);
 }
@@ -4,7 +4,8 @@
 #include <QWidget>
 #include <QAbstractSocket>
 class ChatClient;
-class QStandardItemModel;
+class ChatHistoryModel;
+class MessageCache;
 namespace Ui { class ChatWindow; }
 class ChatWindow : public QWidget
 {
@@ -16,19 +17,21 @@ public:
 private:
     Ui::ChatWindow *ui;
     ChatClient *m_chatClient;
-    QStandardItemModel *m_chatModel;
-    QString m_lastUserName;
+    ChatHistoryModel *m_chatModel;
+    MessageCache *m_messageCache;
 private slots:
     void attemptConnection();
     void connectedToServer();
     void loggedIn();
     void loginFailed(const QString &reason);
-    void messageReceived(const QString &sender, const QString &text);
+    void messageReceived(const QString &sender, const QString &text, quint64 sequence);
     void sendMessage();
     void disconnectedFromServer();
+    void reconnecting(int attempt, int delay);
     void userJoined(const QString &username);
     void userLeft(const QString &username);
     void error(QAbstractSocket::SocketError socketError);
+    void chatScrolled(int value);
 };
 
 #endif // CHATWINDOW_H
@@ -0,0 +1,288 @@
+#include "messagecache.h"
+#include <QDir>
+#include <QFileInfo>
+#include <cstring>
+#include <algorithm>
+
+// the file grows by this much when it is full
+constexpr qint64 GROW_SIZE = 1024 * 1024;
+// a bigger file keeps only its newest COMPACTED_SIZE bytes of messages
+constexpr qint64 MAX_CACHE_SIZE = 32 * 1024 * 1024;
+constexpr qint64 COMPACTED_SIZE = MAX_CACHE_SIZE / 2;
+constexpr quint64 CACHE_MAGIC = Q_UINT64_C(0x3130454843414353);
+
+struct CacheHeader
+{
+    quint64 magic;
+    quint64 end; // of the last record, moved once the record is written
+    quint64 lastSequence;
+    quint64 contiguousSequence; // every readable message up to it is here
+};
+
+// Followed by the UTF-8 sender and text, and by a copy of size at the very end.
+// The sender of a message sent by this client is the uid it was sent with, which the name is not
+// enough to tell apart
+struct CacheRecord
+{
+    quint32 size; // of the whole record
+    quint32 outgoing;
+    quint64 sequence; // 0 for the messages sent by this client
+    qint64 timestamp;
+    quint32 senderSize;
+    quint32 textSize;
+};
+
+constexpr qint64 HEADER_SIZE = sizeof(CacheHeader);
+
+static qint64 recordSize(qint64 senderSize, qint64 textSize)
+{
+    // records are 8 bytes aligned, so the headers can be read in place
+    return (qint64(sizeof(CacheRecord)) + senderSize + textSize + qint64(sizeof(quint32)) + 7) & ~qint64(7);
+}
+
+static CacheHeader *cacheHeader(uchar *data)
+{
+    return reinterpret_cast<CacheHeader *>(data);
+}
+
+MessageCache::~MessageCache()
+{
+    close();
+}
+
+// A file that is not a cache is started again
+bool MessageCache::open(const QString &fileName)
+{
+    close();
+    if (!QDir().mkpath(QFileInfo(fileName).absolutePath()))
+        return false;
+    m_file.setFileName(fileName);
+    if (!m_file.open(QIODevice::ReadWrite))
+        return false;
+    const qint64 size = m_file.size();
+    bool valid = size >= HEADER_SIZE && map(size);
+    if (valid) {
+        const CacheHeader *header = cacheHeader(m_data);
+        valid = header->magic == CACHE_MAGIC && header->end >= quint64(HEADER_SIZE) && header->end <= quint64(size);
+    }
+    // the files written before contiguousSequence was kept had no gap to fill
+    if (valid && cacheHeader(m_data)->contiguousSequence == 0)
+        cacheHeader(m_data)->contiguousSequence = cacheHeader(m_data)->lastSequence;
+    if ((!valid && !initialize()) || (end() > quint64(MAX_CACHE_SIZE) && !compact())) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MessageCache::close()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+    m_data = nullptr;
+    m_mappedSize = 0;
+    m_file.close();
+    m_sequences.clear();
+    m_senderUids.clear();
+    m_indexed = false;
+}
+
+bool MessageCache::isOpen() const
+{
+    return m_data != nullptr;
+}
+
+// The position after the newest message
+quint64 MessageCache::end() const
+{
+    return m_data ? cacheHeader(m_data)->end : 0;
+}
+
+quint64 MessageCache::lastSequence() const
+{
+    return m_data ? cacheHeader(m_data)->lastSequence : 0;
+}
+
+quint64 MessageCache::contiguousSequence() const
+{
+    return m_data ? cacheHeader(m_data)->contiguousSequence : 0;
+}
+
+// Notes that no message up to sequence is missing, the mark never moves back
+void MessageCache::setContiguousSequence(quint64 sequence)
+{
+    if (m_data)
+        cacheHeader(m_data)->contiguousSequence = qMax(cacheHeader(m_data)->contiguousSequence, sequence);
+}
+
+bool MessageCache::contains(quint64 sequence)
+{
+    // the messages mostly come in order, only an older one needs the index
+    if (sequence == 0 || sequence > lastSequence())
+        return false;
+    if (!m_indexed)
+        buildIndex();
+    return m_sequences.contains(sequence);
+}
+
+// Whether a message was sent by this client with uid, its own messages come back in the history
+bool MessageCache::sentFrom(const QString &uid)
+{
+    if (uid.isEmpty() || !m_data)
+        return false;
+    if (!m_indexed)
+        buildIndex();
+    return m_senderUids.contains(uid);
+}
+
+bool MessageCache::append(quint64 sequence, qint64 timestamp, const QString &sender, const QString &text, bool outgoing)
+{
+    if (!m_data)
+        return false;
+    const QByteArray senderBytes = sender.toUtf8();
+    const QByteArray textBytes = text.toUtf8();
+    const qint64 size = recordSize(senderBytes.size(), textBytes.size());
+    const qint64 offset = qint64(end());
+    if (offset + size > m_mappedSize && !map((offset + size + GROW_SIZE - 1) / GROW_SIZE * GROW_SIZE))
+        return false;
+
+    uchar *data = m_data + offset;
+    CacheRecord *record = reinterpret_cast<CacheRecord *>(data);
+    record->size = quint32(size);
+    record->outgoing = outgoing ? 1 : 0;
+    record->sequence = sequence;
+    record->timestamp = timestamp;
+    record->senderSize = quint32(senderBytes.size());
+    record->textSize = quint32(textBytes.size());
+    data += sizeof(CacheRecord);
+    memcpy(data, senderBytes.constData(), size_t(senderBytes.size()));
+    memcpy(data + senderBytes.size(), textBytes.constData(), size_t(textBytes.size()));
+    const quint32 trailer = quint32(size);
+    memcpy(m_data + offset + size - sizeof(quint32), &trailer, sizeof(trailer));
+
+    CacheHeader *header = cacheHeader(m_data);
+    header->end = quint64(offset + size);
+    if (sequence != 0) {
+        header->lastSequence = qMax(header->lastSequence, sequence);
+        if (m_indexed)
+            m_sequences.insert(sequence);
+    }
+    if (outgoing && m_indexed)
+        m_senderUids.insert(sender);
+    return true;
+}
+
+// Reads back from the end of the records, a damaged record hides the older ones
+QVector<HistoryMessage> MessageCache::messagesBefore(quint64 *position, int count)
+{
+    QVector<HistoryMessage> messages;
+    qint64 pos = qMin<qint64>(qint64(*position), qint64(end()));
+    for (; count > 0 && pos > HEADER_SIZE; --count) {
+        const qint64 start = recordStart(pos);
+        if (start < 0) {
+            pos = HEADER_SIZE;
+            break;
+        }
+        const CacheRecord *record = reinterpret_cast<const CacheRecord *>(m_data + start);
+        const char *bytes = reinterpret_cast<const char *>(record + 1);
+        messages.append(HistoryMessage{QString::fromUtf8(bytes, int(record->senderSize)),
+                                       QString::fromUtf8(bytes + record->senderSize, int(record->textSize)),
+                                       record->outgoing != 0, record->sequence});
+        pos = start;
+    }
+    std::reverse(messages.begin(), messages.end());
+    *position = pos > HEADER_SIZE ? quint64(pos) : 0;
+    return messages;
+}
+
+bool MessageCache::map(qint64 size)
+{
+    if (m_data)
+        m_file.unmap(m_data);
+    m_data = nullptr;
+    m_mappedSize = 0;
+    // the grown part is zero filled
+    if (m_file.size() < size && !m_file.resize(size))
+        return false;
+    m_data = m_file.map(0, size);
+    if (!m_data)
+        return false;
+    m_mappedSize = size;
+    return true;
+}
+
+bool MessageCache::initialize()
+{
+    if (m_data)
+        m_file.unmap(m_data);
+    m_data = nullptr;
+    if (!m_file.resize(0) || !map(GROW_SIZE))
+        return false;
+    *cacheHeader(m_data) = CacheHeader{CACHE_MAGIC, quint64(HEADER_SIZE), 0, 0};
+    m_sequences.clear();
+    m_senderUids.clear();
+    m_indexed = false;
+    return true;
+}
+
+// Starts the file again with its newest messages only
+bool MessageCache::compact()
+{
+    const qint64 last = qint64(end());
+    qint64 start = last;
+    while (start > HEADER_SIZE && last - start < COMPACTED_SIZE) {
+        const qint64 previous = recordStart(start);
+        if (previous < 0)
+            break;
+        start = previous;
+    }
+    const QByteArray records(reinterpret_cast<const char *>(m_data + start), int(last - start));
+    const quint64 lastSequence = cacheHeader(m_data)->lastSequence;
+    const quint64 contiguousSequence = cacheHeader(m_data)->contiguousSequence;
+    if (!initialize())
+        return false;
+    if (HEADER_SIZE + records.size() > m_mappedSize
+            && !map((HEADER_SIZE + records.size() + GROW_SIZE - 1) / GROW_SIZE * GROW_SIZE))
+        return false;
+    memcpy(m_data + HEADER_SIZE, records.constData(), size_t(records.size()));
+    CacheHeader *header = cacheHeader(m_data);
+    header->end = quint64(HEADER_SIZE + records.size());
+    header->lastSequence = lastSequence;
+    header->contiguousSequence = contiguousSequence;
+    return true;
+}
+
+// The start of the record ending at end, -1 if it does not look like one
+qint64 MessageCache::recordStart(qint64 end) const
+{
+    if (end - HEADER_SIZE < qint64(sizeof(CacheRecord) + sizeof(quint32)))
+        return -1;
+    quint32 size;
+    memcpy(&size, m_data + end - sizeof(quint32), sizeof(size));
+    if (size < sizeof(CacheRecord) + sizeof(quint32) || size % 8 != 0 || qint64(size) > end - HEADER_SIZE)
+        return -1;
+    const qint64 start = end - size;
+    const CacheRecord *record = reinterpret_cast<const CacheRecord *>(m_data + start);
+    if (record->size != size || recordSize(record->senderSize, record->textSize) != size)
+        return -1;
+    return start;
+}
+
+void MessageCache::buildIndex()
+{
+    m_sequences.clear();
+    m_senderUids.clear();
+    const qint64 last = qint64(end());
+    qint64 offset = HEADER_SIZE;
+    while (offset + qint64(sizeof(CacheRecord)) <= last) {
+        const CacheRecord *record = reinterpret_cast<const CacheRecord *>(m_data + offset);
+        if (record->size < sizeof(CacheRecord) || offset + record->size > last)
+            break;
+        if (record->sequence != 0)
+            m_sequences.insert(record->sequence);
+        if (record->outgoing)
+            m_senderUids.insert(QString::fromUtf8(reinterpret_cast<const char *>(record + 1), int(record->senderSize)));
+        offset += record->size;
+    }
+    m_indexed = true;
+}
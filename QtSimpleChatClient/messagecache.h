@@ -0,0 +1,49 @@
+#ifndef MESSAGECACHE_H
+#define MESSAGECACHE_H
+
+#include <QFile>
+#include <QSet>
+#include <QString>
+#include "chathistorymodel.h"
+
+// Local append-only copy of the chat, kept in a memory-mapped file.
+// Every record ends with its size, so the newest messages are read walking back from
+// the end without going through the rest of the file.
+// The file header keeps the highest sequence stored and the one up to which no message is missing,
+// the set of the stored sequences is only built the first time an older one has to be looked up.
+// Only that second one tells what to ask for after a login: the live messages may come before
+// the history of the gap has been fetched.
+// A file grown past MAX_CACHE_SIZE is cut down to its newest messages when opened
+class MessageCache : public ChatHistorySource
+{
+    Q_DISABLE_COPY(MessageCache)
+public:
+    MessageCache() = default;
+    ~MessageCache();
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() const;
+    quint64 end() const;
+    quint64 lastSequence() const;
+    quint64 contiguousSequence() const;
+    void setContiguousSequence(quint64 sequence);
+    bool contains(quint64 sequence);
+    bool sentFrom(const QString &uid);
+    bool append(quint64 sequence, qint64 timestamp, const QString &sender, const QString &text, bool outgoing);
+    QVector<HistoryMessage> messagesBefore(quint64 *position, int count) override;
+private:
+    bool map(qint64 size);
+    bool initialize();
+    bool compact();
+    qint64 recordStart(qint64 end) const;
+    void buildIndex();
+
+    QFile m_file;
+    uchar *m_data{nullptr};
+    qint64 m_mappedSize{0};
+    QSet<quint64> m_sequences;
+    QSet<QString> m_senderUids; // of the messages sent by this client
+    bool m_indexed{false};
+};
+
+#endif // MESSAGECACHE_H
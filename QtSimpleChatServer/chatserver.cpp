@@ -6,50 +6,106 @@
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QTimer>
+#include <algorithm>
+
+// The workers live in a pool of threads, one per core, so reading, parsing and writing
+// the sockets keeps off the GUI thread. Routing stays in the thread of ChatServer,
+// the workers' signals reach it queued
 ChatServer::ChatServer(QObject *parent)
     : QTcpServer(parent)
-{}
+    , m_idealThreadCount(qMax(QThread::idealThreadCount(), 1))
+{
+    m_availableThreads.reserve(m_idealThreadCount);
+    m_threadsLoad.reserve(m_idealThreadCount);
+    m_threadContexts.reserve(m_idealThreadCount);
+}
+
+ChatServer::~ChatServer()
+{
+    for (QThread *singleThread : qAsConst(m_availableThreads)) {
+        singleThread->quit();
+        singleThread->wait();
+    }
+}
 
 void ChatServer::incomingConnection(qintptr socketDescriptor)
 {
-    ServerWorker *worker = new ServerWorker(this);
+    ServerWorker *worker = new ServerWorker;
     if (!worker->setSocketDescriptor(socketDescriptor)) {
         worker->deleteLater();
         return;
     }
-    connect(worker, &ServerWorker::disconnectedFromClient, this, std::bind(&ChatServer::userDisconnected, this, worker));
+    int threadIdx = m_availableThreads.size();
+    if (threadIdx < m_idealThreadCount) { //we can add a new thread
+        QThread *thread = new QThread(this);
+        QObject *context = new QObject;
+        context->moveToThread(thread);
+        connect(thread, &QThread::finished, context, &QObject::deleteLater);
+        m_availableThreads.append(thread);
+        m_threadsLoad.append(1);
+        m_threadContexts.append(context);
+        thread->start();
+    } else {
+        // find the thread with the least amount of clients and use it
+        threadIdx = int(std::distance(m_threadsLoad.cbegin(), std::min_element(m_threadsLoad.cbegin(), m_threadsLoad.cend())));
+        ++m_threadsLoad[threadIdx];
+    }
+    worker->moveToThread(m_availableThreads.at(threadIdx));
+    connect(m_availableThreads.at(threadIdx), &QThread::finished, worker, &QObject::deleteLater);
+    connect(worker, &ServerWorker::disconnectedFromClient, this, std::bind(&ChatServer::userDisconnected, this, worker, threadIdx));
     connect(worker, &ServerWorker::error, this, std::bind(&ChatServer::userError, this, worker));
     connect(worker, &ServerWorker::jsonReceived, this, std::bind(&ChatServer::jsonReceived, this, worker, std::placeholders::_1));
     connect(worker, &ServerWorker::logMessage, this, &ChatServer::logMessage);
+    connect(this, &ChatServer::stopAllClients, worker, &ServerWorker::disconnectFromClient);
     m_clients.append(worker);
     emit logMessage(QStringLiteral("New client Connected"));
 }
 void ChatServer::sendJson(ServerWorker *destination, const QJsonObject &message)
 {
     Q_ASSERT(destination);
-    destination->sendJson(message);
+    // the worker writes to its socket from its own thread
+    QTimer::singleShot(0, destination, std::bind(&ServerWorker::sendJson, destination, message));
 }
+
+// The message is serialised once and every thread gets a single call writing it to all its recipients.
+// A worker is deleted by a deleteLater posted to its thread after it left m_clients,
+// so it is still alive when a batch queued before that runs
 void ChatServer::broadcast(const QJsonObject &message, ServerWorker *exclude)
 {
-    for (ServerWorker *worker : m_clients) {
+    const QByteArray jsonData = QJsonDocument(message).toJson(QJsonDocument::Compact);
+    QVector<QVector<ServerWorker *>> recipients(m_availableThreads.size());
+    for (ServerWorker *worker : qAsConst(m_clients)) {
         Q_ASSERT(worker);
         if (worker == exclude)
             continue;
-        sendJson(worker, message);
+        const int threadIdx = m_availableThreads.indexOf(worker->thread());
+        Q_ASSERT(threadIdx >= 0);
+        recipients[threadIdx].append(worker);
+    }
+    emit logMessage(QLatin1String("Broadcasting - ") + QString::fromUtf8(jsonData));
+    for (int i = 0, iEnd = recipients.size(); i < iEnd; ++i) {
+        if (recipients.at(i).isEmpty())
+            continue;
+        const QVector<ServerWorker *> workers = recipients.at(i);
+        QTimer::singleShot(0, m_threadContexts.at(i), [workers, jsonData]() {
+            for (ServerWorker *worker : workers)
+                worker->sendData(jsonData);
+        });
     }
 }
 
 void ChatServer::jsonReceived(ServerWorker *sender, const QJsonObject &doc)
 {
     Q_ASSERT(sender);
-    emit logMessage(QLatin1String("JSON received ") + QString::fromUtf8(QJsonDocument(doc).toJson()));
+    emit logMessage(QLatin1String("JSON received ") + QString::fromUtf8(QJsonDocument(doc).toJson(QJsonDocument::Compact)));
     if (sender->userName().isEmpty())
         return jsonFromLoggedOut(sender, doc);
     jsonFromLoggedIn(sender, doc);
 }
 
-void ChatServer::userDisconnected(ServerWorker *sender)
+void ChatServer::userDisconnected(ServerWorker *sender, int threadIdx)
 {
+    --m_threadsLoad[threadIdx];
     m_clients.removeAll(sender);
     const QString userName = sender->userName();
     if (!userName.isEmpty()) {
@@ -70,9 +126,8 @@ void ChatServer::userError(ServerWorker *sender)
 
 void ChatServer::stopServer()
 {
-    for (ServerWorker *worker : m_clients) {
-        worker->disconnectFromClient();
-    }
+    // every worker disconnects in its own thread
+    emit stopAllClients();
     close();
 }
 
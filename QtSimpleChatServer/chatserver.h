@@ -11,22 +11,28 @@ class ChatServer : public QTcpServer
     Q_DISABLE_COPY(ChatServer)
 public:
     explicit ChatServer(QObject *parent = nullptr);
+    ~ChatServer();
 protected:
     void incomingConnection(qintptr socketDescriptor) override;
 signals:
     void logMessage(const QString &msg);
+    void stopAllClients();
 public slots:
     void stopServer();
 private slots:
     void broadcast(const QJsonObject &message, ServerWorker *exclude);
     void jsonReceived(ServerWorker *sender, const QJsonObject &doc);
-    void userDisconnected(ServerWorker *sender);
+    void userDisconnected(ServerWorker *sender, int threadIdx);
     void userError(ServerWorker *sender);
 private:
     void jsonFromLoggedOut(ServerWorker *sender, const QJsonObject &doc);
     void jsonFromLoggedIn(ServerWorker *sender, const QJsonObject &doc);
     void sendJson(ServerWorker *destination, const QJsonObject &message);
-    QVector<ServerWorker *> m_clients;
+    const int m_idealThreadCount;
+    QVector<QThread *> m_availableThreads;
+    QVector<int> m_threadsLoad;
+    QVector<QObject *> m_threadContexts; // one per thread, living in it, receives the batched sends
+    QVector<ServerWorker *> m_clients; // only used by the thread of ChatServer
 };
 
 #endif // CHATSERVER_H
@@ -2,12 +2,26 @@
 #include "ui_serverwindow.h"
 #include "chatserver.h"
 #include <QMessageBox>
+
+// the log view is refreshed at most this often
+constexpr int LOG_REFRESH_INTERVAL = 100; // ms
+// lines kept by the log view, the oldest ones are removed
+constexpr int MAX_LOG_LINES = 5000;
+// lines waiting for a refresh, the others are only counted
+constexpr int MAX_PENDING_LOG_LINES = 1000;
+
 ServerWindow::ServerWindow(QWidget *parent)
     : QWidget(parent)
     , ui(new Ui::ServerWindow)
     , m_chatServer(new ChatServer(this))
+    , m_droppedLogLines(0)
 {
     ui->setupUi(this);
+    ui->logEditor->setMaximumBlockCount(MAX_LOG_LINES);
+    ui->logEditor->setUndoRedoEnabled(false);
+    m_logTimer.setSingleShot(true);
+    m_logTimer.setInterval(LOG_REFRESH_INTERVAL);
+    connect(&m_logTimer, &QTimer::timeout, this, &ServerWindow::flushLog);
     connect(ui->startStopButton, &QPushButton::clicked, this, &ServerWindow::toggleStartServer);
     connect(m_chatServer, &ChatServer::logMessage, this, &ServerWindow::logMessage);
 }
@@ -33,7 +47,25 @@ void ServerWindow::toggleStartServer()
     }
 }
 
+// A busy server logs faster than the editor can show, the lines are added in batches
 void ServerWindow::logMessage(const QString &msg)
 {
-    ui->logEditor->appendPlainText(msg + QLatin1Char('\n'));
+    if (m_pendingLog.size() < MAX_PENDING_LOG_LINES)
+        m_pendingLog.append(msg);
+    else
+        ++m_droppedLogLines;
+    if (!m_logTimer.isActive())
+        m_logTimer.start();
+}
+
+void ServerWindow::flushLog()
+{
+    if (m_droppedLogLines > 0) {
+        m_pendingLog.append(tr("... %n more line(s) not shown", nullptr, m_droppedLogLines));
+        m_droppedLogLines = 0;
+    }
+    if (m_pendingLog.isEmpty())
+        return;
+    ui->logEditor->appendPlainText(m_pendingLog.join(QLatin1Char('\n')));
+    m_pendingLog.clear();
 }
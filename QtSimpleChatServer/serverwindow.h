@@ -2,6 +2,8 @@
 #define SERVERWINDOW_H
 
 #include <QWidget>
+#include <QStringList>
+#include <QTimer>
 
 namespace Ui {
 class ServerWindow;
@@ -18,9 +20,14 @@ public:
 private:
     Ui::ServerWindow *ui;
     ChatServer *m_chatServer;
+    // lines waiting for the next refresh of the log
+    QStringList m_pendingLog;
+    int m_droppedLogLines;
+    QTimer m_logTimer;
 private slots:
     void toggleStartServer();
     void logMessage(const QString &msg);
+    void flushLog();
 };
 
 #endif // SERVERWINDOW_H
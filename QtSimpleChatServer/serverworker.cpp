@@ -32,6 +32,12 @@ void ServerWorker::sendJson(const QJsonObject &json)
     const QByteArray jsonData = QJsonDocument(json).toJson(QJsonDocument::Compact);
     // we notify the central server we are about to send the message
     emit logMessage(QLatin1String("Sending to ") + userName() + QLatin1String(" - ") + QString::fromUtf8(jsonData));
+    sendData(jsonData);
+}
+
+// Writes an already serialised message, a broadcast serialises it once for all the recipients
+void ServerWorker::sendData(const QByteArray &jsonData)
+{
     // we send the message to the socket in the exact same way we did in the client
     QDataStream socketStream(m_serverSocket);
     socketStream.setVersion(QDataStream::Qt_5_7);
@@ -43,13 +49,16 @@ void ServerWorker::disconnectFromClient()
     m_serverSocket->disconnectFromHost();
 }
 
+// The name is set by the thread of ChatServer and read by the thread of the worker
 QString ServerWorker::userName() const
 {
+    QReadLocker locker(&m_userNameLock);
     return m_userName;
 }
 
 void ServerWorker::setUserName(const QString &userName)
 {
+    QWriteLocker locker(&m_userNameLock);
     m_userName = userName;
 }
 
@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include <QTcpSocket>
+#include <QReadWriteLock>
 class QJsonObject;
 class ServerWorker : public QObject
 {
@@ -14,6 +15,7 @@ public:
     QString userName() const;
     void setUserName(const QString &userName);
     void sendJson(const QJsonObject &jsonData);
+    void sendData(const QByteArray &jsonData);
 signals:
     void jsonReceived(const QJsonObject &jsonDoc);
     void disconnectedFromClient();
@@ -26,6 +28,7 @@ private slots:
 private:
     QTcpSocket *m_serverSocket;
     QString m_userName;
+    mutable QReadWriteLock m_userNameLock;
 };
 
 #endif // SERVERWORKER_H
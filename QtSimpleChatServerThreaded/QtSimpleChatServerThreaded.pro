@@ -22,15 +22,40 @@ MOC_DIR = $$BUILD_DIR/build
 SOURCES += \
     server.cpp \
     servermain.cpp \
+    acceptor.cpp \
     chatserver.cpp \
-    serverworker.cpp
+    chatmessage.cpp \
+    clientregistry.cpp \
+    logger.cpp \
+    messageparser.cpp \
+    messagestore.cpp \
+    offlinemailboxes.cpp \
+    outputqueue.cpp \
+    presenceaggregator.cpp \
+    presenceroster.cpp \
+    serverworker.cpp \
+    suspendedsessions.cpp \
+    threadcontext.cpp
 
 HEADERS += \
+    acceptor.h \
     chatserver.h \
     chatserver.h \
+    chatmessage.h \
+    clientregistry.h \
     enums.h \
+    logger.h \
+    mailbox.h \
+    messageparser.h \
+    messagestore.h \
+    offlinemailboxes.h \
+    outputqueue.h \
+    presenceaggregator.h \
+    presenceroster.h \
     server.h \
-    serverworker.h
+    serverworker.h \
+    suspendedsessions.h \
+    threadcontext.h
 
 unix {
     message(Linux build)
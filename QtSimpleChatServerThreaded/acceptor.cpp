@@ -0,0 +1,108 @@
+#include "acceptor.h"
+#include "chatserver.h"
+#include "serverworker.h"
+#include "threadcontext.h"
+#include "logger.h"
+#include <QThread>
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+#if defined(Q_OS_UNIX) && defined(SO_REUSEPORT)
+#define CHAT_HAVE_REUSEPORT
+#endif
+
+Acceptor::Acceptor(ChatServer *server, ThreadContext *context, QObject *parent)
+    : QTcpServer(parent)
+    , m_server(server)
+    , m_context(context)
+{
+}
+
+bool Acceptor::isSupported()
+{
+#ifdef CHAT_HAVE_REUSEPORT
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Acceptor::listenShared(const QHostAddress &address, quint16 port)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+#ifdef CHAT_HAVE_REUSEPORT
+    // QTcpServer::listen() cannot set SO_REUSEPORT before bind(), so the socket is made by hand
+    sockaddr_storage storage;
+    std::memset(&storage, 0, sizeof(storage));
+    socklen_t length;
+    if (address.protocol() == QAbstractSocket::IPv4Protocol) {
+        sockaddr_in *inet = reinterpret_cast<sockaddr_in *>(&storage);
+        inet->sin_family = AF_INET;
+        inet->sin_port = htons(port);
+        inet->sin_addr.s_addr = htonl(address.toIPv4Address());
+        length = sizeof(sockaddr_in);
+    } else {
+        // QHostAddress::Any is a dual stack IPv6 socket
+        const QHostAddress inet6Address = address == QHostAddress::Any ? QHostAddress(QHostAddress::AnyIPv6) : address;
+        const Q_IPV6ADDR raw = inet6Address.toIPv6Address();
+        sockaddr_in6 *inet6 = reinterpret_cast<sockaddr_in6 *>(&storage);
+        inet6->sin6_family = AF_INET6;
+        inet6->sin6_port = htons(port);
+        std::memcpy(&inet6->sin6_addr, &raw, sizeof(raw));
+        length = sizeof(sockaddr_in6);
+    }
+
+    const int fd = ::socket(storage.ss_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        if (address == QHostAddress::Any) // no IPv6 on this host
+            return listenShared(QHostAddress::AnyIPv4, port);
+        CHAT_LOG(MessageType::Critical, "Unable to create the listening socket: %1", qt_error_string(errno));
+        return false;
+    }
+    const int on = 1;
+    const int off = 0;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (address == QHostAddress::Any)
+        ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0
+            || ::bind(fd, reinterpret_cast<sockaddr *>(&storage), length) != 0
+            || ::listen(fd, SOMAXCONN) != 0) {
+        const int error = errno;
+        ::close(fd);
+        CHAT_LOG(MessageType::Critical, "Unable to listen on port %1: %2", port, qt_error_string(error));
+        return false;
+    }
+    if (!setSocketDescriptor(fd)) {
+        ::close(fd);
+        CHAT_LOG(MessageType::Critical, "Unable to listen on port %1: %2", port, errorString());
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    return false;
+#endif
+}
+
+void Acceptor::incomingConnection(qintptr socketDescriptor)
+{
+    CHAT_LOG(MessageType::Info, "Incoming connection from %1 on thread %2...", socketDescriptor, m_context->index());
+    ServerWorker *worker = new ServerWorker;
+    worker->setOutputLimits(m_server->outputLimits());
+    if (!worker->setSocketDescriptor(socketDescriptor)) {
+        CHAT_LOG(MessageType::Critical,
+                 "Error in setting the connection with socket descriptor %1.", socketDescriptor);
+        delete worker;
+        return;
+    }
+    // already on the right thread, nothing to move
+    worker->setThreadContext(m_context);
+    m_server->attachWorker(worker);
+}
@@ -0,0 +1,27 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <QTcpServer>
+
+class ChatServer;
+class ThreadContext;
+
+// Listening socket owned by a worker thread. Every acceptor binds the same port with
+// SO_REUSEPORT, the kernel spreads the connections between them and the workers are
+// created directly on the thread that runs them
+class Acceptor : public QTcpServer
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(Acceptor)
+public:
+    explicit Acceptor(ChatServer *server, ThreadContext *context, QObject *parent = nullptr);
+    static bool isSupported();
+    bool listenShared(const QHostAddress &address, quint16 port);
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
+private:
+    ChatServer *m_server;
+    ThreadContext *m_context;
+};
+
+#endif // ACCEPTOR_H
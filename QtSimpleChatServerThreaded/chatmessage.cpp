@@ -0,0 +1,153 @@
+#include "chatmessage.h"
+
+static_assert(ChatMessage::FieldCount <= 32, "the field bitmap is a quint32");
+
+ChatMessage::FieldKind ChatMessage::kind(Type field)
+{
+    switch (field) {
+        case Success: return FieldKind::Boolean;
+        case Status:
+        case RosterVersion:
+        case Sequence:
+        case Timestamp:
+        case LatestSequence:
+        case ReceivedFrames: return FieldKind::Integer;
+        case Users:
+        case RemovedUsers: return FieldKind::StringList;
+        default: return FieldKind::String;
+    }
+}
+
+bool ChatMessage::isKnown(int key)
+{
+    return key >= 0 && key < FieldCount;
+}
+
+bool ChatMessage::contains(Type field) const
+{
+    Q_ASSERT(isKnown(field));
+    return m_fields & (1u << field);
+}
+
+void ChatMessage::remove(Type field)
+{
+    Q_ASSERT(isKnown(field));
+    m_fields &= ~(1u << field);
+    m_views &= ~(1u << field);
+    m_strings[field].clear();
+    m_lists[field].clear();
+    m_numbers[field] = 0;
+}
+
+void ChatMessage::clear()
+{
+    *this = ChatMessage();
+}
+
+bool ChatMessage::isEmpty() const
+{
+    return m_fields == 0 && m_extraFields.isEmpty();
+}
+
+int ChatMessage::size() const
+{
+    int result = m_extraFields.size();
+    for (quint32 fields = m_fields; fields; fields &= fields - 1)
+        ++result;
+    return result;
+}
+
+QString ChatMessage::string(Type field) const
+{
+    Q_ASSERT(kind(field) == FieldKind::String);
+    if (isView(field))
+        return QString::fromUtf8(m_source.constData() + m_viewOffsets[field], int(m_viewLengths[field]));
+    return m_strings[field];
+}
+
+void ChatMessage::setString(Type field, const QString &value)
+{
+    Q_ASSERT(kind(field) == FieldKind::String);
+    m_strings[field] = value;
+    m_fields |= 1u << field;
+    m_views &= ~(1u << field);
+}
+
+bool ChatMessage::isView(Type field) const
+{
+    return m_views & (1u << field);
+}
+
+QByteArray ChatMessage::utf8(Type field) const
+{
+    Q_ASSERT(kind(field) == FieldKind::String);
+    if (isView(field)) // valid as long as this message is alive
+        return QByteArray::fromRawData(m_source.constData() + m_viewOffsets[field], int(m_viewLengths[field]));
+    return m_strings[field].toUtf8();
+}
+
+void ChatMessage::setSource(const QByteArray &source)
+{
+    m_source = source;
+}
+
+void ChatMessage::setStringView(Type field, qsizetype offset, qsizetype length)
+{
+    Q_ASSERT(kind(field) == FieldKind::String);
+    Q_ASSERT(offset >= 0 && length >= 0 && offset + length <= m_source.size());
+    m_viewOffsets[field] = offset;
+    m_viewLengths[field] = length;
+    m_strings[field].clear();
+    m_fields |= 1u << field;
+    m_views |= 1u << field;
+}
+
+qint64 ChatMessage::integer(Type field) const
+{
+    Q_ASSERT(kind(field) == FieldKind::Integer);
+    return m_numbers[field];
+}
+
+void ChatMessage::setInteger(Type field, qint64 value)
+{
+    Q_ASSERT(kind(field) == FieldKind::Integer);
+    m_numbers[field] = value;
+    m_fields |= 1u << field;
+}
+
+bool ChatMessage::boolean(Type field) const
+{
+    Q_ASSERT(kind(field) == FieldKind::Boolean);
+    return m_numbers[field] != 0;
+}
+
+void ChatMessage::setBoolean(Type field, bool value)
+{
+    Q_ASSERT(kind(field) == FieldKind::Boolean);
+    m_numbers[field] = value ? 1 : 0;
+    m_fields |= 1u << field;
+}
+
+QStringList ChatMessage::list(Type field) const
+{
+    Q_ASSERT(kind(field) == FieldKind::StringList);
+    return m_lists[field];
+}
+
+void ChatMessage::setList(Type field, const QStringList &value)
+{
+    Q_ASSERT(kind(field) == FieldKind::StringList);
+    m_lists[field] = value;
+    m_fields |= 1u << field;
+}
+
+const QVector<QPair<int, QCborValue>> &ChatMessage::extraFields() const
+{
+    return m_extraFields;
+}
+
+void ChatMessage::addExtraField(int key, const QCborValue &value)
+{
+    Q_ASSERT(!isKnown(key));
+    m_extraFields.append(qMakePair(key, value));
+}
@@ -0,0 +1,66 @@
+#ifndef CHATMESSAGE_H
+#define CHATMESSAGE_H
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QPair>
+#include <QCborValue>
+
+#include "enums.h"
+
+// Fixed layout message keyed by Type.
+// Every field has its own slot and a bit in m_fields tells which ones are set,
+// numbers and booleans are stored inline, strings and lists are implicitly shared.
+// A string field can also be a view of UTF-8 bytes in a shared source buffer,
+// it is converted to QString only when string() is called.
+// Keys the server does not know are kept as they are in extraFields()
+class ChatMessage
+{
+public:
+    enum class FieldKind {
+        String,
+        Integer,
+        Boolean,
+        StringList
+    };
+    static constexpr int FieldCount = ReceivedFrames + 1;
+
+    static FieldKind kind(Type field);
+    static bool isKnown(int key);
+
+    bool contains(Type field) const;
+    void remove(Type field);
+    void clear();
+    bool isEmpty() const;
+    int size() const;
+
+    QString string(Type field) const;
+    void setString(Type field, const QString &value);
+    bool isView(Type field) const;
+    QByteArray utf8(Type field) const;
+    void setSource(const QByteArray &source);
+    void setStringView(Type field, qsizetype offset, qsizetype length);
+    qint64 integer(Type field) const;
+    void setInteger(Type field, qint64 value);
+    bool boolean(Type field) const;
+    void setBoolean(Type field, bool value);
+    QStringList list(Type field) const;
+    void setList(Type field, const QStringList &value);
+
+    const QVector<QPair<int, QCborValue>> &extraFields() const;
+    void addExtraField(int key, const QCborValue &value);
+private:
+    quint32 m_fields{0};
+    quint32 m_views{0};
+    QByteArray m_source;
+    qsizetype m_viewOffsets[FieldCount] = {};
+    qsizetype m_viewLengths[FieldCount] = {};
+    QString m_strings[FieldCount];
+    qint64 m_numbers[FieldCount] = {};
+    QStringList m_lists[FieldCount];
+    QVector<QPair<int, QCborValue>> m_extraFields;
+};
+Q_DECLARE_METATYPE(ChatMessage)
+
+#endif // CHATMESSAGE_H
@@ -1,16 +1,42 @@
 #include "chatserver.h"
 #include "serverworker.h"
+#include "threadcontext.h"
+#include "logger.h"
+#include "acceptor.h"
+#include "presenceaggregator.h"
 #include <QThread>
 #include <functional>
 #include <QTimer>
+#include <QDateTime>
+#include <QRandomGenerator>
+
+// how often the load of the threads is sampled
+constexpr int STATS_INTERVAL = 1000; // ms
+// samples between two load reports in the log
+constexpr int STATS_REPORT_SAMPLES = 10;
+// a thread is not worth unloading below this score
+constexpr double MIGRATION_MIN_SCORE = 50.0;
+// a session moves only if the busiest thread is this many times busier than the idlest
+constexpr double MIGRATION_IMBALANCE = 2.0;
+// longest channel name accepted
+constexpr int MAX_CHANNEL_NAME = 64;
+// bytes of stored messages sent for one history request, the client asks again for more.
+// At most half the output a client may have waiting, what is left is for the live traffic
+constexpr qint64 MAX_HISTORY_BYTES = 128 * 1024;
 
 ChatServer::ChatServer(QObject *parent)
     : QTcpServer(parent)
     , m_idealThreadCount(qMax(QThread::idealThreadCount(), 1))
+    , m_presence(new PresenceAggregator(&m_roster, this))
 {
-    qRegisterMetaType<QMap<int, QVariant>>();
+    qRegisterMetaType<ChatMessage>();
     m_availableThreads.reserve(m_idealThreadCount);
-    m_threadsLoad.reserve(m_idealThreadCount);
+    m_threadContexts.reserve(m_idealThreadCount);
+    m_lastCounters.reserve(m_idealThreadCount);
+    m_threadLoads.reserve(m_idealThreadCount);
+    m_statsTimer.setInterval(STATS_INTERVAL);
+    connect(&m_statsTimer, &QTimer::timeout, this, &ChatServer::updateThreadLoads);
+    connect(m_presence, &PresenceAggregator::batchReady, this, &ChatServer::broadcastPresence);
 }
 
 ChatServer::~ChatServer()
@@ -21,102 +47,521 @@ ChatServer::~ChatServer()
     }
 }
 
+RoutingMode ChatServer::routingMode() const
+{
+    return m_routingMode;
+}
+
+void ChatServer::setRoutingMode(RoutingMode mode)
+{
+    m_routingMode = mode;
+}
+
+bool ChatServer::migrationEnabled() const
+{
+    return m_migrationEnabled;
+}
+
+void ChatServer::setMigrationEnabled(bool enabled)
+{
+    m_migrationEnabled = enabled;
+}
+
+QVector<ThreadLoad> ChatServer::threadLoads() const
+{
+    return m_threadLoads;
+}
+
+AcceptMode ChatServer::acceptMode() const
+{
+    return m_acceptMode;
+}
+
+void ChatServer::setAcceptMode(AcceptMode mode)
+{
+    m_acceptMode = mode;
+}
+
+OutputLimits ChatServer::outputLimits() const
+{
+    return m_outputLimits;
+}
+
+void ChatServer::setOutputLimits(const OutputLimits &limits)
+{
+    m_outputLimits = limits;
+}
+
+QVector<ThreadCounters> ChatServer::threadCounters() const
+{
+    QVector<ThreadCounters> result;
+    result.reserve(m_threadContexts.size());
+    for (ThreadContext *context : m_threadContexts)
+        result.append(context->counters());
+    return result;
+}
+
+int ChatServer::flushDelay() const
+{
+    return m_flushDelay;
+}
+
+// Only affects the threads started afterwards
+void ChatServer::setFlushDelay(int msec)
+{
+    m_flushDelay = msec;
+}
+
+int ChatServer::presenceWindow() const
+{
+    return m_presence->window();
+}
+
+// 0 broadcasts every join and leave on its own
+void ChatServer::setPresenceWindow(int msec)
+{
+    m_presence->setWindow(msec);
+}
+
+// Every message sent from now on is numbered and kept, and history requests are answered.
+// The offline mailboxes growing too big are spilled to the same directory
+bool ChatServer::openStore(const QString &directory)
+{
+    return m_store.open(directory)
+            && m_mailboxes.setSpillDirectory(directory + QStringLiteral("/mailboxes"));
+}
+
+int ChatServer::resumeGrace() const
+{
+    return m_resumeGrace;
+}
+
+// 0 ends the sessions as soon as their connection drops
+void ChatServer::setResumeGrace(int seconds)
+{
+    m_resumeGrace = qMax(0, seconds);
+}
+
+bool ChatServer::start(const QHostAddress &address, quint16 port)
+{
+    if (m_acceptMode == AcceptMode::Single)
+        return listen(address, port);
+    if (!Acceptor::isSupported()) {
+        CHAT_LOG(MessageType::Warning, "SO_REUSEPORT is not available, using a single acceptor");
+        return listen(address, port);
+    }
+
+    // every thread gets its acceptor, so they are all started now
+    while (m_availableThreads.size() < m_idealThreadCount)
+        addThread();
+    for (int i = 0; i < m_availableThreads.size(); ++i) {
+        Acceptor *acceptor = new Acceptor(this, m_threadContexts.at(i));
+        acceptor->moveToThread(m_availableThreads.at(i));
+        connect(m_availableThreads.at(i), &QThread::finished, acceptor, &QObject::deleteLater);
+        m_acceptors.append(acceptor);
+        bool listening = false;
+        QMetaObject::invokeMethod(acceptor, [acceptor, address, port, &listening]() {
+            listening = acceptor->listenShared(address, port);
+        }, Qt::BlockingQueuedConnection);
+        if (!listening) {
+            closeAcceptors();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ChatServer::isRunning() const
+{
+    return isListening() || !m_acceptors.isEmpty();
+}
+
+void ChatServer::closeAcceptors()
+{
+    // deleting an acceptor closes its socket
+    for (Acceptor *acceptor : qAsConst(m_acceptors))
+        acceptor->deleteLater();
+    m_acceptors.clear();
+}
+
 void ChatServer::incomingConnection(qintptr socketDescriptor)
 {
-    emit logMessage(MessageType::Info,
-                    QStringLiteral("Incoming connection from %1...").arg(socketDescriptor));
+    CHAT_LOG(MessageType::Info, "Incoming connection from %1...", socketDescriptor);
     ServerWorker *worker = new ServerWorker;
+    worker->setOutputLimits(m_outputLimits);
 
     if (!worker->setSocketDescriptor(socketDescriptor)) {
-        emit logMessage(MessageType::Critical,
-                        QStringLiteral("Error in setting the connection "
-                                       "with socket descriptor %1.").arg(socketDescriptor));
+        CHAT_LOG(MessageType::Critical,
+                 "Error in setting the connection with socket descriptor %1.", socketDescriptor);
         worker->deleteLater();
         return;
     }
 
-    int threadIdx = m_availableThreads.size();
-    if (threadIdx < m_idealThreadCount) { //we can add a new thread
-        m_availableThreads.append(new QThread(this));
-        m_threadsLoad.append(1);
-        m_availableThreads.last()->start();
-    } else {
-        // find the thread with the least amount of clients and use it
-        threadIdx = std::distance(m_threadsLoad.cbegin(), std::min_element(m_threadsLoad.cbegin(), m_threadsLoad.cend()));
-        ++m_threadsLoad[threadIdx];
-    }
+    // a new thread is always the least busy one
+    const int threadIdx = m_availableThreads.size() < m_idealThreadCount ? addThread() : leastBusyThread();
+    ThreadContext *context = m_threadContexts.at(threadIdx);
+    worker->setThreadContext(context);
     worker->moveToThread(m_availableThreads.at(threadIdx));
-    connect(m_availableThreads.at(threadIdx), &QThread::finished, worker, &QObject::deleteLater);
+    attachWorker(worker);
+}
+
+// Called by the thread owning the worker, either after moveToThread() or by its Acceptor
+void ChatServer::attachWorker(ServerWorker *worker)
+{
+    worker->setMailboxes(&m_mailboxes);
+    connect(worker->thread(), &QThread::finished, worker, &QObject::deleteLater);
     connect(worker, &ServerWorker::disconnectedFromClient, this,
-            std::bind(&ChatServer::userDisconnected, this, worker, threadIdx));
+            std::bind(&ChatServer::userDisconnected, this, worker));
     connect(worker, &ServerWorker::error, this, std::bind(&ChatServer::userError, this, worker, std::placeholders::_1));
-    connect(worker, &ServerWorker::dataReceived, this, &ChatServer::dataReceived);
-    connect(worker, &ServerWorker::logMessage, this, &ChatServer::logMessage);
+    // in WorkerThreads mode the routing runs on the thread that received the data,
+    // the main thread only deals with new connections and disconnections
+    connect(worker, &ServerWorker::dataReceived, this,
+            std::bind(&ChatServer::dataReceived, this, worker, std::placeholders::_1),
+            m_routingMode == RoutingMode::WorkerThreads ? Qt::DirectConnection : Qt::AutoConnection);
     connect(this, &ChatServer::stopAllClients, worker, &ServerWorker::disconnectFromClient);
 
-    m_clientsLock.lockForWrite();
-    m_clients.append(worker);
-    m_clientsLock.unlock();
-    emit logMessage(MessageType::Info, QStringLiteral("New client connected from %1").arg(socketDescriptor));
+    // the worker joins the clients of its thread once logged in or resumed
+    CHAT_LOG(MessageType::Info, "New client connected on thread %1", worker->threadContext()->index());
 }
 
-void ChatServer::send(const QMap<int, QVariant> &message, const QString &receiverUid)
+// Calls function for every client, shard after shard. Safe from any thread
+template <typename Function>
+void ChatServer::forEachClient(Function function) const
 {
-    m_clientsLock.lockForRead();
-    const auto clients = m_clients;
-    m_clientsLock.unlock();
-    for (ServerWorker *worker : clients) {
-        Q_ASSERT(worker);
-        if (worker->uid() == receiverUid) {
-            sendData(worker, message);
-            break; // we assume that there can only be one worker with the receiverUid
-        }
+    const int count = m_threadCount.load(std::memory_order_acquire);
+    ThreadContext *const *contexts = m_threadContexts.constData();
+    for (int i = 0; i < count; ++i)
+        contexts[i]->forEachClient(function);
+}
+
+// Calls function for every member of channel, shard after shard. Safe from any thread
+template <typename Function>
+void ChatServer::forEachMember(const QString &channel, Function function) const
+{
+    const int count = m_threadCount.load(std::memory_order_acquire);
+    ThreadContext *const *contexts = m_threadContexts.constData();
+    for (int i = 0; i < count; ++i)
+        contexts[i]->forEachMember(channel, function);
+}
+
+// A receiver that is not connected gets the message in its mailbox
+void ChatServer::send(const QByteArray &frame, const QString &receiverUid)
+{
+    // the reference keeps the receiver alive if it logs out meanwhile
+    if (ServerWorker *worker = m_registry.findByUid(receiverUid)) {
+        sendFrame(worker, OutgoingFrame{frame, QString(), true});
+        worker->deref();
+        return;
+    }
+    if (!m_mailboxes.store(receiverUid, frame))
+        return;
+    // the receiver may have logged in meanwhile and already emptied its mailbox,
+    // then it is emptied again here. Either way no message is left behind
+    if (ServerWorker *worker = m_registry.findByUid(receiverUid)) {
+        deliverMailbox(worker);
+        worker->deref();
     }
 }
 
-void ChatServer::broadcast(const QMap<int, QVariant> &message, ServerWorker *exclude)
+// The waiting messages are gathered by the receiver's thread and written at once
+void ChatServer::deliverMailbox(ServerWorker *receiver)
 {
-    m_clientsLock.lockForRead();
-    const auto clients = m_clients;
-    m_clientsLock.unlock();
-    for (ServerWorker *worker : clients) {
-        Q_ASSERT(worker);
+    const QVector<QByteArray> frames = m_mailboxes.take(receiver->uid());
+    if (frames.isEmpty())
+        return;
+    CHAT_LOG(MessageType::Info, "Delivering %1 offline messages to %2", frames.size(), receiver->uid());
+    for (const QByteArray &frame : frames)
+        sendFrame(receiver, OutgoingFrame{frame, QString(), true});
+}
+
+void ChatServer::broadcast(const ChatMessage &message, ServerWorker *exclude, const QString &presenceKey)
+{
+    CHAT_LOG(MessageType::Info, "Broadcasting \"%1\"", message.string(DataType));
+    broadcastFrame(OutgoingFrame{ServerWorker::encodeData(message), presenceKey}, exclude);
+}
+
+// Encoded once, every recipient gets a shallow copy of the same frame
+void ChatServer::broadcastFrame(const OutgoingFrame &frame, ServerWorker *exclude)
+{
+    forEachClient([exclude, &frame](ServerWorker *worker) {
+        // the shard is locked, the worker cannot move meanwhile
         if (worker != exclude)
-            sendData(worker, message);
+            worker->threadContext()->post(worker, frame);
+    });
+}
+
+void ChatServer::broadcastPresence(const QByteArray &frame)
+{
+    CHAT_LOG(MessageType::Info, "Broadcasting a presence batch");
+    // a batch is not a single user's update, it can be neither dropped nor replaced
+    const OutgoingFrame presence{frame, QString()};
+    forEachClient([&presence](ServerWorker *worker) {
+        worker->threadContext()->post(worker, presence);
+    });
+}
+
+// Only the members of the channel are touched, whatever the number of clients
+void ChatServer::channelBroadcast(const QByteArray &frame, const QString &channel, ServerWorker *exclude)
+{
+    const OutgoingFrame outgoing{frame, QString()};
+    CHAT_LOG(MessageType::Info, "Broadcasting to channel %1", channel);
+    forEachMember(channel, [exclude, &outgoing](ServerWorker *worker) {
+        if (worker != exclude)
+            worker->threadContext()->post(worker, outgoing);
+    });
+}
+
+// Tells the members of channel that member joined or left it
+void ChatServer::notifyChannel(const QString &channel, const QString &type, ServerWorker *member, ServerWorker *exclude)
+{
+    const SessionInfo session = member->session();
+    ChatMessage message;
+    message.setString(DataType, type);
+    message.setString(Channel, channel);
+    message.setString(UserName, session.userName);
+    message.setString(UserUid, session.uid);
+    channelBroadcast(ServerWorker::encodeData(message), channel, exclude);
+}
+
+bool ChatServer::isMember(ServerWorker *worker, const QString &channel) const
+{
+    for (;;) {
+        ThreadContext *context = worker->threadContext();
+        const bool member = context->isMember(worker, channel);
+        // retried if the worker moved to another thread meanwhile
+        if (member || worker->threadContext() == context)
+            return member;
     }
 }
 
-void ChatServer::sendData(ServerWorker *destination, const QMap<int, QVariant> &message)
+void ChatServer::changeChannel(ServerWorker *sender, const QString &channel, bool join)
+{
+    const QString type = join ? QStringLiteral("join") : QStringLiteral("leave");
+    ChatMessage reply;
+    reply.setString(DataType, type);
+    reply.setString(Channel, channel);
+    if (channel.isEmpty() || channel.size() > MAX_CHANNEL_NAME) {
+        reply.setBoolean(Success, false);
+        reply.setString(Reason, QStringLiteral("Invalid channel name"));
+        sendData(sender, reply);
+        return;
+    }
+    ThreadContext::ChannelResult result;
+    for (;;) {
+        ThreadContext *context = sender->threadContext();
+        result = join ? context->joinChannel(sender, channel) : context->leaveChannel(sender, channel);
+        // NotHere with an unchanged context means the client is gone
+        if (result != ThreadContext::ChannelResult::NotHere || sender->threadContext() == context)
+            break;
+    }
+    if (result == ThreadContext::ChannelResult::NotHere)
+        return;
+    reply.setBoolean(Success, true);
+    sendData(sender, reply);
+    if (result == ThreadContext::ChannelResult::Changed)
+        notifyChannel(channel, type, sender, sender);
+}
+
+// Sends the stored messages following since that sender may read, then a "history"
+// reply with the sequence to ask for next and the latest one stored
+void ChatServer::sendHistory(ServerWorker *sender, quint64 since)
+{
+    ChatMessage reply;
+    reply.setString(DataType, QStringLiteral("history"));
+    if (!m_store.isOpen()) {
+        reply.setBoolean(Success, false);
+        reply.setString(Reason, QStringLiteral("History is not kept"));
+        sendData(sender, reply);
+        return;
+    }
+    quint64 resume = since;
+    const qint64 pageBytes = qMin(MAX_HISTORY_BYTES, m_outputLimits.maxQueued / 2);
+    const QVector<StoredRecord> records = m_store.read(since, pageBytes, &resume);
+    // most records share a few audiences, each one is checked once
+    QHash<QByteArray, bool> readable;
+    for (const StoredRecord &record : records) {
+        auto allowed = readable.find(record.audience);
+        if (allowed == readable.end())
+            allowed = readable.insert(record.audience, canRead(sender, record.audience));
+        if (allowed.value())
+            sendFrame(sender, OutgoingFrame{record.frame, QString()});
+    }
+    reply.setBoolean(Success, true);
+    reply.setInteger(Sequence, qint64(resume));
+    reply.setInteger(LatestSequence, qint64(m_store.lastSequence()));
+    sendData(sender, reply);
+}
+
+// The audience of a stored message is empty for everyone, "#channel" for the members
+// of a channel, and "@sender\nreceiver" for the two users of a private message
+bool ChatServer::canRead(ServerWorker *reader, const QByteArray &audience) const
+{
+    if (audience.isEmpty())
+        return true;
+    if (audience.startsWith('#'))
+        return isMember(reader, QString::fromUtf8(audience.mid(1)));
+    if (audience.startsWith('@'))
+        return audience.mid(1).split('\n').contains(reader->uid().toUtf8());
+    return false;
+}
+
+void ChatServer::sendData(ServerWorker *destination, const ChatMessage &message)
 {
     Q_ASSERT(destination);
-    emit logMessage(MessageType::Info,
-                    QStringLiteral("Sending \"%1\" to %2")
-                        .arg(message[DataType].toString())
-                        .arg(destination->uid()));
-    QTimer::singleShot(0, destination, std::bind(&ServerWorker::sendData, destination, message));
+    CHAT_LOG(MessageType::Info, "Sending \"%1\" to %2", message.string(DataType), destination->uid());
+    sendFrame(destination, OutgoingFrame{ServerWorker::encodeData(message), QString()});
+}
+
+// The caller keeps destination alive: it runs in its thread or holds a reference to it.
+// The walks over a shard, which hold its lock, post to the workers directly
+void ChatServer::sendFrame(ServerWorker *destination, const OutgoingFrame &frame)
+{
+    Q_ASSERT(destination && destination->threadContext());
+    ThreadContext::postTo(destination, frame);
+}
+
+int ChatServer::addThread()
+{
+    const int threadIdx = m_availableThreads.size();
+    QThread *thread = new QThread(this);
+    ThreadContext *context = new ThreadContext(threadIdx);
+    context->setFlushDelay(m_flushDelay);
+    context->moveToThread(thread);
+    connect(thread, &QThread::started, context, &ThreadContext::start);
+    connect(thread, &QThread::finished, context, &QObject::deleteLater);
+    m_availableThreads.append(thread);
+    m_threadContexts.append(context);
+    // the vector was reserved up front and never reallocates, routing threads may now read the new entry
+    m_threadCount.store(m_threadContexts.size(), std::memory_order_release);
+    m_lastCounters.append(ThreadCounters());
+    m_threadLoads.append(ThreadLoad());
+    thread->start();
+    if (!m_statsTimer.isActive()) {
+        m_statsClock.start();
+        m_statsTimer.start();
+    }
+    return threadIdx;
+}
+
+int ChatServer::leastBusyThread() const
+{
+    Q_ASSERT(!m_threadLoads.isEmpty());
+    int result = 0;
+    double resultScore = 0;
+    for (int i = 0; i < m_threadLoads.size(); ++i) {
+        // the clients connected since the last sample count too
+        ThreadLoad load = m_threadLoads.at(i);
+        load.clients = m_threadContexts.at(i)->clientCount();
+        const double score = load.score();
+        if (i == 0 || score < resultScore) {
+            result = i;
+            resultScore = score;
+        }
+    }
+    return result;
 }
 
-QVariantList ChatServer::loggedInUsers(ServerWorker *exclude) const
+void ChatServer::updateThreadLoads()
 {
-    QVariantList users;
-    m_clientsLock.lockForRead();
-    const auto clients = m_clients;
-    m_clientsLock.unlock();
-    for (ServerWorker *worker : clients) {
-        if (worker == exclude) continue;
-        Q_ASSERT(worker);
-        if (auto name = worker->userName(); !name.isEmpty())
-            users.append(QString("%1\n%2\n%3").arg(name).arg(worker->uid()).arg(worker->status()));
+    const double seconds = qMax<qint64>(m_statsClock.restart(), 1) / 1000.0;
+    for (int i = 0; i < m_threadContexts.size(); ++i) {
+        ThreadContext *context = m_threadContexts.at(i);
+        const ThreadCounters counters = context->counters();
+        const ThreadCounters &last = m_lastCounters.at(i);
+        ThreadLoad &load = m_threadLoads[i];
+        load.clients = context->clientCount();
+        load.messagesPerSecond = (counters.messagesReceived - last.messagesReceived
+                                  + counters.framesSent - last.framesSent) / seconds;
+        load.bytesPerSecond = (counters.bytesReceived - last.bytesReceived
+                               + counters.bytesSent - last.bytesSent) / seconds;
+        load.loopLatencyMs = context->takeLoopLatency();
+        m_lastCounters[i] = counters;
+    }
+    if (m_migrationEnabled)
+        rebalance(seconds);
+    const QVector<ServerWorker *> expired = m_suspended.takeExpired(QDateTime::currentMSecsSinceEpoch());
+    for (ServerWorker *worker : expired) {
+        CHAT_LOG(MessageType::Info, "The session of %1 expired", worker->uid());
+        dropSuspended(worker);
+    }
+
+    if (++m_samplesSinceReport < STATS_REPORT_SAMPLES)
+        return;
+    m_samplesSinceReport = 0;
+    m_mailboxes.purgeExpired();
+    if (Logger::isEnabled(MessageType::Info)) {
+        QStringList report;
+        for (int i = 0; i < m_threadLoads.size(); ++i) {
+            const ThreadLoad &load = m_threadLoads.at(i);
+            report.append(QStringLiteral("#%1: %2 clients, %3 msg/s, %4 KiB/s, %5 ms")
+                          .arg(i).arg(load.clients).arg(load.messagesPerSecond, 0, 'f', 0)
+                          .arg(load.bytesPerSecond / 1024.0, 0, 'f', 1).arg(load.loopLatencyMs, 0, 'f', 1));
+        }
+        CHAT_LOG(MessageType::Info, "Thread load: %1", report.join(QLatin1String("; ")));
+    }
+    ThreadCounters output;
+    for (const ThreadCounters &counters : qAsConst(m_lastCounters)) {
+        output.framesDropped += counters.framesDropped;
+        output.framesCoalesced += counters.framesCoalesced;
+        output.slowConsumers += counters.slowConsumers;
+    }
+    // reported only when something new happened
+    if (output.framesDropped != m_reportedOutput.framesDropped || output.framesCoalesced != m_reportedOutput.framesCoalesced
+            || output.slowConsumers != m_reportedOutput.slowConsumers) {
+        m_reportedOutput = output;
+        CHAT_LOG(MessageType::Warning, "Slow clients: %1 frames dropped, %2 coalesced, %3 disconnected",
+                 output.framesDropped, output.framesCoalesced, output.slowConsumers);
     }
-    return users;
 }
 
-void ChatServer::dataReceived(const QMap<int, QVariant> &data)
+void ChatServer::rebalance(double seconds)
+{
+    int busiest = 0;
+    int idlest = 0;
+    for (int i = 1; i < m_threadLoads.size(); ++i) {
+        if (m_threadLoads.at(i).score() > m_threadLoads.at(busiest).score())
+            busiest = i;
+        if (m_threadLoads.at(i).score() < m_threadLoads.at(idlest).score())
+            idlest = i;
+    }
+    const double busiestScore = m_threadLoads.value(busiest).score();
+    const double idlestScore = m_threadLoads.value(idlest).score();
+    const bool unbalanced = busiest != idlest && busiestScore >= MIGRATION_MIN_SCORE
+            && busiestScore >= idlestScore * MIGRATION_IMBALANCE;
+
+    // the heaviest session that does not simply swap the roles of the two threads.
+    // The activity is taken from every worker so that it always covers the last period
+    const double limit = (busiestScore - idlestScore) / 2;
+    ServerWorker *candidate = nullptr;
+    double candidateActivity = 0;
+    for (int i = 0; i < m_threadContexts.size(); ++i) {
+        const bool source = unbalanced && i == busiest;
+        m_threadContexts.at(i)->forEachClient([&](ServerWorker *worker) {
+            const double activity = worker->takeActivity() / seconds;
+            if (source && activity < limit && activity > candidateActivity) {
+                // its session may end once the shard is unlocked
+                worker->ref();
+                if (candidate)
+                    candidate->deref();
+                candidate = worker;
+                candidateActivity = activity;
+            }
+        });
+    }
+    if (!candidate)
+        return;
+    // the worker moves itself, and only if it is idle at that moment
+    ThreadContext *target = m_threadContexts.at(idlest);
+    QMetaObject::invokeMethod(candidate, [candidate, target]() {
+        candidate->migrateTo(target);
+        candidate->deref();
+    }, Qt::QueuedConnection);
+}
+
+void ChatServer::dataReceived(ServerWorker *sender, const ChatMessage &data)
 {
-    ServerWorker *sender = dynamic_cast<ServerWorker*>(this->sender());
     Q_ASSERT(sender);
-    emit logMessage(MessageType::Info,
-                    QLatin1String("Data received from %1").arg(sender->uid()));
+    CHAT_LOG(MessageType::Info, "Data received from %1", sender->uid());
 
     if (sender->userName().isEmpty())
         // a new user is trying to log in
@@ -126,120 +571,344 @@ void ChatServer::dataReceived(const QMap<int, QVariant> &data)
         dataFromLoggedIn(sender, data);
 }
 
-void ChatServer::dataFromLoggedOut(ServerWorker *sender, const QMap<int, QVariant> &data)
+void ChatServer::dataFromLoggedOut(ServerWorker *sender, const ChatMessage &data)
 {
     Q_ASSERT(sender);
-    const auto type = data.value(DataType).toString();
+    const auto type = data.string(DataType);
+    if (type == QLatin1String("resume")) {
+        resumeSession(sender, data);
+        return;
+    }
     if (type.toLower() != QStringLiteral("login")) {
-        emit logMessage(MessageType::Warning,
-                        QStringLiteral("Wrong message \"%1\" from an unauthorized client.")
-                            .arg(type));
+        CHAT_LOG(MessageType::Warning, "Wrong message \"%1\" from an unauthorized client.", type);
         return;
     }
 
-    const auto userName = data.value(UserName).toString().simplified();
+    const auto userName = data.string(UserName).simplified();
     if (userName.isEmpty()) {
-        emit logMessage(MessageType::Warning,
-                        QStringLiteral("New client \"%1\" has empty username.")
-                            .arg(sender->uid()));
+        CHAT_LOG(MessageType::Warning, "New client \"%1\" has empty username.", sender->uid());
         return;
     }
-    const auto userUid = data.value(UserUid).toString();
+    const auto userUid = data.string(UserUid);
     if (userUid.isEmpty()) {
-        emit logMessage(MessageType::Warning,
-                        QStringLiteral("New client \"%1\" has empty uid.")
-                            .arg(userName));
-        return;
-    }
-
-    // search for duplicate username
-    m_clientsLock.lockForRead();
-    const auto clients = m_clients;
-    m_clientsLock.unlock();
-    for (ServerWorker *worker : clients) {
-        if (worker != sender) {
-            if (worker->userName() == userName) {
-                QMap<int, QVariant> message;
-                message[DataType] = QStringLiteral("login");
-                message[Success] = false;
-                message[Reason] = QStringLiteral("Username is already in use");
-                sendData(sender, message);
-                emit logMessage(MessageType::Critical,
-                                QStringLiteral("Clients %1 and %2 have duplicate username \"%3\".")
-                                    .arg(worker->uid())
-                                    .arg(sender->uid())
-                                    .arg(userName));
-                return;
-            }
-        }
+        CHAT_LOG(MessageType::Warning, "New client \"%1\" has empty uid.", userName);
+        return;
+    }
+    // the uids are separated by line feeds in the audience of a private message
+    if (userUid.contains(QLatin1Char('\n'))) {
+        CHAT_LOG(MessageType::Warning, "New client \"%1\" has an invalid uid.", userName);
+        return;
     }
 
-    sender->setUserName(userName);
-    sender->setUid(userUid);
+    // other comes with a reference
+    ServerWorker *other = nullptr;
+    auto result = m_registry.registerUser(sender, userName, userUid, &other);
+    // the same user logs in again after losing the connection, their suspended session makes way.
+    // Another user only sharing the name is refused as when the session is live
+    if (result != ClientRegistry::Result::Registered && other->uid() == userUid
+            && m_suspended.remove(other, other->session().token)) {
+        dropSuspended(other);
+        other->deref();
+        other = nullptr;
+        result = m_registry.registerUser(sender, userName, userUid, &other);
+    }
+    if (result != ClientRegistry::Result::Registered) {
+        const bool duplicateName = result == ClientRegistry::Result::DuplicateName;
+        ChatMessage message;
+        message.setString(DataType, QStringLiteral("login"));
+        message.setBoolean(Success, false);
+        message.setString(Reason, duplicateName ? QStringLiteral("Username is already in use")
+                                                : QStringLiteral("Uid is already in use"));
+        sendData(sender, message);
+        if (duplicateName)
+            CHAT_LOG(MessageType::Critical, "Clients %1 and %2 have duplicate username \"%3\".",
+                     other->uid(), sender->uid(), userName);
+        else
+            CHAT_LOG(MessageType::Critical, "Clients %1 and %2 have duplicate uid \"%3\".",
+                     other->uid(), sender->uid(), userUid);
+        other->deref();
+        return;
+    }
+
+    sender->setIdentity(userName, userUid);
+    sender->threadContext()->addClient(sender);
+    m_mailboxes.noteSeen(userUid);
 
-    // send back the login success
-    QMap<int, QVariant> successMessage;
-    successMessage[DataType] = QStringLiteral("login");
-    successMessage[Success] = true;
-    const auto users = loggedInUsers(sender);
-    if (!users.isEmpty())
-        successMessage[Users] = users;
-    sendData(sender, successMessage);
+    const int status = sender->status();
+    const quint64 version = m_roster.join(sender, userUid, userName, status);
 
-    // broadcast the new user
-    QMap<int, QVariant> newUserMessage;
-    newUserMessage[DataType] = QStringLiteral("newuser");
-    newUserMessage[UserName] = userName;
-    newUserMessage[UserUid] = userUid;
-    broadcast(newUserMessage, sender);
-    emit logMessage(MessageType::Info,
-                    QStringLiteral("Login successful: %1 as \"%2\"")
-                        .arg(userUid)
-                        .arg(userName));
+    // send back the login success with the users, the new one included.
+    // A client that still knows a recent version of the list only gets the changes
+    const quint64 knownVersion = data.contains(RosterVersion) ? quint64(data.integer(RosterVersion)) : 0;
+    const auto frames = m_roster.loginFrames(knownVersion);
+    for (const QByteArray &frame : frames)
+        sendFrame(sender, OutgoingFrame{frame, QString()});
+    if (m_resumeGrace > 0) {
+        const QString token = newSessionToken();
+        sender->setSessionToken(token);
+        ChatMessage session;
+        session.setString(DataType, QStringLiteral("session"));
+        session.setString(SessionToken, token);
+        sendData(sender, session);
+    }
+    deliverMailbox(sender);
+
+    if (m_presence->isEnabled()) {
+        // the new user goes out with the next presence batch
+        m_presence->noteChange();
+    } else {
+        ChatMessage newUserMessage;
+        newUserMessage.setString(DataType, QStringLiteral("newuser"));
+        newUserMessage.setString(UserName, userName);
+        newUserMessage.setString(UserUid, userUid);
+        newUserMessage.setInteger(Status, status);
+        newUserMessage.setInteger(RosterVersion, qint64(version));
+        broadcast(newUserMessage, sender, userUid);
+    }
+    CHAT_LOG(MessageType::Info, "Login successful: %1 as \"%2\"", userUid, userName);
 }
 
-void ChatServer::dataFromLoggedIn(ServerWorker *sender, const QMap<int, QVariant> &data)
+void ChatServer::dataFromLoggedIn(ServerWorker *sender, const ChatMessage &data)
 {
     Q_ASSERT(sender);
 
-    QMap<int, QVariant> message = data;
-    message[SenderName] = sender->userName();
-    message[SenderUid] = sender->uid();
-    auto receiverUid = data.value(ReceiverUid).toString();
-    if (receiverUid == QLatin1String("all") || receiverUid.isEmpty())
-        broadcast(message, sender); // broadcast the message to all users in the chat
+    const QString type = data.string(DataType);
+    if (type == QLatin1String("join") || type == QLatin1String("leave")) {
+        changeChannel(sender, data.string(Channel).simplified(), type == QLatin1String("join"));
+        return;
+    }
+    if (type == QLatin1String("history")) {
+        sendHistory(sender, quint64(qMax<qint64>(data.integer(Sequence), 0)));
+        return;
+    }
+
+    ChatMessage message = data;
+    // a status change makes a new version of the roster
+    if (data.contains(Status)) {
+        if (const quint64 version = m_roster.setStatus(sender, sender->uid(), int(data.integer(Status)))) {
+            message.setInteger(RosterVersion, qint64(version));
+            if (m_presence->isEnabled())
+                m_presence->noteChange();
+        }
+    }
+    message.setString(SenderName, sender->userName());
+    message.setString(SenderUid, sender->uid());
+    // numbers set by the client are not trusted
+    message.remove(Sequence);
+    message.remove(Timestamp);
+    auto receiverUid = data.string(ReceiverUid);
+    const bool toAll = receiverUid == QLatin1String("all") || receiverUid.isEmpty();
+    const QString channel = toAll ? data.string(Channel).simplified() : QString();
+    QByteArray audience;
+    if (!channel.isEmpty()) {
+        if (!isMember(sender, channel)) {
+            ChatMessage reply;
+            reply.setString(DataType, type);
+            reply.setString(Channel, channel);
+            reply.setBoolean(Success, false);
+            reply.setString(Reason, QStringLiteral("Not a member of the channel"));
+            sendData(sender, reply);
+            return;
+        }
+        message.setString(Channel, channel);
+        audience = '#' + channel.toUtf8();
+    } else if (!toAll) {
+        // no user has such a uid, and it would let others read the message
+        if (receiverUid.contains(QLatin1Char('\n'))) {
+            CHAT_LOG(MessageType::Warning, "Invalid receiver uid from %1", sender->uid());
+            return;
+        }
+        audience = '@' + sender->uid().toUtf8() + '\n' + receiverUid.toUtf8();
+    }
+
+    // only the text messages are kept, the stored frame is the one sent
+    QByteArray frame;
+    if (data.contains(Text))
+        frame = m_store.append(&message, audience);
+    if (frame.isEmpty())
+        frame = ServerWorker::encodeData(message);
+
+    if (!toAll)
+        send(frame, receiverUid); // send the message to a receiver only
+    else if (channel.isEmpty())
+        broadcastFrame(OutgoingFrame{frame, QString()}, sender); // broadcast the message to all users in the chat
     else
-        send(message, receiverUid); // send the message to a receiver only
+        channelBroadcast(frame, channel, sender); // to the members of the channel only
+}
+
+void ChatServer::userDisconnected(ServerWorker *sender)
+{
+    {
+        // a handover still to come is cancelled, one under way is waited for
+        QMutexLocker locker(&m_resumeLock);
+        m_resuming.remove(sender);
+    }
+    const QString token = sender->session().token;
+    if (m_resumeGrace > 0 && !token.isEmpty() && m_registry.contains(sender)) {
+        // nobody is told, the frames sent meanwhile wait in its replay buffer
+        m_suspended.insert(token, sender, QDateTime::currentMSecsSinceEpoch() + m_resumeGrace * qint64(1000));
+        CHAT_LOG(MessageType::Info, "%1 disconnected, session kept for %2 s", sender->uid(), m_resumeGrace);
+        return;
+    }
+    endSession(sender);
 }
 
-void ChatServer::userDisconnected(ServerWorker *sender, int threadIdx)
+// The user leaves: channels, list of users and registry.
+// Out of its shard and of the registry, the worker can no longer be found by a broadcast
+// or a lookup; only then is the server's reference released
+void ChatServer::endSession(ServerWorker *worker)
 {
-    --m_threadsLoad[threadIdx];
-    m_clientsLock.lockForWrite();
-    m_clients.removeAll(sender);
-    m_clientsLock.unlock();
-    const QString userName = sender->userName();
-    if (!userName.isEmpty()) {
-        QMap<int, QVariant> message;
-        message[DataType] = QStringLiteral("userdisconnected");
-        message[UserName] = userName;
-        message[UserUid] = sender->uid();
-        broadcast(message, nullptr);
-        emit logMessage(MessageType::Info, sender->uid() + QLatin1String(" disconnected"));
+    const QStringList channels = worker->threadContext()->removeClient(worker);
+    for (const QString &channel : channels)
+        notifyChannel(channel, QStringLiteral("leave"), worker, nullptr);
+    const QString userName = worker->userName();
+    if (m_registry.unregisterUser(worker)) {
+        // the messages sent from now on wait in its mailbox
+        m_mailboxes.noteSeen(worker->uid());
+        const quint64 version = m_roster.leave(worker, worker->uid());
+        if (m_presence->isEnabled()) {
+            if (version)
+                m_presence->noteChange();
+        } else {
+            ChatMessage message;
+            message.setString(DataType, QStringLiteral("userdisconnected"));
+            message.setString(UserName, userName);
+            message.setString(UserUid, worker->uid());
+            if (version)
+                message.setInteger(RosterVersion, qint64(version));
+            broadcast(message, nullptr, worker->uid());
+        }
+        CHAT_LOG(MessageType::Info, "%1 disconnected", worker->uid());
+    }
+    worker->deref();
+}
+
+// Ends a suspended session that will not be resumed. The private messages it kept without
+// delivering them go to the offline mailbox, from the thread of the worker that holds them,
+// and on to the user if it has logged in again meanwhile
+void ChatServer::dropSuspended(ServerWorker *worker)
+{
+    const QString uid = worker->uid();
+    worker->ref();
+    endSession(worker);
+    QMetaObject::invokeMethod(worker, [this, worker, uid]() {
+        if (worker->spillUndelivered()) {
+            if (ServerWorker *receiver = m_registry.findByUid(uid)) {
+                deliverMailbox(receiver);
+                receiver->deref();
+            }
+        }
+        worker->deref();
+    }, Qt::QueuedConnection);
+}
+
+// Session resumption:
+// every frame written to a client is counted, and the client counts the frames it reads.
+// After login the server sends a "session" frame with a SessionToken. When the connection
+// drops the session is suspended for resumeGrace() seconds: the user stays logged in and
+// the frames sent to it go on being counted and kept in its replay buffer.
+// A new connection sends "resume" with the token and the ReceivedFrames count, it gets a
+// "resume" reply with a new token followed by the frames it missed, and both counts go on
+// from ReceivedFrames. If the frames are no longer kept, the reply has Success false and
+// the client logs in again. The private messages that could not be replayed wait for it
+// in its offline mailbox
+void ChatServer::resumeSession(ServerWorker *sender, const ChatMessage &data)
+{
+    const QString token = data.string(SessionToken);
+    ServerWorker *previous = token.isEmpty() ? nullptr : m_suspended.take(token);
+    if (!previous) {
+        ChatMessage reply;
+        reply.setString(DataType, QStringLiteral("resume"));
+        reply.setBoolean(Success, false);
+        reply.setString(Reason, QStringLiteral("Unknown or expired session"));
+        sendData(sender, reply);
+        return;
+    }
+    const quint64 received = quint64(qMax<qint64>(data.integer(ReceivedFrames), 0));
+    ServerWorker *next = sender;
+    next->ref();
+    {
+        QMutexLocker locker(&m_resumeLock);
+        m_resuming.insert(next);
     }
-    sender->deleteLater();
+    // the replay buffer belongs to the thread of the previous worker
+    QMetaObject::invokeMethod(previous, [this, previous, next, received]() {
+        handOver(previous, next, received);
+        next->deref();
+    }, Qt::QueuedConnection);
+}
+
+// Runs in the thread of previous, which is suspended and owned by the caller.
+// next is referenced by the caller but may disconnect at any time: the handover and
+// userDisconnected() are serialised by m_resumeLock, so next is either taken over
+// before its disconnection is handled, or the handover is given up
+void ChatServer::handOver(ServerWorker *previous, ServerWorker *next, quint64 received)
+{
+    ChatMessage reply;
+    reply.setString(DataType, QStringLiteral("resume"));
+    QVector<QByteArray> frames;
+    QMutexLocker locker(&m_resumeLock);
+    if (!m_resuming.remove(next)) {
+        locker.unlock();
+        // the new connection is already gone, the session waits for another one
+        m_suspended.insert(previous->session().token, previous,
+                           QDateTime::currentMSecsSinceEpoch() + m_resumeGrace * qint64(1000));
+        return;
+    }
+    if (!previous->replayFrom(received, &frames)) {
+        locker.unlock();
+        reply.setBoolean(Success, false);
+        reply.setString(Reason, QStringLiteral("Missed frames are no longer available"));
+        sendData(next, reply);
+        dropSuspended(previous);
+        return;
+    }
+
+    // next keeps what it is sent until the reply and the missed frames are out
+    const SessionInfo session = previous->session();
+    const QString token = newSessionToken();
+    next->holdOutput();
+    next->setIdentity(session.userName, session.uid);
+    next->setStatus(session.status);
+    next->setSessionToken(token);
+    ThreadContext::transferClient(previous, next);
+    m_registry.replaceWorker(previous, next);
+    m_roster.replaceOwner(session.uid, previous, next);
+    // frames already posted to previous are passed on, they may come after newer ones
+    previous->setSuccessor(next);
+    locker.unlock();
+
+    reply.setBoolean(Success, true);
+    reply.setString(UserName, session.userName);
+    reply.setString(UserUid, session.uid);
+    reply.setString(SessionToken, token);
+    frames.prepend(ServerWorker::encodeData(reply));
+    CHAT_LOG(MessageType::Info, "%1 resumed its session, %2 frames replayed", session.uid, frames.size() - 1);
+    QMetaObject::invokeMethod(next, [next, received, frames]() {
+        next->resume(received, frames);
+    }, Qt::QueuedConnection);
+    previous->deref();
+}
+
+QString ChatServer::newSessionToken()
+{
+    quint32 words[4];
+    QRandomGenerator::system()->fillRange(words);
+    return QString::fromLatin1(QByteArray(reinterpret_cast<const char *>(words), sizeof(words)).toHex());
 }
 
 void ChatServer::userError(ServerWorker *sender, int error)
 {
     Q_UNUSED(sender)
-    emit logMessage(MessageType::Critical, QLatin1String("Error from %1: %2")
-                                               .arg(sender->uid())
-                                               .arg(error));
+    CHAT_LOG(MessageType::Critical, "Error from %1: %2", sender->uid(), error);
 }
 
 void ChatServer::stopServer()
 {
+    const QVector<ServerWorker *> suspended = m_suspended.takeAll();
+    for (ServerWorker *worker : suspended)
+        endSession(worker);
     emit stopAllClients();
     close();
+    closeAcceptors();
 }
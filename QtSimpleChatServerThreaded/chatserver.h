@@ -4,12 +4,23 @@
 #include <QTcpServer>
 #include <QVector>
 #include <QTimer>
-#include <QReadWriteLock>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSet>
+#include <atomic>
 
 class QThread;
 class ServerWorker;
-
+class Acceptor;
+class PresenceAggregator;
 #include "enums.h"
+#include "chatmessage.h"
+#include "clientregistry.h"
+#include "presenceroster.h"
+#include "messagestore.h"
+#include "offlinemailboxes.h"
+#include "suspendedsessions.h"
+#include "threadcontext.h"
 
 class ChatServer : public QTcpServer
 {
@@ -18,30 +29,89 @@ class ChatServer : public QTcpServer
 public:
     explicit ChatServer(QObject *parent = nullptr);
     ~ChatServer();
+    RoutingMode routingMode() const;
+    void setRoutingMode(RoutingMode mode);
+    bool migrationEnabled() const;
+    void setMigrationEnabled(bool enabled);
+    QVector<ThreadLoad> threadLoads() const;
+    AcceptMode acceptMode() const;
+    void setAcceptMode(AcceptMode mode);
+    OutputLimits outputLimits() const;
+    void setOutputLimits(const OutputLimits &limits);
+    QVector<ThreadCounters> threadCounters() const;
+    int flushDelay() const;
+    void setFlushDelay(int msec);
+    int presenceWindow() const;
+    void setPresenceWindow(int msec);
+    bool openStore(const QString &directory);
+    int resumeGrace() const;
+    void setResumeGrace(int seconds);
+    bool start(const QHostAddress &address, quint16 port);
+    bool isRunning() const;
+    void attachWorker(ServerWorker *worker);
 protected:
     void incomingConnection(qintptr socketDescriptor) override;
 private:
     const int m_idealThreadCount;
+    RoutingMode m_routingMode{RoutingMode::WorkerThreads};
+    AcceptMode m_acceptMode{AcceptMode::Single};
+    OutputLimits m_outputLimits;
+    int m_flushDelay{0};
+    QVector<Acceptor *> m_acceptors;
     QVector<QThread *> m_availableThreads;
-    QVector<int> m_threadsLoad;
-    QVector<ServerWorker *> m_clients;
-    QTimer timer;
-    mutable QReadWriteLock m_clientsLock;
+    QVector<ThreadContext *> m_threadContexts;
+    std::atomic<int> m_threadCount{0};
+    QVector<ThreadCounters> m_lastCounters;
+    QVector<ThreadLoad> m_threadLoads;
+    bool m_migrationEnabled{false};
+    QTimer m_statsTimer;
+    QElapsedTimer m_statsClock;
+    int m_samplesSinceReport{0};
+    ThreadCounters m_reportedOutput;
+    ClientRegistry m_registry;
+    PresenceRoster m_roster;
+    PresenceAggregator *m_presence;
+    MessageStore m_store;
+    OfflineMailboxes m_mailboxes;
+    SuspendedSessions m_suspended;
+    int m_resumeGrace{30};
+    QMutex m_resumeLock;
+    QSet<ServerWorker *> m_resuming; // new connections waiting for their handover
 private slots:
-    void send(const QMap<int, QVariant> &message, const QString &receiverUid);
-    void broadcast(const QMap<int, QVariant> &message, ServerWorker *exclude);
-    void dataReceived(const QMap<int, QVariant> &data);
-    void userDisconnected(ServerWorker *sender, int threadIdx);
+    void send(const QByteArray &frame, const QString &receiverUid);
+    void broadcast(const ChatMessage &message, ServerWorker *exclude, const QString &presenceKey = QString());
+    void broadcastFrame(const OutgoingFrame &frame, ServerWorker *exclude);
+    void dataReceived(ServerWorker *sender, const ChatMessage &data);
+    void userDisconnected(ServerWorker *sender);
+    void updateThreadLoads();
+    void broadcastPresence(const QByteArray &frame);
     void userError(ServerWorker *sender, int error);
 public slots:
     void stopServer();
 private:
-    void dataFromLoggedOut(ServerWorker *sender, const QMap<int, QVariant> &data);
-    void dataFromLoggedIn(ServerWorker *sender, const QMap<int, QVariant> &data);
-    void sendData(ServerWorker *destination, const QMap<int, QVariant> &data);
-    QVariantList loggedInUsers(ServerWorker *exclude) const;
+    void dataFromLoggedOut(ServerWorker *sender, const ChatMessage &data);
+    void dataFromLoggedIn(ServerWorker *sender, const ChatMessage &data);
+    void sendData(ServerWorker *destination, const ChatMessage &data);
+    void sendFrame(ServerWorker *destination, const OutgoingFrame &frame);
+    template <typename Function> void forEachClient(Function function) const;
+    template <typename Function> void forEachMember(const QString &channel, Function function) const;
+    void changeChannel(ServerWorker *sender, const QString &channel, bool join);
+    void channelBroadcast(const QByteArray &frame, const QString &channel, ServerWorker *exclude);
+    void notifyChannel(const QString &channel, const QString &type, ServerWorker *member, ServerWorker *exclude);
+    bool isMember(ServerWorker *worker, const QString &channel) const;
+    void deliverMailbox(ServerWorker *receiver);
+    void endSession(ServerWorker *worker);
+    void dropSuspended(ServerWorker *worker);
+    void resumeSession(ServerWorker *sender, const ChatMessage &data);
+    void handOver(ServerWorker *previous, ServerWorker *next, quint64 received);
+    static QString newSessionToken();
+    void sendHistory(ServerWorker *sender, quint64 since);
+    bool canRead(ServerWorker *reader, const QByteArray &audience) const;
+    int addThread();
+    int leastBusyThread() const;
+    void rebalance(double seconds);
+    void closeAcceptors();
 signals:
-    void logMessage(MessageType type, const QString &msg);
     void stopAllClients();
 };
 
@@ -0,0 +1,99 @@
+#include "clientregistry.h"
+#include "serverworker.h"
+
+ClientRegistry::Result ClientRegistry::registerUser(ServerWorker *worker, const QString &userName,
+                                                    const QString &uid, ServerWorker **conflict)
+{
+    Q_ASSERT(worker);
+    const QString foldedName = foldName(userName);
+    QWriteLocker locker(&m_lock);
+    if (ServerWorker *other = m_byName.value(foldedName); other && other != worker) {
+        if (conflict) {
+            other->ref();
+            *conflict = other;
+        }
+        return Result::DuplicateName;
+    }
+    if (ServerWorker *other = m_byUid.value(uid); other && other != worker) {
+        if (conflict) {
+            other->ref();
+            *conflict = other;
+        }
+        return Result::DuplicateUid;
+    }
+
+    // a client logging in again replaces its previous identity
+    auto previous = m_byWorker.constFind(worker);
+    if (previous != m_byWorker.cend()) {
+        m_byName.remove(foldName(previous->userName));
+        m_byUid.remove(previous->uid);
+    }
+    m_byName.insert(foldedName, worker);
+    m_byUid.insert(uid, worker);
+    m_byWorker.insert(worker, Entry{userName, uid});
+    return Result::Registered;
+}
+
+bool ClientRegistry::unregisterUser(ServerWorker *worker)
+{
+    QWriteLocker locker(&m_lock);
+    auto entry = m_byWorker.find(worker);
+    if (entry == m_byWorker.end())
+        return false;
+    m_byName.remove(foldName(entry->userName));
+    m_byUid.remove(entry->uid);
+    m_byWorker.erase(entry);
+    return true;
+}
+
+// The identity of previous now belongs to worker, as one change
+bool ClientRegistry::replaceWorker(ServerWorker *previous, ServerWorker *worker)
+{
+    Q_ASSERT(worker);
+    QWriteLocker locker(&m_lock);
+    auto entry = m_byWorker.find(previous);
+    if (entry == m_byWorker.end())
+        return false;
+    const Entry identity = entry.value();
+    m_byWorker.erase(entry);
+    m_byWorker.insert(worker, identity);
+    m_byName.insert(foldName(identity.userName), worker);
+    m_byUid.insert(identity.uid, worker);
+    return true;
+}
+
+ServerWorker *ClientRegistry::findByUid(const QString &uid) const
+{
+    QReadLocker locker(&m_lock);
+    ServerWorker *worker = m_byUid.value(uid);
+    if (worker)
+        worker->ref();
+    return worker;
+}
+
+ServerWorker *ClientRegistry::findByName(const QString &userName) const
+{
+    const QString foldedName = foldName(userName);
+    QReadLocker locker(&m_lock);
+    ServerWorker *worker = m_byName.value(foldedName);
+    if (worker)
+        worker->ref();
+    return worker;
+}
+
+bool ClientRegistry::contains(ServerWorker *worker) const
+{
+    QReadLocker locker(&m_lock);
+    return m_byWorker.contains(worker);
+}
+
+int ClientRegistry::size() const
+{
+    QReadLocker locker(&m_lock);
+    return m_byWorker.size();
+}
+
+QString ClientRegistry::foldName(const QString &userName)
+{
+    return userName.toCaseFolded();
+}
@@ -0,0 +1,46 @@
+#ifndef CLIENTREGISTRY_H
+#define CLIENTREGISTRY_H
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QString>
+
+class ServerWorker;
+
+// Thread safe index of the logged in clients.
+// Lookups by uid and by case folded user name are O(1).
+// A worker found is returned with a reference taken under the lock, the caller releases
+// it with ServerWorker::deref(): the session may end as soon as the lock is released
+class ClientRegistry
+{
+    Q_DISABLE_COPY(ClientRegistry)
+public:
+    enum class Result {
+        Registered,
+        DuplicateName,
+        DuplicateUid
+    };
+
+    ClientRegistry() = default;
+    Result registerUser(ServerWorker *worker, const QString &userName, const QString &uid,
+                        ServerWorker **conflict = nullptr);
+    bool unregisterUser(ServerWorker *worker);
+    bool replaceWorker(ServerWorker *previous, ServerWorker *worker);
+    ServerWorker *findByUid(const QString &uid) const;
+    ServerWorker *findByName(const QString &userName) const;
+    bool contains(ServerWorker *worker) const;
+    int size() const;
+private:
+    struct Entry {
+        QString userName;
+        QString uid;
+    };
+    static QString foldName(const QString &userName);
+
+    mutable QReadWriteLock m_lock;
+    QHash<QString, ServerWorker *> m_byUid;
+    QHash<QString, ServerWorker *> m_byName;
+    QHash<ServerWorker *, Entry> m_byWorker;
+};
+
+#endif // CLIENTREGISTRY_H
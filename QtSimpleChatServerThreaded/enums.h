@@ -14,6 +14,16 @@ enum class MessageType {
 };
 Q_DECLARE_METATYPE(MessageType)
 
+enum class RoutingMode {
+    MainThread,   // every message is routed by the thread owning ChatServer
+    WorkerThreads // messages are routed by the thread owning the sender
+};
+
+enum class AcceptMode {
+    Single,   // ChatServer accepts every connection and hands it to a worker thread
+    ReusePort // every worker thread listens on SERVER_PORT itself (SO_REUSEPORT)
+};
+
 enum Type {
     SenderName,//string //кто отправил сообщение
     SenderUid,//string  //кто отправил сообщение
@@ -26,6 +36,15 @@ enum Type {
     Reason, //string
     Users,//list
     Status,//int
+    Text,//string //текст сообщения
+    RosterVersion,//int //версия списка пользователей
+    RemovedUsers,//list //uid отключившихся пользователей
+    Channel,//string //название канала
+    Sequence,//int //номер сохранённого сообщения
+    Timestamp,//int //время сохранения сообщения, мс
+    LatestSequence,//int //номер последнего сохранённого сообщения
+    SessionToken,//string //ключ для возобновления сессии
+    ReceivedFrames,//int //сколько кадров сессии получил клиент
     Unknown = 65535
 };
 
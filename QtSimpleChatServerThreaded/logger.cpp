@@ -0,0 +1,245 @@
+#include "logger.h"
+#include <QThread>
+#include <QDateTime>
+#include <QMutexLocker>
+#include <cstdio>
+
+// records a single thread can queue before they are dropped
+constexpr quint32 LOG_BUFFER_SIZE = 1024;
+// the writer thread wakes up at least this often
+constexpr unsigned long LOG_FLUSH_INTERVAL = 50; // ms
+
+// Single producer, single consumer ring of records
+class LogBuffer
+{
+public:
+    bool push(LogRecord &record)
+    {
+        const quint32 head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == LOG_BUFFER_SIZE)
+            return false;
+        m_records[head % LOG_BUFFER_SIZE] = std::move(record);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+    bool pop(LogRecord *record)
+    {
+        const quint32 tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        *record = std::move(m_records[tail % LOG_BUFFER_SIZE]);
+        m_records[tail % LOG_BUFFER_SIZE] = LogRecord();
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+    quint32 size() const
+    {
+        return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed);
+    }
+private:
+    LogRecord m_records[LOG_BUFFER_SIZE];
+    std::atomic<quint32> m_head{0};
+    std::atomic<quint32> m_tail{0};
+};
+
+static thread_local LogBuffer *t_logBuffer = nullptr;
+
+std::atomic<int> Logger::s_level{int(MessageType::Info)};
+
+Logger &Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger() = default;
+
+Logger::~Logger()
+{
+    stop();
+    qDeleteAll(m_buffers);
+}
+
+void Logger::setLevel(MessageType level)
+{
+    s_level.store(int(level), std::memory_order_relaxed);
+}
+
+bool Logger::start(const QString &fileName)
+{
+    if (m_running.load())
+        return true;
+    m_file.setFileName(fileName);
+    const bool opened = fileName.isEmpty()
+            ? m_file.open(stderr, QIODevice::WriteOnly)
+            : m_file.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text);
+    if (!opened)
+        return false;
+    m_running.store(true);
+    m_writer = QThread::create([this]() { run(); });
+    m_writer->setObjectName(QStringLiteral("Logger"));
+    m_writer->start(QThread::LowPriority);
+    return true;
+}
+
+void Logger::stop()
+{
+    if (!m_running.exchange(false))
+        return;
+    m_wakeUp.wakeOne();
+    m_writer->wait();
+    delete m_writer;
+    m_writer = nullptr;
+    m_file.close();
+}
+
+quint64 Logger::droppedRecords() const
+{
+    return m_dropped.load(std::memory_order_relaxed);
+}
+
+void Logger::log(MessageType type, const char *format)
+{
+    LogRecord record;
+    record.type = type;
+    record.format = format;
+    append(record);
+}
+
+void Logger::log(MessageType type, const char *format, const LogArgument &a1)
+{
+    LogRecord record;
+    record.type = type;
+    record.format = format;
+    record.argumentCount = 1;
+    record.arguments[0] = a1;
+    append(record);
+}
+
+void Logger::log(MessageType type, const char *format, const LogArgument &a1, const LogArgument &a2)
+{
+    LogRecord record;
+    record.type = type;
+    record.format = format;
+    record.argumentCount = 2;
+    record.arguments[0] = a1;
+    record.arguments[1] = a2;
+    append(record);
+}
+
+void Logger::log(MessageType type, const char *format, const LogArgument &a1, const LogArgument &a2,
+                 const LogArgument &a3)
+{
+    LogRecord record;
+    record.type = type;
+    record.format = format;
+    record.argumentCount = 3;
+    record.arguments[0] = a1;
+    record.arguments[1] = a2;
+    record.arguments[2] = a3;
+    append(record);
+}
+
+LogBuffer *Logger::threadBuffer()
+{
+    if (!t_logBuffer) {
+        t_logBuffer = new LogBuffer;
+        QMutexLocker locker(&m_mutex);
+        m_buffers.append(t_logBuffer);
+    }
+    return t_logBuffer;
+}
+
+void Logger::append(LogRecord &record)
+{
+    record.timestamp = QDateTime::currentMSecsSinceEpoch();
+    LogBuffer *buffer = threadBuffer();
+    if (!buffer->push(record)) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    // don't wait for the timeout if the buffer is filling up
+    if (buffer->size() == LOG_BUFFER_SIZE / 2)
+        m_wakeUp.wakeOne();
+}
+
+void Logger::run()
+{
+    QByteArray batch;
+    for (;;) {
+        const bool running = m_running.load();
+        writeRecords(&batch);
+        if (!batch.isEmpty()) {
+            m_file.write(batch);
+            m_file.flush();
+            batch.clear();
+        }
+        if (!running)
+            break;
+        QMutexLocker locker(&m_mutex);
+        m_wakeUp.wait(&m_mutex, LOG_FLUSH_INTERVAL);
+    }
+}
+
+void Logger::writeRecords(QByteArray *batch)
+{
+    m_mutex.lock();
+    const QVector<LogBuffer *> buffers = m_buffers;
+    m_mutex.unlock();
+
+    LogRecord record;
+    for (LogBuffer *buffer : buffers) {
+        while (buffer->pop(&record)) {
+            QString text = QString::fromUtf8(record.format);
+            switch (record.argumentCount) {
+                case 1:
+                    text = text.arg(record.arguments[0].toString());
+                    break;
+                case 2:
+                    text = text.arg(record.arguments[0].toString(), record.arguments[1].toString());
+                    break;
+                case 3:
+                    text = text.arg(record.arguments[0].toString(), record.arguments[1].toString(),
+                                    record.arguments[2].toString());
+                    break;
+                default:
+                    break;
+            }
+            batch->append(timestamp(record.timestamp));
+            switch (record.type) {
+                case MessageType::Info: batch->append(" INFO:    "); break;
+                case MessageType::Warning: batch->append(" WARNING: "); break;
+                case MessageType::Critical: batch->append(" ERROR:   "); break;
+            }
+            batch->append(text.toUtf8());
+            batch->append('\n');
+        }
+    }
+    const quint64 dropped = m_dropped.load(std::memory_order_relaxed);
+    if (dropped != m_reportedDropped) {
+        batch->append(timestamp(QDateTime::currentMSecsSinceEpoch()));
+        batch->append(" WARNING: ");
+        batch->append(QByteArray::number(dropped - m_reportedDropped));
+        batch->append(" log records dropped\n");
+        m_reportedDropped = dropped;
+    }
+}
+
+QByteArray Logger::timestamp(qint64 msecs)
+{
+    // records come in bursts, the date part only changes once per second
+    const qint64 second = msecs / 1000;
+    if (second != m_cachedSecond) {
+        m_cachedSecond = second;
+        m_cachedPrefix = QDateTime::fromMSecsSinceEpoch(second * 1000, Qt::UTC)
+                             .toString(QStringLiteral("yyyy-MM-ddTHH:mm:ss."))
+                             .toLatin1();
+    }
+    QByteArray result = m_cachedPrefix;
+    const int millis = int(msecs % 1000);
+    result.append(char('0' + millis / 100));
+    result.append(char('0' + millis / 10 % 10));
+    result.append(char('0' + millis % 10));
+    result.append('Z');
+    return result;
+}
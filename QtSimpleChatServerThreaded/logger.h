@@ -0,0 +1,96 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QString>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QFile>
+#include <atomic>
+
+#include "enums.h"
+
+class QThread;
+class LogBuffer;
+
+// Argument of a log record, kept unformatted until the writer thread needs it
+class LogArgument
+{
+public:
+    LogArgument() = default;
+    LogArgument(const QString &value) : m_string(value), m_isString(true) {}
+    LogArgument(QLatin1String value) : m_string(value), m_isString(true) {}
+    LogArgument(int value) : m_number(value) {}
+    LogArgument(uint value) : m_number(value) {}
+    LogArgument(qint64 value) : m_number(value) {}
+    LogArgument(quint64 value) : m_number(qint64(value)) {}
+    QString toString() const { return m_isString ? m_string : QString::number(m_number); }
+private:
+    QString m_string;
+    qint64 m_number{0};
+    bool m_isString{false};
+};
+
+struct LogRecord
+{
+    qint64 timestamp{0};
+    MessageType type{MessageType::Info};
+    const char *format{nullptr}; // a string literal, placeholders %1 to %3
+    int argumentCount{0};
+    LogArgument arguments[3];
+};
+
+// Asynchronous log sink.
+// Every thread appends records to its own lock-free ring buffer, a background thread
+// formats them and writes them in batches to a file or to stderr.
+// Use CHAT_LOG so that nothing is evaluated when the level is disabled
+class Logger
+{
+    Q_DISABLE_COPY(Logger)
+public:
+    static Logger &instance();
+    static bool isEnabled(MessageType type)
+    {
+        return int(type) >= s_level.load(std::memory_order_relaxed);
+    }
+    static void setLevel(MessageType level);
+
+    bool start(const QString &fileName = QString()); // empty file name means stderr
+    void stop();
+    quint64 droppedRecords() const;
+
+    void log(MessageType type, const char *format);
+    void log(MessageType type, const char *format, const LogArgument &a1);
+    void log(MessageType type, const char *format, const LogArgument &a1, const LogArgument &a2);
+    void log(MessageType type, const char *format, const LogArgument &a1, const LogArgument &a2,
+             const LogArgument &a3);
+private:
+    Logger();
+    ~Logger();
+    LogBuffer *threadBuffer();
+    void append(LogRecord &record);
+    void run();
+    void writeRecords(QByteArray *batch);
+    QByteArray timestamp(qint64 msecs);
+
+    static std::atomic<int> s_level;
+
+    QMutex m_mutex;
+    QWaitCondition m_wakeUp;
+    QVector<LogBuffer *> m_buffers; // guarded by m_mutex, never shrinks
+    QThread *m_writer{nullptr};
+    QFile m_file;
+    std::atomic<bool> m_running{false};
+    std::atomic<quint64> m_dropped{0};
+    quint64 m_reportedDropped{0};
+    qint64 m_cachedSecond{-1};
+    QByteArray m_cachedPrefix;
+};
+
+#define CHAT_LOG(type, ...) \
+    do { \
+        if (Logger::isEnabled(type)) \
+            Logger::instance().log(type, __VA_ARGS__); \
+    } while (false)
+
+#endif // LOGGER_H
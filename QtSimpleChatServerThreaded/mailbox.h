@@ -0,0 +1,83 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <QtGlobal>
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer single-consumer queue
+// (intrusive MPSC queue by D. Vyukov).
+// push() may be called from any thread, pop() only from the consumer thread.
+template <typename T>
+class Mailbox
+{
+    Q_DISABLE_COPY(Mailbox)
+public:
+    Mailbox()
+        : m_head(&m_stub)
+        , m_tail(&m_stub)
+    {}
+    ~Mailbox()
+    {
+        T value;
+        while (pop(&value)) {}
+    }
+
+    void push(T value)
+    {
+        Node *node = new Node;
+        node->value = std::move(value);
+        pushNode(node);
+    }
+
+    // returns false if the mailbox is empty or a producer is halfway through a push,
+    // in the latter case the producer will wake the consumer again
+    bool pop(T *value)
+    {
+        Node *tail = m_tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next)
+                return false;
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (!next) {
+            if (tail != m_head.load(std::memory_order_acquire))
+                return false;
+            pushNode(&m_stub);
+            next = tail->next.load(std::memory_order_acquire);
+            if (!next)
+                return false;
+        }
+        m_tail = next;
+        *value = std::move(tail->value);
+        delete tail;
+        return true;
+    }
+
+    bool isEmpty() const
+    {
+        return m_tail == &m_stub && !m_stub.next.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+    void pushNode(Node *node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node *previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+    }
+
+    Node m_stub;
+    std::atomic<Node *> m_head;
+    Node *m_tail;
+};
+
+#endif // MAILBOX_H
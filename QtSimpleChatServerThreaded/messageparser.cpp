@@ -0,0 +1,456 @@
+#include "messageparser.h"
+#include <QCborValue>
+#include <limits>
+
+namespace {
+constexpr int MaxNestingDepth = 64;
+constexpr quint8 BreakByte = 0xff;
+constexpr quint8 FalseByte = 0xf4;
+constexpr quint8 TrueByte = 0xf5;
+
+enum MajorType {
+    UnsignedInteger = 0,
+    NegativeInteger = 1,
+    ByteString = 2,
+    TextString = 3,
+    Array = 4,
+    Map = 5,
+    Tag = 6,
+    SimpleOrFloat = 7
+};
+
+// Strict UTF-8 check: no overlong forms, surrogates or code points past U+10FFFF.
+// The views are written back to the recipients as they are, nothing else validates them
+bool isValidUtf8(const char *data, quint64 size)
+{
+    const quint8 *p = reinterpret_cast<const quint8 *>(data);
+    const quint8 *const end = p + size;
+    while (p != end) {
+        const quint8 lead = *p++;
+        if (lead < 0x80)
+            continue;
+        int trailing;
+        quint8 low = 0x80;
+        quint8 high = 0xbf;
+        if (lead >= 0xc2 && lead <= 0xdf) {
+            trailing = 1;
+        } else if (lead >= 0xe0 && lead <= 0xef) {
+            trailing = 2;
+            if (lead == 0xe0)
+                low = 0xa0; // overlong
+            else if (lead == 0xed)
+                high = 0x9f; // surrogates
+        } else if (lead >= 0xf0 && lead <= 0xf4) {
+            trailing = 3;
+            if (lead == 0xf0)
+                low = 0x90; // overlong
+            else if (lead == 0xf4)
+                high = 0x8f; // past U+10FFFF
+        } else {
+            return false;
+        }
+        if (end - p < trailing || *p < low || *p > high)
+            return false;
+        for (int i = 1; i < trailing; ++i) {
+            if ((p[i] & 0xc0) != 0x80)
+                return false;
+        }
+        p += trailing;
+    }
+    return true;
+}
+}
+
+void MessageParser::append(const QByteArray &data)
+{
+    if (data.isEmpty())
+        return;
+    if (m_offset == m_buffer.size()) {
+        // everything was consumed, adopt the chunk without copying it
+        m_buffer = data;
+    } else {
+        // keep only the partial message, the parsed messages may still share the old buffer
+        if (m_offset > 0)
+            m_buffer = m_buffer.mid(m_offset);
+        m_buffer.append(data);
+    }
+    m_offset = 0;
+}
+
+// Forgets the stream, the next data starts a new one
+void MessageParser::reset()
+{
+    m_buffer.clear();
+    m_offset = 0;
+    m_needed = 0;
+    m_remaining = 0;
+    m_started = false;
+    m_definite = false;
+    m_finished = false;
+    m_errorString.clear();
+}
+
+MessageParser::Result MessageParser::next(ChatMessage *message)
+{
+    Q_ASSERT(message);
+    if (m_finished)
+        return EndOfStream;
+    // the previous attempt told us how many bytes the current message needs at least
+    if (m_buffer.size() - m_offset < m_needed)
+        return NeedMoreData;
+
+    const char *data = m_buffer.constData();
+    Cursor c{data, data + m_offset, data + m_buffer.size(), quint64(m_offset)};
+
+    if (!m_started) {
+        Head head;
+        const Status status = readHead(c, &head);
+        if (status == Incomplete)
+            return NeedMoreData;
+        if (status == Invalid || head.major != Array)
+            return fail(QStringLiteral("The stream must be an array"));
+        m_started = true;
+        m_definite = !head.indefinite;
+        m_remaining = head.argument;
+        m_offset = c.pos - data;
+    }
+
+    if (m_definite && m_remaining == 0) {
+        m_finished = true;
+        return EndOfStream;
+    }
+    if (!m_definite) {
+        if (c.pos == c.end)
+            return NeedMoreData;
+        if (atBreak(c)) {
+            m_offset = c.pos + 1 - data;
+            m_finished = true;
+            return EndOfStream;
+        }
+    }
+
+    const Status status = readMap(c, message);
+    if (status == Incomplete) {
+        const quint64 needed = c.wanted - quint64(m_offset);
+        if (needed > quint64(MaxMessageSize))
+            return fail(QStringLiteral("Message is too large"));
+        m_needed = qsizetype(needed);
+        return NeedMoreData;
+    }
+    if (status == Invalid)
+        return fail(m_errorString.isEmpty() ? QStringLiteral("Malformed CBOR") : m_errorString);
+    // a message received at once is not allowed more than one received in pieces
+    if (c.pos - (data + m_offset) > MaxMessageSize)
+        return fail(QStringLiteral("Message is too large"));
+
+    m_offset = c.pos - data;
+    m_needed = 0;
+    if (m_definite)
+        --m_remaining;
+    return Message;
+}
+
+QString MessageParser::errorString() const
+{
+    return m_errorString;
+}
+
+MessageParser::Status MessageParser::incomplete(Cursor &c, quint64 bytes)
+{
+    // clamp the length so that the sum cannot overflow, next() rejects it anyway
+    const quint64 wanted = quint64(c.pos - c.begin) + qMin<quint64>(bytes, quint64(MaxMessageSize) + 1);
+    if (wanted > c.wanted)
+        c.wanted = wanted;
+    return Incomplete;
+}
+
+MessageParser::Status MessageParser::readHead(Cursor &c, Head *head)
+{
+    if (c.pos == c.end)
+        return incomplete(c, 1);
+    const quint8 initial = quint8(*c.pos);
+    const quint8 info = initial & 0x1f;
+    head->major = initial >> 5;
+    head->argument = 0;
+    head->indefinite = false;
+    if (info < 24) {
+        head->argument = info;
+        ++c.pos;
+        return Ok;
+    }
+    int size = 0;
+    switch (info) {
+        case 24: size = 1; break;
+        case 25: size = 2; break;
+        case 26: size = 4; break;
+        case 27: size = 8; break;
+        case 31:
+            if (head->major == UnsignedInteger || head->major == NegativeInteger || head->major == Tag)
+                return Invalid;
+            head->indefinite = true;
+            ++c.pos;
+            return Ok;
+        default:
+            return Invalid;
+    }
+    if (c.end - c.pos < 1 + size)
+        return incomplete(c, 1 + size);
+    for (int i = 1; i <= size; ++i)
+        head->argument = (head->argument << 8) | quint8(c.pos[i]);
+    c.pos += 1 + size;
+    return Ok;
+}
+
+bool MessageParser::atBreak(const Cursor &c)
+{
+    return c.pos != c.end && quint8(*c.pos) == BreakByte;
+}
+
+MessageParser::Status MessageParser::readText(Cursor &c, Text *text)
+{
+    Head head;
+    Status status = readHead(c, &head);
+    if (status != Ok)
+        return status;
+    Q_ASSERT(head.major == TextString);
+    if (!head.indefinite) {
+        if (quint64(c.end - c.pos) < head.argument)
+            return incomplete(c, head.argument);
+        if (!isValidUtf8(c.pos, head.argument)) {
+            m_errorString = QStringLiteral("Text is not valid UTF-8");
+            return Invalid;
+        }
+        text->offset = c.pos - c.begin;
+        text->length = qsizetype(head.argument);
+        text->isView = true;
+        c.pos += head.argument;
+        return Ok;
+    }
+
+    QByteArray utf8;
+    for (;;) {
+        if (c.pos == c.end)
+            return incomplete(c, 1);
+        if (atBreak(c)) {
+            ++c.pos;
+            break;
+        }
+        Head chunk;
+        status = readHead(c, &chunk);
+        if (status != Ok)
+            return status;
+        if (chunk.major != TextString || chunk.indefinite)
+            return Invalid;
+        if (quint64(c.end - c.pos) < chunk.argument)
+            return incomplete(c, chunk.argument);
+        // every chunk is a complete string of its own
+        if (!isValidUtf8(c.pos, chunk.argument)) {
+            m_errorString = QStringLiteral("Text is not valid UTF-8");
+            return Invalid;
+        }
+        utf8.append(c.pos, int(chunk.argument));
+        c.pos += chunk.argument;
+    }
+    text->owned = QString::fromUtf8(utf8);
+    text->isView = false;
+    return Ok;
+}
+
+MessageParser::Status MessageParser::skipItem(Cursor &c, int depth)
+{
+    if (depth > MaxNestingDepth)
+        return Invalid;
+    Head head;
+    Status status = readHead(c, &head);
+    if (status != Ok)
+        return status;
+    switch (head.major) {
+        case UnsignedInteger:
+        case NegativeInteger:
+            return Ok;
+        case ByteString:
+        case TextString:
+            if (!head.indefinite) {
+                if (quint64(c.end - c.pos) < head.argument)
+                    return incomplete(c, head.argument);
+                c.pos += head.argument;
+                return Ok;
+            }
+            for (;;) {
+                if (c.pos == c.end)
+                    return incomplete(c, 1);
+                if (atBreak(c)) {
+                    ++c.pos;
+                    return Ok;
+                }
+                Head chunk;
+                status = readHead(c, &chunk);
+                if (status != Ok)
+                    return status;
+                if (chunk.major != head.major || chunk.indefinite)
+                    return Invalid;
+                if (quint64(c.end - c.pos) < chunk.argument)
+                    return incomplete(c, chunk.argument);
+                c.pos += chunk.argument;
+            }
+        case Array:
+        case Map: {
+            const int itemsPerEntry = head.major == Map ? 2 : 1;
+            for (quint64 i = 0; head.indefinite || i < head.argument; ++i) {
+                if (head.indefinite) {
+                    if (c.pos == c.end)
+                        return incomplete(c, 1);
+                    if (atBreak(c)) {
+                        ++c.pos;
+                        return Ok;
+                    }
+                }
+                for (int j = 0; j < itemsPerEntry; ++j) {
+                    status = skipItem(c, depth + 1);
+                    if (status != Ok)
+                        return status;
+                }
+            }
+            return Ok;
+        }
+        case Tag:
+            return skipItem(c, depth + 1);
+        default: // simple values and floats, a break here is out of place
+            return head.indefinite ? Invalid : Ok;
+    }
+}
+
+MessageParser::Status MessageParser::readMap(Cursor &c, ChatMessage *message)
+{
+    Head head;
+    Status status = readHead(c, &head);
+    if (status != Ok)
+        return status;
+    if (head.major != Map) {
+        m_errorString = QStringLiteral("Message must be a map");
+        return Invalid;
+    }
+
+    message->clear();
+    message->setSource(m_buffer);
+    for (quint64 i = 0; head.indefinite || i < head.argument; ++i) {
+        if (head.indefinite) {
+            if (c.pos == c.end)
+                return incomplete(c, 1);
+            if (atBreak(c)) {
+                ++c.pos;
+                break;
+            }
+        }
+        Head key;
+        status = readHead(c, &key);
+        if (status != Ok)
+            return status;
+        if (key.major != UnsignedInteger || key.argument > quint64(std::numeric_limits<int>::max())) {
+            m_errorString = QStringLiteral("Message type must be an integer");
+            return Invalid;
+        }
+        const int field = int(key.argument);
+        if (ChatMessage::isKnown(field)) {
+            status = readValue(c, Type(field), message);
+        } else {
+            const char *start = c.pos;
+            status = skipItem(c, 0);
+            if (status == Ok)
+                message->addExtraField(field, QCborValue::fromCbor(QByteArray(start, int(c.pos - start))));
+        }
+        if (status != Ok)
+            return status;
+    }
+    return Ok;
+}
+
+MessageParser::Status MessageParser::readValue(Cursor &c, Type field, ChatMessage *message)
+{
+    if (c.pos == c.end)
+        return incomplete(c, 1);
+    const quint8 initial = quint8(*c.pos);
+    const int major = initial >> 5;
+
+    switch (ChatMessage::kind(field)) {
+        case ChatMessage::FieldKind::String:
+            if (major == TextString) {
+                Text text;
+                const Status status = readText(c, &text);
+                if (status == Ok) {
+                    if (text.isView)
+                        message->setStringView(field, text.offset, text.length);
+                    else
+                        message->setString(field, text.owned);
+                }
+                return status;
+            }
+            break;
+        case ChatMessage::FieldKind::Integer:
+            if (major == UnsignedInteger || major == NegativeInteger) {
+                Head head;
+                const Status status = readHead(c, &head);
+                if (status != Ok)
+                    return status;
+                // both ranges end where qint64 does
+                if (head.argument > quint64(std::numeric_limits<qint64>::max())) {
+                    m_errorString = QStringLiteral("Integer out of range");
+                    return Invalid;
+                }
+                message->setInteger(field, major == UnsignedInteger ? qint64(head.argument)
+                                                                    : -1 - qint64(head.argument));
+                return Ok;
+            }
+            break;
+        case ChatMessage::FieldKind::Boolean:
+            if (initial == FalseByte || initial == TrueByte) {
+                ++c.pos;
+                message->setBoolean(field, initial == TrueByte);
+                return Ok;
+            }
+            break;
+        case ChatMessage::FieldKind::StringList:
+            if (major == Array) {
+                Head head;
+                Status status = readHead(c, &head);
+                if (status != Ok)
+                    return status;
+                QStringList list;
+                for (quint64 i = 0; head.indefinite || i < head.argument; ++i) {
+                    if (head.indefinite) {
+                        if (c.pos == c.end)
+                            return incomplete(c, 1);
+                        if (atBreak(c)) {
+                            ++c.pos;
+                            break;
+                        }
+                    }
+                    if (c.pos == c.end)
+                        return incomplete(c, 1);
+                    if ((quint8(*c.pos) >> 5) == TextString) {
+                        Text text;
+                        status = readText(c, &text);
+                        if (status != Ok)
+                            return status;
+                        list.append(text.isView ? QString::fromUtf8(c.begin + text.offset, int(text.length))
+                                                : text.owned);
+                    } else {
+                        status = skipItem(c, 1);
+                        if (status != Ok)
+                            return status;
+                    }
+                }
+                message->setList(field, list);
+                return Ok;
+            }
+            break;
+    }
+    return skipItem(c, 0); // a value of the wrong type is ignored
+}
+
+MessageParser::Result MessageParser::fail(const QString &reason)
+{
+    m_errorString = reason;
+    m_finished = true;
+    return Error;
+}
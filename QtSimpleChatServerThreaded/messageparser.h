@@ -0,0 +1,73 @@
+#ifndef MESSAGEPARSER_H
+#define MESSAGEPARSER_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "chatmessage.h"
+
+// Incremental parser for the client stream: a CBOR array of maps keyed by Type.
+// The received chunks are kept as they are and complete messages are parsed in place,
+// string fields are checked to be valid UTF-8, then kept as views into the chunk and only converted to QString on demand.
+// Only the unconsumed tail of the buffer is copied when a message spans two chunks.
+class MessageParser
+{
+    Q_DISABLE_COPY(MessageParser)
+public:
+    enum Result {
+        Message,
+        NeedMoreData,
+        EndOfStream,
+        Error
+    };
+    static constexpr qsizetype MaxMessageSize = 1024 * 1024;
+
+    MessageParser() = default;
+    void append(const QByteArray &data);
+    void reset();
+    Result next(ChatMessage *message);
+    QString errorString() const;
+private:
+    enum Status {
+        Ok,
+        Incomplete,
+        Invalid
+    };
+    struct Cursor {
+        const char *begin;
+        const char *pos;
+        const char *end;
+        quint64 wanted; // offset the buffer must reach before parsing can go on
+    };
+    struct Head {
+        int major;
+        quint64 argument;
+        bool indefinite;
+    };
+    struct Text {
+        qsizetype offset{0};
+        qsizetype length{0};
+        QString owned; // set for indefinite length strings, which are not contiguous
+        bool isView{true};
+    };
+
+    static Status incomplete(Cursor &c, quint64 bytes);
+    static Status readHead(Cursor &c, Head *head);
+    static Status skipItem(Cursor &c, int depth);
+    static bool atBreak(const Cursor &c);
+    Status readText(Cursor &c, Text *text);
+    Status readMap(Cursor &c, ChatMessage *message);
+    Status readValue(Cursor &c, Type field, ChatMessage *message);
+    Result fail(const QString &reason);
+
+    QByteArray m_buffer;
+    qsizetype m_offset{0};
+    qsizetype m_needed{0};
+    quint64 m_remaining{0};
+    bool m_started{false};
+    bool m_definite{false};
+    bool m_finished{false};
+    QString m_errorString;
+};
+
+#endif // MESSAGEPARSER_H
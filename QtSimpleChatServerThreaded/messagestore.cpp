@@ -0,0 +1,343 @@
+#include "messagestore.h"
+#include "chatmessage.h"
+#include "serverworker.h"
+#include "logger.h"
+#include <QDir>
+#include <QFile>
+#include <QThread>
+#include <QDateTime>
+#include <QMutexLocker>
+#include <cstring>
+#include <algorithm>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// size of a segment file, a record never spans two segments
+constexpr qint64 SEGMENT_SIZE = 16 * 1024 * 1024;
+// bytes of records between two entries of the sparse index
+constexpr qint64 INDEX_INTERVAL = 4096;
+// longest time a record waits before it is synced to the disk
+constexpr unsigned long GROUP_COMMIT_INTERVAL = 50; // ms
+
+// Every record starts with this header, followed by the audience and the frame.
+// size is written last, a record with a zero size is the end of the segment
+struct RecordHeader
+{
+    quint32 size; // of the frame
+    quint32 audienceSize;
+    quint64 sequence;
+    qint64 timestamp;
+};
+
+static qint64 recordSize(qint64 audienceSize, qint64 frameSize)
+{
+    // records are 8 bytes aligned, so the headers can be read in place
+    return (qint64(sizeof(RecordHeader)) + audienceSize + frameSize + 7) & ~qint64(7);
+}
+
+struct MessageStore::Segment
+{
+    QFile file;
+    uchar *data{nullptr};
+    qint64 size{0}; // guarded by m_lock
+    qint64 synced{0}; // used by the sync thread only
+    quint64 firstSequence{0}; // 0 while the segment is empty
+    QVector<IndexEntry> index;
+};
+
+MessageStore::MessageStore() = default;
+
+MessageStore::~MessageStore()
+{
+    close();
+}
+
+bool MessageStore::open(const QString &directory)
+{
+    if (isOpen())
+        return true;
+    QDir dir(directory);
+    if (!dir.mkpath(QStringLiteral("."))) {
+        CHAT_LOG(MessageType::Critical, "Unable to create the message store %1", directory);
+        return false;
+    }
+    m_directory = dir.absolutePath();
+
+    const QStringList names = dir.entryList({QStringLiteral("*.seg")}, QDir::Files, QDir::Name);
+    for (const QString &name : names) {
+        bool ok = false;
+        const int number = name.left(name.size() - 4).toInt(&ok);
+        if (!ok)
+            continue;
+        m_nextNumber = qMax(m_nextNumber, number + 1);
+        Segment *segment = openSegment(number, false);
+        if (!segment) {
+            close();
+            return false;
+        }
+        loadSegment(segment);
+        m_segments.append(segment);
+    }
+    // an empty segment is the spare one, it goes last and is written to first
+    std::sort(m_segments.begin(), m_segments.end(), [](const Segment *a, const Segment *b) {
+        return a->firstSequence && (!b->firstSequence || a->firstSequence < b->firstSequence);
+    });
+    while (m_segments.size() > 1 && !m_segments.at(m_segments.size() - 2)->firstSequence) {
+        Segment *unused = m_segments.takeAt(m_segments.size() - 2);
+        unused->file.remove();
+        delete unused;
+    }
+    if (m_segments.isEmpty()) {
+        Segment *segment = openSegment(m_nextNumber++, true);
+        if (!segment) {
+            close();
+            return false;
+        }
+        m_segments.append(segment);
+    }
+
+    m_running.store(true);
+    m_syncer = QThread::create([this]() { run(); });
+    m_syncer->setObjectName(QStringLiteral("MessageStore"));
+    m_syncer->start();
+    CHAT_LOG(MessageType::Info, "Message store %1 opened, last sequence %2", m_directory, m_lastSequence);
+    return true;
+}
+
+void MessageStore::close()
+{
+    if (m_running.exchange(false)) {
+        m_wakeUp.wakeOne();
+        m_syncer->wait();
+    }
+    delete m_syncer;
+    m_syncer = nullptr;
+    // the files are unmapped when they are destroyed
+    qDeleteAll(m_segments);
+    m_segments.clear();
+    delete m_spare;
+    m_spare = nullptr;
+    m_nextNumber = 0;
+    m_lastSequence = 0;
+}
+
+bool MessageStore::isOpen() const
+{
+    return m_running.load();
+}
+
+quint64 MessageStore::lastSequence() const
+{
+    QReadLocker locker(&m_lock);
+    return m_lastSequence;
+}
+
+MessageStore::Segment *MessageStore::openSegment(int number, bool create)
+{
+    Segment *segment = new Segment;
+    segment->file.setFileName(QStringLiteral("%1/%2.seg").arg(m_directory).arg(number, 8, 10, QLatin1Char('0')));
+    // a new file is zero filled by resize(), that is an empty segment
+    const bool opened = segment->file.open(create ? QIODevice::ReadWrite | QIODevice::NewOnly : QIODevice::ReadWrite)
+            && (segment->file.size() >= SEGMENT_SIZE || segment->file.resize(SEGMENT_SIZE));
+    if (opened)
+        segment->data = segment->file.map(0, SEGMENT_SIZE);
+    if (!segment->data) {
+        CHAT_LOG(MessageType::Critical, "Unable to map the segment %1: %2", segment->file.fileName(),
+                 segment->file.errorString());
+        delete segment;
+        return nullptr;
+    }
+    return segment;
+}
+
+// Finds the end of the records of a segment and rebuilds its index.
+// The scan stops at the first record that is not complete or not in order,
+// what follows it was being written when the server stopped
+void MessageStore::loadSegment(Segment *segment)
+{
+    qint64 offset = 0;
+    quint64 previous = 0;
+    while (offset + qint64(sizeof(RecordHeader)) <= SEGMENT_SIZE) {
+        const RecordHeader *header = reinterpret_cast<const RecordHeader *>(segment->data + offset);
+        if (header->size == 0)
+            break;
+        const qint64 size = recordSize(header->audienceSize, header->size);
+        if (offset + size > SEGMENT_SIZE || header->sequence <= previous) {
+            CHAT_LOG(MessageType::Warning, "Segment %1 is damaged after sequence %2", segment->file.fileName(),
+                     previous);
+            break;
+        }
+        indexRecord(segment, header->sequence, offset);
+        previous = header->sequence;
+        offset += size;
+    }
+    segment->size = offset;
+    segment->synced = offset;
+    m_lastSequence = qMax(m_lastSequence, previous);
+}
+
+void MessageStore::indexRecord(Segment *segment, quint64 sequence, qint64 offset)
+{
+    if (segment->index.isEmpty()) {
+        segment->firstSequence = sequence;
+        segment->index.append(IndexEntry{sequence, offset});
+    } else if (offset - segment->index.constLast().offset >= INDEX_INTERVAL) {
+        segment->index.append(IndexEntry{sequence, offset});
+    }
+}
+
+// Numbers the message, stamps it and stores it.
+// Returns the encoded frame, or an empty array if the message could not be stored
+QByteArray MessageStore::append(ChatMessage *message, const QByteArray &audience)
+{
+    Q_ASSERT(message);
+    if (!isOpen())
+        return QByteArray();
+    QWriteLocker locker(&m_lock);
+    const quint64 sequence = m_lastSequence + 1;
+    message->setInteger(Sequence, qint64(sequence));
+    message->setInteger(Timestamp, QDateTime::currentMSecsSinceEpoch());
+    const QByteArray frame = ServerWorker::encodeData(*message);
+    const qint64 size = recordSize(audience.size(), frame.size());
+    if (size > SEGMENT_SIZE) {
+        message->remove(Sequence);
+        message->remove(Timestamp);
+        CHAT_LOG(MessageType::Warning, "Message of %1 bytes is too big to be stored", frame.size());
+        return QByteArray();
+    }
+
+    Segment *segment = m_segments.constLast();
+    if (segment->size + size > SEGMENT_SIZE) {
+        if (!m_spare) {
+            CHAT_LOG(MessageType::Warning, "No segment ready, the message store waits for the disk");
+            m_spare = openSegment(m_nextNumber++, true);
+            if (!m_spare) {
+                message->remove(Sequence);
+                message->remove(Timestamp);
+                return QByteArray();
+            }
+        }
+        segment = m_spare;
+        m_spare = nullptr;
+        m_segments.append(segment);
+        m_wakeUp.wakeOne(); // the next spare segment
+    }
+
+    uchar *record = segment->data + segment->size;
+    RecordHeader *header = reinterpret_cast<RecordHeader *>(record);
+    memcpy(record + sizeof(RecordHeader), audience.constData(), size_t(audience.size()));
+    memcpy(record + sizeof(RecordHeader) + audience.size(), frame.constData(), size_t(frame.size()));
+    header->audienceSize = quint32(audience.size());
+    header->sequence = sequence;
+    header->timestamp = message->integer(Timestamp);
+    header->size = quint32(frame.size());
+    indexRecord(segment, sequence, segment->size);
+    segment->size += size;
+    m_lastSequence = sequence;
+    return frame;
+}
+
+// Returns the records following since, up to about maxBytes of frames.
+// resume is set to the last sequence returned, the one to ask for next
+QVector<StoredRecord> MessageStore::read(quint64 since, qint64 maxBytes, quint64 *resume) const
+{
+    Q_ASSERT(resume);
+    *resume = since;
+    QVector<StoredRecord> result;
+    QReadLocker locker(&m_lock);
+    if (since >= m_lastSequence)
+        return result;
+
+    // the last segment starting at or before the wanted record, then the last index entry before it
+    const quint64 wanted = since + 1;
+    auto segment = std::upper_bound(m_segments.cbegin(), m_segments.cend(), wanted,
+                                    [](quint64 sequence, const Segment *segment) {
+        return !segment->firstSequence || sequence < segment->firstSequence;
+    });
+    if (segment != m_segments.cbegin())
+        --segment;
+    qint64 bytes = 0;
+    for (; segment != m_segments.cend() && bytes < maxBytes; ++segment) {
+        const Segment *current = *segment;
+        auto entry = std::upper_bound(current->index.cbegin(), current->index.cend(), wanted,
+                                      [](quint64 sequence, const IndexEntry &entry) {
+            return sequence < entry.sequence;
+        });
+        qint64 offset = entry == current->index.cbegin() ? 0 : (entry - 1)->offset;
+        while (offset < current->size && bytes < maxBytes) {
+            const RecordHeader *header = reinterpret_cast<const RecordHeader *>(current->data + offset);
+            const char *audience = reinterpret_cast<const char *>(current->data + offset + sizeof(RecordHeader));
+            offset += recordSize(header->audienceSize, header->size);
+            if (header->sequence < wanted)
+                continue;
+            StoredRecord record;
+            record.sequence = header->sequence;
+            record.timestamp = header->timestamp;
+            record.audience = QByteArray::fromRawData(audience, int(header->audienceSize));
+            record.frame = QByteArray::fromRawData(audience + header->audienceSize, int(header->size));
+            bytes += header->size;
+            *resume = header->sequence;
+            result.append(record);
+        }
+    }
+    return result;
+}
+
+void MessageStore::run()
+{
+    for (;;) {
+        const bool running = m_running.load();
+        syncSegments();
+        if (!running)
+            break;
+        prepareSpare();
+        QMutexLocker locker(&m_syncMutex);
+        m_wakeUp.wait(&m_syncMutex, GROUP_COMMIT_INTERVAL);
+    }
+}
+
+// One sync for all the records appended since the previous one
+void MessageStore::syncSegments()
+{
+    QVector<QPair<Segment *, qint64>> dirty;
+    m_lock.lockForRead();
+    for (Segment *segment : qAsConst(m_segments)) {
+        if (segment->size > segment->synced)
+            dirty.append(qMakePair(segment, segment->size));
+    }
+    m_lock.unlock();
+
+    // the segments stay mapped while the store is open, no lock is needed to sync them
+    for (const auto &range : qAsConst(dirty)) {
+        Segment *segment = range.first;
+#ifdef Q_OS_UNIX
+        const qint64 pageSize = sysconf(_SC_PAGESIZE);
+        const qint64 start = segment->synced / pageSize * pageSize;
+        if (msync(segment->data + start, size_t(range.second - start), MS_SYNC) != 0)
+            CHAT_LOG(MessageType::Warning, "Unable to sync the segment %1", segment->file.fileName());
+#endif
+        // elsewhere the system writes the mapped pages back on its own
+        segment->synced = range.second;
+    }
+}
+
+// Creates the next segment ahead of time, so append() does not have to
+void MessageStore::prepareSpare()
+{
+    int number;
+    {
+        QWriteLocker locker(&m_lock);
+        if (m_spare)
+            return;
+        number = m_nextNumber++;
+    }
+    Segment *segment = openSegment(number, true);
+    if (!segment)
+        return;
+    // append() only makes a segment itself when there is no spare, and uses it at once
+    QWriteLocker locker(&m_lock);
+    Q_ASSERT(!m_spare);
+    m_spare = segment;
+}
@@ -0,0 +1,69 @@
+#ifndef MESSAGESTORE_H
+#define MESSAGESTORE_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QReadWriteLock>
+#include <atomic>
+
+class QThread;
+class ChatMessage;
+
+struct StoredRecord
+{
+    quint64 sequence{0};
+    qint64 timestamp{0};
+    QByteArray audience;
+    QByteArray frame; // shares the mapped segment, valid while the store is open
+};
+
+// Append-only log of the chat messages, kept in memory-mapped segment files.
+// append() numbers the message, encodes it and copies the frame into the current
+// segment, it never waits for the disk: a background thread syncs the new records
+// every GROUP_COMMIT_INTERVAL ms and keeps the next segment ready before it is needed.
+// Every segment has a sparse index of the sequence numbers, read() looks a sequence up
+// in it and hands out the stored frames without copying them.
+// The audience is an opaque tag stored with the record, ChatServer uses it to decide
+// who may read it back
+class MessageStore
+{
+    Q_DISABLE_COPY(MessageStore)
+public:
+    MessageStore();
+    ~MessageStore();
+    bool open(const QString &directory);
+    void close();
+    bool isOpen() const;
+    quint64 lastSequence() const;
+    QByteArray append(ChatMessage *message, const QByteArray &audience);
+    QVector<StoredRecord> read(quint64 since, qint64 maxBytes, quint64 *resume) const;
+private:
+    struct IndexEntry {
+        quint64 sequence;
+        qint64 offset;
+    };
+    struct Segment;
+    Segment *openSegment(int number, bool create);
+    void loadSegment(Segment *segment);
+    void indexRecord(Segment *segment, quint64 sequence, qint64 offset);
+    void run();
+    void syncSegments();
+    void prepareSpare();
+
+    QString m_directory;
+    mutable QReadWriteLock m_lock;
+    QVector<Segment *> m_segments; // by first sequence, the last one is written to
+    Segment *m_spare{nullptr};
+    int m_nextNumber{0};
+    quint64 m_lastSequence{0};
+
+    QMutex m_syncMutex;
+    QWaitCondition m_wakeUp;
+    QThread *m_syncer{nullptr};
+    std::atomic<bool> m_running{false};
+};
+
+#endif // MESSAGESTORE_H
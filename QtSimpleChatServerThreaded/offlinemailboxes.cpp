@@ -0,0 +1,272 @@
+#include "offlinemailboxes.h"
+#include "logger.h"
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QMutexLocker>
+
+// users that can have messages waiting at the same time
+constexpr int MAX_MAILBOXES = 10000;
+// messages and bytes kept for one user, the oldest messages are dropped beyond
+constexpr size_t MAX_MAILBOX_MESSAGES = 500;
+constexpr qint64 MAX_MAILBOX_BYTES = 256 * 1024;
+// bytes kept for all the users together, in memory and in the spill files
+constexpr qint64 MAX_TOTAL_BYTES = 256 * 1024 * 1024;
+// how long a message waits for its receiver
+constexpr qint64 MAILBOX_TTL = 7 * 24 * 3600 * qint64(1000); // ms
+// buffered bytes of a mailbox moved to its spill file
+constexpr int SPILL_THRESHOLD = 16 * 1024;
+// capacity of a new buffer, and number of empty buffers kept for reuse
+constexpr int INITIAL_BUFFER_SIZE = 1024;
+constexpr int MAX_POOLED_BUFFERS = 64;
+
+OfflineMailboxes::~OfflineMailboxes()
+{
+    for (auto it = m_mailboxes.begin(); it != m_mailboxes.end(); ++it)
+        release(&it.value());
+}
+
+// The files left by a previous run are removed, mailboxes do not outlive the server
+bool OfflineMailboxes::setSpillDirectory(const QString &directory)
+{
+    QDir dir(directory);
+    if (!dir.mkpath(QStringLiteral(".")))
+        return false;
+    const QStringList stale = dir.entryList({QStringLiteral("*.mbox")}, QDir::Files);
+    for (const QString &name : stale)
+        dir.remove(name);
+    QMutexLocker locker(&m_lock);
+    m_spillDirectory = dir.absolutePath();
+    return true;
+}
+
+// A user logging in or out may be sent messages while not connected for MAILBOX_TTL
+void OfflineMailboxes::noteSeen(const QString &uid)
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_lock);
+    m_seen.insert(uid, now);
+}
+
+bool OfflineMailboxes::store(const QString &uid, const QByteArray &frame)
+{
+    if (frame.size() > MAX_MAILBOX_BYTES)
+        return false;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_lock);
+    const auto seen = m_seen.constFind(uid);
+    if (seen == m_seen.cend() || now - seen.value() > MAILBOX_TTL)
+        return false; // nobody we know, the message would never be taken
+    if (m_totalBytes + frame.size() > MAX_TOTAL_BYTES) {
+        CHAT_LOG(MessageType::Warning, "Offline mailboxes are full, message to %1 dropped", uid);
+        return false;
+    }
+    auto it = m_mailboxes.find(uid);
+    if (it == m_mailboxes.end()) {
+        if (m_mailboxes.size() >= MAX_MAILBOXES) {
+            CHAT_LOG(MessageType::Warning, "Too many offline mailboxes, message to %1 dropped", uid);
+            return false;
+        }
+        it = m_mailboxes.insert(uid, Mailbox());
+        it->buffer = takeBuffer();
+    }
+    Mailbox &mailbox = it.value();
+    const qint64 before = mailbox.bytes;
+    dropExpired(&mailbox, now);
+    while (!mailbox.entries.empty() && (mailbox.bytes + frame.size() > MAX_MAILBOX_BYTES
+                                        || mailbox.entries.size() >= MAX_MAILBOX_MESSAGES))
+        dropOldest(&mailbox);
+    mailbox.buffer.append(frame);
+    mailbox.entries.push_back(Entry{now + MAILBOX_TTL, frame.size()});
+    mailbox.bytes += frame.size();
+    m_totalBytes += mailbox.bytes - before;
+    if (m_spillDirectory.isEmpty() || mailbox.spilling || mailbox.buffer.size() < SPILL_THRESHOLD)
+        return true;
+
+    // the buffer is written without the lock, meanwhile the next messages go to a new one.
+    // take() and purgeExpired() leave a mailbox being spilled alone
+    if (mailbox.spillFile.isEmpty())
+        mailbox.spillFile = QStringLiteral("%1/%2.mbox").arg(m_spillDirectory).arg(m_nextSpillFile++);
+    const QString fileName = mailbox.spillFile;
+    const qint64 fileEnd = mailbox.spillStart + mailbox.spilledBytes;
+    QByteArray data = takeBuffer();
+    data.swap(mailbox.buffer);
+    mailbox.spilledBytes += data.size();
+    mailbox.spilling = true;
+    locker.unlock();
+    const bool written = writeSpill(fileName, fileEnd, data);
+    locker.relock();
+    Mailbox &spilled = m_mailboxes[uid];
+    spilled.spilling = false;
+    if (!written) {
+        // the messages stay in memory, the older ones may have been dropped meanwhile
+        const qint64 kept = qMin<qint64>(spilled.spilledBytes, data.size());
+        spilled.buffer.prepend(data.right(int(kept)));
+        spilled.spilledBytes -= kept;
+        if (spilled.spilledBytes == 0)
+            spilled.spillStart = 0;
+    } else if (spilled.spilledBytes == 0) {
+        // its messages were all dropped meanwhile
+        QFile::remove(fileName);
+        spilled.spillStart = 0;
+    }
+    recycle(&data);
+    m_spillDone.wakeAll();
+    return true;
+}
+
+// Empties the mailbox of uid and returns its messages, oldest first.
+// They are posted one by one and the receiver's thread still writes them together
+QVector<QByteArray> OfflineMailboxes::take(const QString &uid)
+{
+    Mailbox mailbox;
+    {
+        QMutexLocker locker(&m_lock);
+        auto it = m_mailboxes.find(uid);
+        while (it != m_mailboxes.end() && it->spilling) {
+            // the file is complete once the spill is over
+            m_spillDone.wait(&m_lock);
+            it = m_mailboxes.find(uid);
+        }
+        if (it == m_mailboxes.end())
+            return QVector<QByteArray>();
+        mailbox = std::move(it.value());
+        m_mailboxes.erase(it);
+        m_totalBytes -= mailbox.bytes;
+    }
+    // the mailbox is no longer shared, its file is read without the lock
+    dropExpired(&mailbox, QDateTime::currentMSecsSinceEpoch());
+    QByteArray block;
+    qint64 lost = 0;
+    if (mailbox.spilledBytes > 0) {
+        QFile file(mailbox.spillFile);
+        if (file.open(QIODevice::ReadOnly) && file.seek(mailbox.spillStart))
+            block = file.read(mailbox.spilledBytes);
+        if (block.size() != mailbox.spilledBytes) {
+            CHAT_LOG(MessageType::Critical, "Unable to read the offline messages of %1 from %2", uid,
+                     mailbox.spillFile);
+            block.clear();
+            lost = mailbox.spilledBytes;
+        }
+        file.close();
+        file.remove();
+    }
+    if (block.isEmpty())
+        block = mailbox.buffer;
+    else
+        block.append(mailbox.buffer);
+
+    QVector<QByteArray> result;
+    result.reserve(int(mailbox.entries.size()));
+    qint64 offset = -lost;
+    for (const Entry &entry : mailbox.entries) {
+        if (offset >= 0)
+            result.append(block.mid(int(offset), int(entry.size)));
+        offset += entry.size;
+    }
+    // the messages are copies, the buffer goes back to the pool
+    block = QByteArray();
+    mailbox.spilledBytes = 0;
+    QMutexLocker locker(&m_lock);
+    release(&mailbox);
+    return result;
+}
+
+// Drops the expired messages of the mailboxes nobody asked for lately
+void OfflineMailboxes::purgeExpired()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QMutexLocker locker(&m_lock);
+    for (auto it = m_seen.begin(); it != m_seen.end();) {
+        if (now - it.value() > MAILBOX_TTL)
+            it = m_seen.erase(it);
+        else
+            ++it;
+    }
+    for (auto it = m_mailboxes.begin(); it != m_mailboxes.end();) {
+        if (it->spilling) {
+            ++it;
+            continue;
+        }
+        const qint64 before = it->bytes;
+        dropExpired(&it.value(), now);
+        m_totalBytes -= before - it->bytes;
+        if (it->entries.empty()) {
+            release(&it.value());
+            it = m_mailboxes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void OfflineMailboxes::dropOldest(Mailbox *mailbox)
+{
+    const Entry entry = mailbox->entries.front();
+    mailbox->entries.pop_front();
+    mailbox->bytes -= entry.size;
+    if (mailbox->spilledBytes == 0) {
+        mailbox->buffer.remove(0, int(entry.size));
+        return;
+    }
+    // the file is only skipped, it is removed once nothing in it is left
+    mailbox->spillStart += entry.size;
+    mailbox->spilledBytes -= entry.size;
+    if (mailbox->spilledBytes == 0) {
+        QFile::remove(mailbox->spillFile);
+        mailbox->spillStart = 0;
+    }
+}
+
+void OfflineMailboxes::dropExpired(Mailbox *mailbox, qint64 now)
+{
+    // every message lives as long, the expired ones are the oldest
+    while (!mailbox->entries.empty() && mailbox->entries.front().expires <= now)
+        dropOldest(mailbox);
+}
+
+// Appends data to the spill file that should end at end, without touching it on failure
+bool OfflineMailboxes::writeSpill(const QString &fileName, qint64 end, const QByteArray &data)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        CHAT_LOG(MessageType::Warning, "Unable to spill a mailbox to %1", fileName);
+        return false;
+    }
+    // the file may have been removed meanwhile, its messages all dropped
+    if (file.size() != end) {
+        CHAT_LOG(MessageType::Warning, "Unable to spill a mailbox to %1", fileName);
+        return false;
+    }
+    if (file.write(data) != data.size()) {
+        CHAT_LOG(MessageType::Warning, "Unable to spill a mailbox to %1", fileName);
+        file.resize(end);
+        return false;
+    }
+    return true;
+}
+
+void OfflineMailboxes::release(Mailbox *mailbox)
+{
+    if (mailbox->spilledBytes > 0)
+        QFile::remove(mailbox->spillFile);
+    recycle(&mailbox->buffer);
+}
+
+QByteArray OfflineMailboxes::takeBuffer()
+{
+    if (!m_pool.isEmpty())
+        return m_pool.takeLast();
+    QByteArray buffer;
+    buffer.reserve(INITIAL_BUFFER_SIZE);
+    return buffer;
+}
+
+void OfflineMailboxes::recycle(QByteArray *buffer)
+{
+    if (m_pool.size() < MAX_POOLED_BUFFERS && buffer->capacity() <= SPILL_THRESHOLD * 2) {
+        buffer->resize(0);
+        m_pool.append(*buffer);
+    }
+    *buffer = QByteArray();
+}
@@ -0,0 +1,64 @@
+#ifndef OFFLINEMAILBOXES_H
+#define OFFLINEMAILBOXES_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QString>
+#include <QVector>
+#include <deque>
+
+// Thread safe mailboxes keeping the private messages sent to users that are not connected.
+// Only the users seen lately, logged in or out within MAILBOX_TTL, get a mailbox.
+// A mailbox holds the encoded frames back to back in one buffer, taken from a pool.
+// It is bounded in size and in number of messages, the oldest ones go first,
+// and a message expires after MAILBOX_TTL. All the mailboxes together keep at most
+// MAX_TOTAL_BYTES, further messages are refused.
+// When a spill directory is set, a buffer growing past SPILL_THRESHOLD is moved to a file,
+// written without holding the lock
+class OfflineMailboxes
+{
+    Q_DISABLE_COPY(OfflineMailboxes)
+public:
+    OfflineMailboxes() = default;
+    ~OfflineMailboxes();
+    bool setSpillDirectory(const QString &directory);
+    void noteSeen(const QString &uid);
+    bool store(const QString &uid, const QByteArray &frame);
+    QVector<QByteArray> take(const QString &uid);
+    void purgeExpired();
+private:
+    struct Entry {
+        qint64 expires;
+        qint64 size;
+    };
+    // the frames are the spilled ones first, [spillStart, spillStart + spilledBytes)
+    // of the spill file, then the buffer
+    struct Mailbox {
+        std::deque<Entry> entries;
+        qint64 bytes{0};
+        QString spillFile;
+        qint64 spillStart{0};
+        qint64 spilledBytes{0};
+        QByteArray buffer;
+        bool spilling{false}; // the previous buffer is being written, it counts as spilled
+    };
+    void dropOldest(Mailbox *mailbox);
+    void dropExpired(Mailbox *mailbox, qint64 now);
+    static bool writeSpill(const QString &fileName, qint64 end, const QByteArray &data);
+    void release(Mailbox *mailbox);
+    QByteArray takeBuffer();
+    void recycle(QByteArray *buffer);
+
+    QMutex m_lock;
+    QWaitCondition m_spillDone;
+    QHash<QString, Mailbox> m_mailboxes;
+    qint64 m_totalBytes{0};
+    QHash<QString, qint64> m_seen; // when each user logged in or out last
+    QString m_spillDirectory;
+    int m_nextSpillFile{0};
+    QVector<QByteArray> m_pool;
+};
+
+#endif // OFFLINEMAILBOXES_H
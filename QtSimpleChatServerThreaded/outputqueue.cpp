@@ -0,0 +1,68 @@
+#include "outputqueue.h"
+#include <algorithm>
+
+bool OutputQueue::isEmpty() const
+{
+    return m_frames.empty();
+}
+
+qint64 OutputQueue::bytes() const
+{
+    return m_bytes;
+}
+
+void OutputQueue::enqueue(const OutgoingFrame &frame)
+{
+    m_frames.push_back(frame);
+    m_bytes += frame.data.size();
+}
+
+// Replaces the queued presence update of the same user, returns false if there is none
+bool OutputQueue::replacePresence(const OutgoingFrame &frame)
+{
+    if (frame.presenceKey.isEmpty())
+        return false;
+    const auto queued = std::find_if(m_frames.begin(), m_frames.end(), [&frame](const OutgoingFrame &item) {
+        return item.presenceKey == frame.presenceKey;
+    });
+    if (queued == m_frames.end())
+        return false;
+    // the old update goes away and the new one takes the end of the queue, after the frames it may depend on
+    m_bytes -= queued->data.size();
+    m_frames.erase(queued);
+    enqueue(frame);
+    return true;
+}
+
+bool OutputQueue::dequeue(OutgoingFrame *frame)
+{
+    if (m_frames.empty())
+        return false;
+    *frame = std::move(m_frames.front());
+    m_frames.pop_front();
+    m_bytes -= frame->data.size();
+    return true;
+}
+
+// Drops presence updates, oldest first, until the queue is down to targetBytes.
+// Returns the number of frames dropped
+int OutputQueue::dropPresence(qint64 targetBytes)
+{
+    int dropped = 0;
+    for (auto it = m_frames.begin(); it != m_frames.end() && m_bytes > targetBytes;) {
+        if (it->presenceKey.isEmpty()) {
+            ++it;
+            continue;
+        }
+        m_bytes -= it->data.size();
+        it = m_frames.erase(it);
+        ++dropped;
+    }
+    return dropped;
+}
+
+void OutputQueue::clear()
+{
+    m_frames.clear();
+    m_bytes = 0;
+}
@@ -0,0 +1,52 @@
+#ifndef OUTPUTQUEUE_H
+#define OUTPUTQUEUE_H
+
+#include <QByteArray>
+#include <QString>
+#include <deque>
+
+// An encoded frame on its way to a client
+struct OutgoingFrame
+{
+    QByteArray data;
+    // set for presence updates: they can be dropped, and a newer update
+    // for the same user makes the queued one obsolete
+    QString presenceKey;
+    // a private message, it goes to the offline mailbox of its receiver if it is never delivered
+    bool isPrivate;
+};
+
+// What happens when a client does not read fast enough and its queue fills up
+enum class SlowConsumerPolicy {
+    Disconnect,   // the client is disconnected
+    DropPresence, // the oldest presence updates are dropped first, then the client is disconnected
+    Coalesce      // like DropPresence, and queued presence updates are replaced by newer ones for the same user
+};
+
+struct OutputLimits
+{
+    qint64 highWatermark{256 * 1024}; // socket buffer size above which frames are queued
+    qint64 lowWatermark{64 * 1024};   // socket buffer size below which the queue is flushed again
+    qint64 maxQueued{1024 * 1024};    // queued bytes tolerated before the policy kicks in
+    SlowConsumerPolicy policy{SlowConsumerPolicy::Coalesce};
+};
+
+// Frames waiting for a congested socket, only used by the thread owning the worker
+class OutputQueue
+{
+    Q_DISABLE_COPY(OutputQueue)
+public:
+    OutputQueue() = default;
+    bool isEmpty() const;
+    qint64 bytes() const;
+    void enqueue(const OutgoingFrame &frame);
+    bool replacePresence(const OutgoingFrame &frame);
+    bool dequeue(OutgoingFrame *frame);
+    int dropPresence(qint64 targetBytes);
+    void clear();
+private:
+    std::deque<OutgoingFrame> m_frames;
+    qint64 m_bytes{0};
+};
+
+#endif // OUTPUTQUEUE_H
@@ -0,0 +1,58 @@
+#include "presenceaggregator.h"
+#include "presenceroster.h"
+
+// changes that make a batch go out before the end of the window,
+// well below what the roster keeps in its log
+constexpr int MAX_BATCH_CHANGES = 1024;
+
+PresenceAggregator::PresenceAggregator(PresenceRoster *roster, QObject *parent)
+    : QObject(parent)
+    , m_roster(roster)
+    , m_lastVersion(roster->version())
+    , m_timer(this)
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, &QTimer::timeout, this, &PresenceAggregator::flush);
+}
+
+int PresenceAggregator::window() const
+{
+    return m_window;
+}
+
+// 0 disables the aggregation, every change is then broadcast on its own
+void PresenceAggregator::setWindow(int msec)
+{
+    m_window = qMax(0, msec);
+}
+
+bool PresenceAggregator::isEnabled() const
+{
+    return m_window > 0;
+}
+
+void PresenceAggregator::noteChange()
+{
+    Q_ASSERT(isEnabled());
+    if (m_pending.fetch_add(1, std::memory_order_relaxed) + 1 == MAX_BATCH_CHANGES)
+        QMetaObject::invokeMethod(this, &PresenceAggregator::flush, Qt::QueuedConnection);
+    // the first change of a batch starts the window
+    else if (!m_armed.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, &PresenceAggregator::arm, Qt::QueuedConnection);
+}
+
+void PresenceAggregator::arm()
+{
+    if (!m_timer.isActive())
+        m_timer.start(m_window);
+}
+
+void PresenceAggregator::flush()
+{
+    m_timer.stop();
+    m_armed.store(false, std::memory_order_release);
+    m_pending.store(0, std::memory_order_relaxed);
+    const QByteArray frame = m_roster->changesFrame(m_lastVersion, &m_lastVersion);
+    if (!frame.isEmpty())
+        emit batchReady(frame);
+}
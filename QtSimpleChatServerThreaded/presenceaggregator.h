@@ -0,0 +1,37 @@
+#ifndef PRESENCEAGGREGATOR_H
+#define PRESENCEAGGREGATOR_H
+
+#include <QObject>
+#include <QTimer>
+#include <atomic>
+
+class PresenceRoster;
+
+// Collects the changes of the roster over a short window and hands them over as one
+// "presence" frame, so a join or leave storm costs one broadcast per window instead of
+// one per change. noteChange() is thread safe, the batches are made in the owner thread
+class PresenceAggregator : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(PresenceAggregator)
+public:
+    explicit PresenceAggregator(PresenceRoster *roster, QObject *parent = nullptr);
+    int window() const;
+    void setWindow(int msec);
+    bool isEnabled() const;
+    void noteChange();
+signals:
+    void batchReady(const QByteArray &frame);
+private:
+    void arm();
+    void flush();
+
+    PresenceRoster *m_roster;
+    int m_window{0};
+    quint64 m_lastVersion;
+    QTimer m_timer;
+    std::atomic<bool> m_armed{false};
+    std::atomic<int> m_pending{0};
+};
+
+#endif // PRESENCEAGGREGATOR_H
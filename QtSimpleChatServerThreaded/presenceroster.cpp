@@ -0,0 +1,171 @@
+#include "presenceroster.h"
+#include "chatmessage.h"
+#include "serverworker.h"
+#include <QRandomGenerator>
+
+// changes kept for the clients catching up
+constexpr int MAX_LOGGED_CHANGES = 4096;
+// changes since the snapshot that make it worth rebuilding
+constexpr int SNAPSHOT_REBUILD_CHANGES = 256;
+
+PresenceRoster::PresenceRoster()
+    // versions of a previous run must not be mistaken for versions of this one
+    : m_version(quint64(QRandomGenerator::global()->bounded(1u << 30)) << 32)
+{
+}
+
+quint64 PresenceRoster::version() const
+{
+    QMutexLocker locker(&m_lock);
+    return m_version;
+}
+
+QString PresenceRoster::formatUser(const QString &userName, const QString &uid, int status)
+{
+    return QStringLiteral("%1\n%2\n%3").arg(userName, uid).arg(status);
+}
+
+quint64 PresenceRoster::join(ServerWorker *owner, const QString &uid, const QString &userName, int status)
+{
+    QMutexLocker locker(&m_lock);
+    m_entries.insert(uid, Entry{owner, userName, status});
+    logChange(uid, userName, status, false);
+    return m_version;
+}
+
+// Returns 0 if the uid is not, or no longer, logged in through owner
+quint64 PresenceRoster::leave(ServerWorker *owner, const QString &uid)
+{
+    QMutexLocker locker(&m_lock);
+    const auto entry = m_entries.constFind(uid);
+    // the uid may already belong to a new session of the same user
+    if (entry == m_entries.cend() || entry->owner != owner)
+        return 0;
+    const QString userName = entry->userName;
+    m_entries.erase(entry);
+    logChange(uid, userName, 0, true);
+    return m_version;
+}
+
+// Returns 0 when nothing changed
+quint64 PresenceRoster::setStatus(ServerWorker *owner, const QString &uid, int status)
+{
+    QMutexLocker locker(&m_lock);
+    const auto entry = m_entries.find(uid);
+    if (entry == m_entries.end() || entry->owner != owner || entry->status == status)
+        return 0;
+    entry->status = status;
+    logChange(uid, entry->userName, status, false);
+    return m_version;
+}
+
+// A resumed session keeps its entry, nothing changes for the other users
+bool PresenceRoster::replaceOwner(const QString &uid, ServerWorker *previous, ServerWorker *owner)
+{
+    QMutexLocker locker(&m_lock);
+    const auto entry = m_entries.find(uid);
+    if (entry == m_entries.end() || entry->owner != previous)
+        return false;
+    entry->owner = owner;
+    return true;
+}
+
+void PresenceRoster::logChange(const QString &uid, const QString &userName, int status, bool removed)
+{
+    m_changes.push_back(Change{++m_version, uid, userName, status, removed});
+    if (m_changes.size() > MAX_LOGGED_CHANGES)
+        m_changes.pop_front();
+}
+
+bool PresenceRoster::hasChangesSince(quint64 version) const
+{
+    if (version > m_version)
+        return false;
+    if (version == m_version)
+        return true;
+    return !m_changes.empty() && m_changes.front().version <= version + 1;
+}
+
+// The frames bringing a client that knows knownVersion (0 if none) up to date:
+// the login reply, with the whole list unless the client can catch up, then the changes
+QVector<QByteArray> PresenceRoster::loginFrames(quint64 knownVersion)
+{
+    QMutexLocker locker(&m_lock);
+    QVector<QByteArray> frames;
+    quint64 base = knownVersion;
+    if (knownVersion != 0 && hasChangesSince(knownVersion)) {
+        ChatMessage reply;
+        reply.setString(DataType, QStringLiteral("login"));
+        reply.setBoolean(Success, true);
+        reply.setInteger(RosterVersion, qint64(knownVersion));
+        frames.append(ServerWorker::encodeData(reply));
+    } else {
+        if (m_snapshotFrame.isEmpty() || m_version - m_snapshotVersion > SNAPSHOT_REBUILD_CHANGES
+                || !hasChangesSince(m_snapshotVersion))
+            rebuildSnapshot();
+        frames.append(m_snapshotFrame);
+        base = m_snapshotVersion;
+    }
+    if (base != m_version)
+        frames.append(deltaFrame(QStringLiteral("roster"), base));
+    return frames;
+}
+
+// The changes after since as a "presence" frame, empty if there are none.
+// version is set to the version the frame brings the clients to
+QByteArray PresenceRoster::changesFrame(quint64 since, quint64 *version)
+{
+    QMutexLocker locker(&m_lock);
+    *version = m_version;
+    if (since == m_version)
+        return QByteArray();
+    if (hasChangesSince(since))
+        return deltaFrame(QStringLiteral("presence"), since);
+    // the batch was kept waiting longer than the log goes back: the whole list, as on login,
+    // which the logged in clients take in place of theirs
+    if (m_snapshotFrame.isEmpty() || m_snapshotVersion != m_version)
+        rebuildSnapshot();
+    return m_snapshotFrame;
+}
+
+// The changes after since, only the last one of each user
+QByteArray PresenceRoster::deltaFrame(const QString &dataType, quint64 since) const
+{
+    QHash<QString, const Change *> latest;
+    for (auto it = m_changes.crbegin(); it != m_changes.crend() && it->version > since; ++it) {
+        if (!latest.contains(it->uid))
+            latest.insert(it->uid, &*it);
+    }
+    QStringList users;
+    QStringList removed;
+    for (const Change *change : qAsConst(latest)) {
+        if (change->removed)
+            removed.append(change->uid);
+        else
+            users.append(formatUser(change->userName, change->uid, change->status));
+    }
+    ChatMessage delta;
+    delta.setString(DataType, dataType);
+    delta.setInteger(RosterVersion, qint64(m_version));
+    if (!users.isEmpty())
+        delta.setList(Users, users);
+    if (!removed.isEmpty())
+        delta.setList(RemovedUsers, removed);
+    return ServerWorker::encodeData(delta);
+}
+
+void PresenceRoster::rebuildSnapshot()
+{
+    QStringList users;
+    users.reserve(m_entries.size());
+    for (auto i = m_entries.cbegin(); i != m_entries.cend(); ++i)
+        users.append(formatUser(i->userName, i.key(), i->status));
+    ChatMessage reply;
+    reply.setString(DataType, QStringLiteral("login"));
+    reply.setBoolean(Success, true);
+    reply.setInteger(RosterVersion, qint64(m_version));
+    if (!users.isEmpty())
+        reply.setList(Users, users);
+    m_snapshotFrame = ServerWorker::encodeData(reply);
+    m_snapshotVersion = m_version;
+}
@@ -0,0 +1,57 @@
+#ifndef PRESENCEROSTER_H
+#define PRESENCEROSTER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <deque>
+
+class ServerWorker;
+
+// Thread safe, versioned list of the logged in users.
+// Every join, leave and status change makes a new version and is kept in a bounded log,
+// so a client that knows a recent version only needs the changes since then.
+// The full list is encoded once into a snapshot frame shared by the following logins,
+// and only rebuilt when the changes logged since it grow too many
+class PresenceRoster
+{
+    Q_DISABLE_COPY(PresenceRoster)
+public:
+    PresenceRoster();
+    quint64 version() const;
+    quint64 join(ServerWorker *owner, const QString &uid, const QString &userName, int status);
+    quint64 leave(ServerWorker *owner, const QString &uid);
+    quint64 setStatus(ServerWorker *owner, const QString &uid, int status);
+    bool replaceOwner(const QString &uid, ServerWorker *previous, ServerWorker *owner);
+    QVector<QByteArray> loginFrames(quint64 knownVersion);
+    QByteArray changesFrame(quint64 since, quint64 *version);
+    static QString formatUser(const QString &userName, const QString &uid, int status);
+private:
+    struct Entry {
+        ServerWorker *owner;
+        QString userName;
+        int status;
+    };
+    struct Change {
+        quint64 version;
+        QString uid;
+        QString userName;
+        int status;
+        bool removed;
+    };
+    void logChange(const QString &uid, const QString &userName, int status, bool removed);
+    bool hasChangesSince(quint64 version) const;
+    QByteArray deltaFrame(const QString &dataType, quint64 since) const;
+    void rebuildSnapshot();
+
+    mutable QMutex m_lock;
+    quint64 m_version;
+    QHash<QString, Entry> m_entries;
+    std::deque<Change> m_changes;
+    QByteArray m_snapshotFrame;
+    quint64 m_snapshotVersion{0};
+};
+
+#endif // PRESENCEROSTER_H
@@ -1,42 +1,64 @@
 #include "server.h"
 
 #include "chatserver.h"
-
-#include <QDateTime>
+#include "logger.h"
 
 Server::Server(QObject *parent)
     : QObject(parent)
     , m_chatServer(new ChatServer(this))
 {
-    connect(m_chatServer, &ChatServer::logMessage, this, &Server::logMessage);
 }
 
 void Server::toggleStartServer()
 {
-    if (m_chatServer->isListening()) {
+    if (m_chatServer->isRunning()) {
         m_chatServer->stopServer();
-        logMessage(MessageType::Info, QStringLiteral("Server Stopped"));
+        CHAT_LOG(MessageType::Info, "Server Stopped");
     } else {
-        if (!m_chatServer->listen(QHostAddress::Any, SERVER_PORT)) {
-            logMessage(MessageType::Critical, QStringLiteral("Unable to start the server"));
+        if (!m_chatServer->start(QHostAddress::Any, SERVER_PORT)) {
+            CHAT_LOG(MessageType::Critical, "Unable to start the server");
             return;
         }
-        logMessage(MessageType::Info, QStringLiteral("Server Started"));
+        CHAT_LOG(MessageType::Info, "Server Started");
     }
 }
 
-void Server::logMessage(MessageType type, const QString &msg)
+void Server::setRoutingMode(RoutingMode mode)
 {
-    auto dt = QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs);
-    switch(type) {
-        case MessageType::Info:
-            qDebug()    << dt << QStringLiteral("INFO:   ") << msg;
-            break;
-        case MessageType::Warning:
-            qWarning()  << dt << QStringLiteral("WARNING:") << msg;
-            break;
-        case MessageType::Critical:
-            qCritical() << dt << QStringLiteral("ERROR:  ") << msg;
-            break;
-    }
+    m_chatServer->setRoutingMode(mode);
+}
+
+void Server::setMigrationEnabled(bool enabled)
+{
+    m_chatServer->setMigrationEnabled(enabled);
+}
+
+void Server::setAcceptMode(AcceptMode mode)
+{
+    m_chatServer->setAcceptMode(mode);
+}
+
+void Server::setOutputLimits(const OutputLimits &limits)
+{
+    m_chatServer->setOutputLimits(limits);
+}
+
+void Server::setFlushDelay(int msec)
+{
+    m_chatServer->setFlushDelay(msec);
+}
+
+void Server::setPresenceWindow(int msec)
+{
+    m_chatServer->setPresenceWindow(msec);
+}
+
+bool Server::openStore(const QString &directory)
+{
+    return m_chatServer->openStore(directory);
+}
+
+void Server::setResumeGrace(int seconds)
+{
+    m_chatServer->setResumeGrace(seconds);
 }
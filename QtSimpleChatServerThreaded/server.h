@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include "enums.h"
+#include "outputqueue.h"
 
 class ChatServer;
 
@@ -13,10 +14,16 @@ class Server : public QObject
 public:
     explicit Server(QObject *parent = nullptr);
     void toggleStartServer();
+    void setRoutingMode(RoutingMode mode);
+    void setMigrationEnabled(bool enabled);
+    void setAcceptMode(AcceptMode mode);
+    void setOutputLimits(const OutputLimits &limits);
+    void setFlushDelay(int msec);
+    void setPresenceWindow(int msec);
+    bool openStore(const QString &directory);
+    void setResumeGrace(int seconds);
 private:
     ChatServer *m_chatServer;
-private slots:
-    void logMessage(MessageType type, const QString &msg);
 };
 
 #endif // SERVER_H
@@ -1,15 +1,101 @@
 #include <QCoreApplication>
+#include <QCommandLineParser>
 #include <QDebug>
 
 #include "server.h"
 #include "enums.h"
+#include "chatmessage.h"
+#include "logger.h"
 
 int main(int argc, char *argv[])
 {
     QCoreApplication a(argc, argv);
-    qRegisterMetaType<MessageType>();
-    qRegisterMetaType<QMap<int, QVariant>>();
+    qRegisterMetaType<ChatMessage>();
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption routingOption(QStringLiteral("routing"),
+                                     QStringLiteral("Where messages are routed: \"threads\" (default) or \"main\"."),
+                                     QStringLiteral("mode"), QStringLiteral("threads"));
+    QCommandLineOption logFileOption(QStringLiteral("log-file"),
+                                     QStringLiteral("Append the log to <file> instead of stderr."),
+                                     QStringLiteral("file"));
+    QCommandLineOption logLevelOption(QStringLiteral("log-level"),
+                                      QStringLiteral("Lowest level logged: \"info\" (default), \"warning\" or \"error\"."),
+                                      QStringLiteral("level"), QStringLiteral("info"));
+    QCommandLineOption acceptOption(QStringLiteral("accept"),
+                                    QStringLiteral("How connections are accepted: \"single\" (default) or \"reuseport\" (one listening socket per thread)."),
+                                    QStringLiteral("mode"), QStringLiteral("single"));
+    QCommandLineOption migrateOption(QStringLiteral("migrate"),
+                                     QStringLiteral("Move idle sessions of busy threads to less busy ones."));
+    QCommandLineOption outputLimitOption(QStringLiteral("output-limit"),
+                                         QStringLiteral("KiB queued for a client that does not read before it is dealt with (default 1024)."),
+                                         QStringLiteral("kib"), QStringLiteral("1024"));
+    QCommandLineOption slowConsumerOption(QStringLiteral("slow-consumer"),
+                                          QStringLiteral("What happens to a client over the output limit: \"coalesce\" (default), \"drop-presence\" or \"disconnect\"."),
+                                          QStringLiteral("policy"), QStringLiteral("coalesce"));
+    QCommandLineOption flushDelayOption(QStringLiteral("flush-delay"),
+                                        QStringLiteral("Milliseconds outgoing frames may wait to be written together (default 0: end of the current batch)."),
+                                        QStringLiteral("ms"), QStringLiteral("0"));
+    QCommandLineOption presenceWindowOption(QStringLiteral("presence-window"),
+                                            QStringLiteral("Milliseconds of joins, leaves and status changes broadcast as one presence batch, 0 to broadcast each one (default 100)."),
+                                            QStringLiteral("ms"), QStringLiteral("100"));
+    QCommandLineOption storeOption(QStringLiteral("store"),
+                                   QStringLiteral("Keep the messages in <directory> and answer the history requests."),
+                                   QStringLiteral("directory"));
+    QCommandLineOption resumeGraceOption(QStringLiteral("resume-grace"),
+                                         QStringLiteral("Seconds a dropped session can be resumed by its client, 0 to end it at once (default 30)."),
+                                         QStringLiteral("seconds"), QStringLiteral("30"));
+    parser.addOption(routingOption);
+    parser.addOption(storeOption);
+    parser.addOption(resumeGraceOption);
+    parser.addOption(presenceWindowOption);
+    parser.addOption(flushDelayOption);
+    parser.addOption(outputLimitOption);
+    parser.addOption(slowConsumerOption);
+    parser.addOption(acceptOption);
+    parser.addOption(migrateOption);
+    parser.addOption(logFileOption);
+    parser.addOption(logLevelOption);
+    parser.process(a);
+
+    const QString logLevel = parser.value(logLevelOption);
+    if (logLevel == QLatin1String("warning"))
+        Logger::setLevel(MessageType::Warning);
+    else if (logLevel == QLatin1String("error"))
+        Logger::setLevel(MessageType::Critical);
+    if (!Logger::instance().start(parser.value(logFileOption))) {
+        qCritical() << "Unable to open the log file" << parser.value(logFileOption);
+        return 1;
+    }
+
     Server server;
+    if (parser.isSet(storeOption) && !server.openStore(parser.value(storeOption))) {
+        qCritical() << "Unable to open the message store" << parser.value(storeOption);
+        Logger::instance().stop();
+        return 1;
+    }
+    if (parser.value(routingOption) == QLatin1String("main"))
+        server.setRoutingMode(RoutingMode::MainThread);
+    if (parser.value(acceptOption) == QLatin1String("reuseport"))
+        server.setAcceptMode(AcceptMode::ReusePort);
+    OutputLimits outputLimits;
+    outputLimits.maxQueued = qMax(1, parser.value(outputLimitOption).toInt()) * qint64(1024);
+    // the socket buffer is allowed a quarter of the limit before frames are queued
+    outputLimits.highWatermark = qMax<qint64>(outputLimits.maxQueued / 4, 1024);
+    outputLimits.lowWatermark = outputLimits.highWatermark / 4;
+    const QString slowConsumer = parser.value(slowConsumerOption);
+    if (slowConsumer == QLatin1String("disconnect"))
+        outputLimits.policy = SlowConsumerPolicy::Disconnect;
+    else if (slowConsumer == QLatin1String("drop-presence"))
+        outputLimits.policy = SlowConsumerPolicy::DropPresence;
+    server.setOutputLimits(outputLimits);
+    server.setFlushDelay(parser.value(flushDelayOption).toInt());
+    server.setPresenceWindow(parser.value(presenceWindowOption).toInt());
+    server.setResumeGrace(parser.value(resumeGraceOption).toInt());
+    server.setMigrationEnabled(parser.isSet(migrateOption));
     server.toggleStartServer();
-    return a.exec();
+    const int result = a.exec();
+    Logger::instance().stop();
+    return result;
 }
@@ -1,13 +1,21 @@
 #include "serverworker.h"
+#include "logger.h"
+#include "threadcontext.h"
 #include <QDataStream>
 #include <QCborValue>
+#include <QThread>
+
+// gathered bytes written without waiting for the end of the batch
+constexpr int MAX_CORK_SIZE = 64 * 1024;
+// bytes of the last frames kept to resume the session
+constexpr qint64 MAX_REPLAY_BYTES = 64 * 1024;
 
 
 ServerWorker::ServerWorker(QObject *parent)
     : QObject(parent)
-    , m_socket(this), m_reader(&m_socket), m_writer(&m_socket)
+    , m_socket(this), m_writer(&m_socket)
+    , m_session(new SessionInfo)
 {
-
     connect(&m_socket, &QTcpSocket::connected, this, [this](){
         if (!m_socket.isOpen()) {
             // qDebug() << "Error: socket is not open";
@@ -16,14 +24,14 @@ ServerWorker::ServerWorker(QObject *parent)
             // qDebug() << "No writer device set";
             m_writer.setDevice(&m_socket);
         }
-        if (!m_reader.device()) {
-            // qDebug() << "No reader device set";
-            m_reader.setDevice(&m_socket);
-        }
     });
 
     connect(&m_socket, &QTcpSocket::readyRead, this, &ServerWorker::receiveData);
-    connect(&m_socket, &QTcpSocket::disconnected, this, &ServerWorker::disconnectedFromClient);
+    connect(&m_socket, &QTcpSocket::bytesWritten, this, &ServerWorker::flushQueue);
+    connect(&m_socket, &QTcpSocket::disconnected, this, [this]() {
+        suspend();
+        emit disconnectedFromClient();
+    });
 #if (QT_VERSION < QT_VERSION_CHECK(5, 15, 0))
     connect(m_serverSocket, QOverload<QAbstractSocket::SocketError>::of(&QAbstractSocket::error), this, &ServerWorker::error);
 #else
@@ -36,9 +44,14 @@ ServerWorker::ServerWorker(QObject *parent)
 ServerWorker::~ServerWorker()
 {
     if (m_writeOpened && m_socket.state() != QAbstractSocket::UnconnectedState) {
+        flush();
         m_writer.endArray();
         m_socket.waitForBytesWritten(2000);
     }
+    if (m_successor)
+        m_successor->deref();
+    delete m_session.load(std::memory_order_relaxed);
+    qDeleteAll(m_retiredSessions);
 }
 
 
@@ -47,63 +60,275 @@ bool ServerWorker::setSocketDescriptor(qintptr socketDescriptor)
     return m_socket.setSocketDescriptor(socketDescriptor);
 }
 
-void ServerWorker::sendData(const QMap<int, QVariant> &data)
+QByteArray ServerWorker::encodeData(const ChatMessage &message)
 {
-    // qDebug() << "Sending"<<data;
-    if (!m_writeOpened) {
-        // qDebug() << "starting the main array";
-        m_writer.startArray();
-        m_writeOpened = true;
-    }
-    m_writer.startMap(data.size());
-    for (auto i = data.cbegin(); i != data.cend(); ++i)
-    {
-        m_writer.append(i.key());
-        switch (i.value().type()) {
-            case QVariant::Bool: m_writer.append(i.value().toBool()); break;
-            case QVariant::Int: m_writer.append(i.value().toInt()); break;
-            case QVariant::UInt: m_writer.append(i.value().toUInt()); break;
-            case QVariant::LongLong: m_writer.append(i.value().toLongLong()); break;
-            case QVariant::ULongLong: m_writer.append(i.value().toULongLong()); break;
-            case QVariant::Double: m_writer.append(i.value().toDouble()); break;
-            case QVariant::Char: m_writer.append(i.value().toString()); break;
-            case QVariant::Map: { // QMap<QString, QString>
-                auto map = i.value().toMap();
-                m_writer.startMap(map.size());
-                for (auto j = map.cbegin(); j != map.cend(); ++j) {
-                    m_writer.append(j.key());
-                    m_writer.append(j.value().toString());
+    QByteArray frame;
+    QCborStreamWriter writer(&frame);
+    writer.startMap(message.size());
+    for (int key = 0; key < ChatMessage::FieldCount; ++key) {
+        const Type field = Type(key);
+        if (!message.contains(field))
+            continue;
+        writer.append(key);
+        switch (ChatMessage::kind(field)) {
+            case ChatMessage::FieldKind::String:
+                if (message.isView(field)) {
+                    // forwarded as received, no conversion to UTF-16 and back
+                    const QByteArray utf8 = message.utf8(field);
+                    writer.appendTextString(utf8.constData(), utf8.size());
+                } else {
+                    writer.append(message.string(field));
                 }
-                m_writer.endMap();
                 break;
-            }
-            case QVariant::List: { // QList<QVariant>
-                auto list = i.value().toList();
-                m_writer.startArray(list.size());
-                for (auto j = 0; j < list.size(); ++j) {
-                    m_writer.append(list.at(j).toString());
-                }
-                m_writer.endArray();
-                break;
-            }
-            case QVariant::String: m_writer.append(i.value().toString()); break;
-            case QVariant::StringList: {
-                auto list = i.value().toStringList();
-                m_writer.startArray(list.size());
-                for (auto j = 0; j < list.size(); ++j) {
-                    m_writer.append(list.at(j));
-                }
-                m_writer.endArray();
-                break;
-            }
-            case QVariant::ByteArray: m_writer.append(i.value().toByteArray()); break;
-            default: {
-                emit logMessage(MessageType::Critical, QString("Unknown type of data: %1").arg(i.key()));
+            case ChatMessage::FieldKind::Integer: writer.append(message.integer(field)); break;
+            case ChatMessage::FieldKind::Boolean: writer.append(message.boolean(field)); break;
+            case ChatMessage::FieldKind::StringList: {
+                const QStringList list = message.list(field);
+                writer.startArray(list.size());
+                for (const QString &item : list)
+                    writer.append(item);
+                writer.endArray();
                 break;
             }
         }
     }
-    m_writer.endMap();
+    for (const auto &extra : message.extraFields()) {
+        writer.append(extra.first);
+        extra.second.toCbor(writer);
+    }
+    writer.endMap();
+    return frame;
+}
+
+void ServerWorker::setOutputLimits(const OutputLimits &limits)
+{
+    m_outputLimits = limits;
+}
+
+// Where the private messages of a suspended session go when they cannot be replayed
+void ServerWorker::setMailboxes(OfflineMailboxes *mailboxes)
+{
+    m_mailboxes = mailboxes;
+}
+
+// forwarded is set for the frames posted to the previous thread of a migrated worker,
+// they are older than the held ones
+void ServerWorker::sendFrame(const OutgoingFrame &frame, bool forwarded)
+{
+    if (!forwarded && m_holding.load(std::memory_order_acquire)) {
+        // the frames of the previous connection or thread go first, see resume() and migrateTo()
+        m_held.append(frame);
+        return;
+    }
+    if (m_successor) {
+        // posted before the session was handed over
+        ThreadContext::postTo(m_successor, frame);
+        return;
+    }
+    if (m_socket.state() != QAbstractSocket::ConnectedState) {
+        if (m_suspended)
+            record(frame.data, frame.isPrivate);
+        return;
+    }
+    if (!m_writeOpened) {
+        // qDebug() << "starting the main array";
+        m_writer.startArray();
+        m_writeOpened = true;
+    }
+    if (m_outputQueue.isEmpty() && m_socket.bytesToWrite() + m_cork.size() < m_outputLimits.highWatermark) {
+        cork(frame.data);
+        return;
+    }
+    // the client does not keep up, the frame waits for bytesWritten()
+    if (m_outputLimits.policy == SlowConsumerPolicy::Coalesce && m_outputQueue.replacePresence(frame)) {
+        threadContext()->addCoalesced();
+        return;
+    }
+    m_outputQueue.enqueue(frame);
+    if (m_outputQueue.bytes() > m_outputLimits.maxQueued)
+        handleOverflow();
+}
+
+// Counts a frame put on the stream and keeps it for a replay if the session can be resumed.
+// The count starts with the connection, like the client's
+void ServerWorker::record(const QByteArray &data, bool undelivered)
+{
+    ++m_sentFrames;
+    if (readSession(&SessionInfo::token).isEmpty())
+        return;
+    m_replay.push_back(Recorded{data, undelivered});
+    m_replayBytes += data.size();
+    while (m_replayBytes > MAX_REPLAY_BYTES && m_replay.size() > 1) {
+        const Recorded &oldest = m_replay.front();
+        // it can no longer be replayed, the user gets it at the next login
+        if (oldest.undelivered)
+            keepOffline(oldest.data);
+        m_replayBytes -= oldest.data.size();
+        m_replay.pop_front();
+    }
+}
+
+void ServerWorker::keepOffline(const QByteArray &data)
+{
+    if (m_mailboxes)
+        m_mailboxes->store(uid(), data);
+}
+
+// Moves the private messages recorded since the connection dropped to the offline mailbox,
+// for a session that will not be resumed. Returns true if there were some
+bool ServerWorker::spillUndelivered()
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    bool spilled = false;
+    for (Recorded &frame : m_replay) {
+        if (!frame.undelivered)
+            continue;
+        keepOffline(frame.data);
+        frame.undelivered = false;
+        spilled = true;
+    }
+    return spilled;
+}
+
+// A resumable session goes on recording the frames sent to it once disconnected
+void ServerWorker::suspend()
+{
+    if (readSession(&SessionInfo::token).isEmpty())
+        return;
+    m_suspended = true;
+    // what was waiting for the socket counts as sent, the client asks for it again
+    OutgoingFrame frame;
+    while (m_outputQueue.dequeue(&frame))
+        record(frame.data, frame.isPrivate);
+}
+
+// Copies the frames following the received first ones, to be called from the thread
+// of the worker once it is disconnected. Fails when some of them are no longer kept
+bool ServerWorker::replayFrom(quint64 received, QVector<QByteArray> *frames) const
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    const quint64 first = m_sentFrames - m_replay.size();
+    if (received < first || received > m_sentFrames)
+        return false;
+    for (auto it = m_replay.cbegin() + qint64(received - first); it != m_replay.cend(); ++it)
+        frames->append(it->data);
+    return true;
+}
+
+// Keeps the frames posted from now on until resume(), callable from any thread
+void ServerWorker::holdOutput()
+{
+    m_holding.store(true, std::memory_order_release);
+}
+
+// Takes over a session of which the client received the first received frames:
+// frames are sent, then what was held meanwhile
+void ServerWorker::resume(quint64 received, const QVector<QByteArray> &frames)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    m_sentFrames = received;
+    m_replay.clear();
+    m_replayBytes = 0;
+    for (const QByteArray &data : frames)
+        sendFrame(OutgoingFrame{data, QString()}, true);
+    releaseOutput();
+    // not sent from a drain, nothing else would flush them
+    flush();
+}
+
+// Sends what was held since holdOutput(), from the thread of the worker
+void ServerWorker::releaseOutput()
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    m_holding.store(false, std::memory_order_release);
+    const QVector<OutgoingFrame> held = m_held;
+    m_held.clear();
+    for (const OutgoingFrame &frame : held)
+        sendFrame(frame);
+}
+
+// The frames still reaching this worker are passed on, from its own thread
+void ServerWorker::setSuccessor(ServerWorker *successor)
+{
+    Q_ASSERT(thread() == QThread::currentThread() && !m_successor);
+    successor->ref();
+    m_successor = successor;
+}
+
+// Keeps the worker from being deleted. Callable from any thread by a holder that knows
+// the worker is still alive: its own thread, a shard lock, the registry or a reference
+void ServerWorker::ref()
+{
+    m_references.fetch_add(1, std::memory_order_relaxed);
+}
+
+// The last reference released deletes the worker in its own thread
+void ServerWorker::deref()
+{
+    if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        deleteLater();
+}
+
+void ServerWorker::cork(const QByteArray &data)
+{
+    if (m_cork.isEmpty())
+        threadContext()->scheduleFlush(this);
+    // the first frame is only shared, the copies start with the second one
+    m_cork.append(data);
+    record(data);
+    m_bytesActivity.fetch_add(quint64(data.size()), std::memory_order_relaxed);
+    m_messagesActivity.fetch_add(1, std::memory_order_relaxed);
+    threadContext()->addSent(data.size());
+    if (m_cork.size() >= MAX_CORK_SIZE)
+        flush();
+}
+
+// Writes the gathered frames with a single call
+void ServerWorker::flush()
+{
+    if (m_cork.isEmpty())
+        return;
+    m_socket.write(m_cork);
+    m_cork = QByteArray();
+}
+
+void ServerWorker::writeFrame(const QByteArray &data)
+{
+    // the frame is a complete CBOR map, so it can go straight to the socket
+    m_socket.write(data);
+    record(data);
+    m_bytesActivity.fetch_add(quint64(data.size()), std::memory_order_relaxed);
+    m_messagesActivity.fetch_add(1, std::memory_order_relaxed);
+    threadContext()->addSent(data.size());
+}
+
+void ServerWorker::flushQueue()
+{
+    // the gathered frames are older than the queued ones
+    flush();
+    if (m_outputQueue.isEmpty() || m_socket.bytesToWrite() > m_outputLimits.lowWatermark)
+        return;
+    OutgoingFrame frame;
+    while (m_socket.bytesToWrite() < m_outputLimits.highWatermark && m_outputQueue.dequeue(&frame))
+        writeFrame(frame.data);
+}
+
+void ServerWorker::handleOverflow()
+{
+    if (m_outputLimits.policy != SlowConsumerPolicy::Disconnect) {
+        const int dropped = m_outputQueue.dropPresence(m_outputLimits.maxQueued);
+        if (dropped > 0)
+            threadContext()->addDropped(dropped);
+        if (m_outputQueue.bytes() <= m_outputLimits.maxQueued)
+            return;
+    }
+    CHAT_LOG(MessageType::Warning, "Disconnecting %1: %2 bytes waiting to be sent",
+             uid(), m_outputQueue.bytes() + m_socket.bytesToWrite());
+    threadContext()->addSlowConsumer();
+    m_outputQueue.clear();
+    m_cork = QByteArray();
+    // nothing else will be written, the pending data is discarded
+    m_socket.abort();
 }
 
 // bool ServerWorker::messageProcessed(int messageID) const
@@ -123,225 +348,173 @@ void ServerWorker::sendData(const QMap<int, QVariant> &data)
 
 void ServerWorker::disconnectFromClient()
 {
+    flush();
     m_socket.disconnectFromHost();
 }
 
-QString ServerWorker::userName() const
+SessionInfo ServerWorker::session() const
 {
-    m_userNameLock.lockForRead();
-    const QString result = m_userName;
-    m_userNameLock.unlock();
-    return result;
+    m_sessionReaders.fetch_add(1);
+    const SessionInfo info = *m_session.load();
+    m_sessionReaders.fetch_sub(1);
+    return info;
 }
 
-void ServerWorker::setUserName(const QString &userName)
+// Copies one field of the current record, the rest is not touched
+template <typename T>
+T ServerWorker::readSession(T SessionInfo::*field) const
 {
-    m_userNameLock.lockForWrite();
-    m_userName = userName;
-    m_userNameLock.unlock();
+    m_sessionReaders.fetch_add(1);
+    const T value = m_session.load()->*field;
+    m_sessionReaders.fetch_sub(1);
+    return value;
 }
 
-QString ServerWorker::uid() const
+// Publishes a modified copy of the current record, whichever thread the change comes from.
+// A reader announces itself before loading the record, so once the swap is done and no reader
+// is left, no one can still be copying from the replaced records and they are freed
+template <typename Change>
+void ServerWorker::updateSession(Change change)
 {
-    m_uidLock.lockForRead();
-    const QString result = m_uid;
-    m_uidLock.unlock();
-    return result;
+    // the record is copied from like any reader does
+    m_sessionReaders.fetch_add(1);
+    const SessionInfo *current = m_session.load();
+    SessionInfo *next = new SessionInfo(*current);
+    change(next);
+    while (!m_session.compare_exchange_weak(current, next)) {
+        // someone else published first, the change applies to the newer record
+        *next = *current;
+        change(next);
+    }
+    m_sessionReaders.fetch_sub(1);
+    QMutexLocker locker(&m_retiredLock);
+    m_retiredSessions.append(current);
+    if (m_sessionReaders.load() == 0) {
+        qDeleteAll(m_retiredSessions);
+        m_retiredSessions.clear();
+    }
 }
 
-void ServerWorker::setUid(
-    const QString &uid)
+QString ServerWorker::userName() const
 {
-    m_uidLock.lockForWrite();
-    m_uid = uid;
-    m_uidLock.unlock();
+    return readSession(&SessionInfo::userName);
 }
 
-int ServerWorker::status() const
+QString ServerWorker::uid() const
 {
-    m_statusLock.lockForRead();
-    const int result = m_status;
-    m_statusLock.unlock();
-    return result;
+    return readSession(&SessionInfo::uid);
 }
 
-void ServerWorker::receiveData()
+void ServerWorker::setIdentity(const QString &userName, const QString &uid)
 {
-    m_reader.reparse();
-    // qDebug() << "last reader error:"<<m_reader.lastError().toString();
-
-    // Протокол:
-    // [
-    // {Type, Val}
-    // ...
-    // ]
-
-    while (m_reader.lastError() == QCborError::NoError) {
-        if (!m_started) {
-            // qDebug() << "not started yet";
-            if (!m_reader.isArray()) {
-                // qDebug() << "Error: must be an array";
-                break; // protocol error
-            }
-            // qDebug() << "entering the main array";
-            m_reader.enterContainer();
-            m_started = true;
-        }
-        else if (m_reader.containerDepth() == 1) {
-            // qDebug() << "we are at depth 1";
-            if (!m_reader.hasNext()) {
-                // qDebug() << "nothing to read, disconnecting...";
-                m_reader.leaveContainer();
-                // disconnectFromHost();
-                return;
-            }
-
-            if (!m_reader.isMap() || !m_reader.isLengthKnown()) {
-                // qDebug() << "Error: must be a map";
-                break; // protocol error
-            }
-            // qDebug() << "we are at a map. Receiving message";
-            m_leftToRead = m_reader.length();
-            // qDebug() << "message size is"<<m_leftToRead;
-            m_reader.enterContainer();
-            m_receivedData.clear();
-        }
-        else if (m_lastMessageType == Unknown) {
-            // qDebug() << "reading message type";
-            if (!m_reader.isInteger()) {
-                // qDebug() << "Error: message type must be an integer";
-                break; // protocol error
-            }
-            m_lastMessageType = Type(m_reader.toInteger());
-            // qDebug() << "message type"<<m_lastMessageType;
-            m_reader.next();
-        }
-        else {
-            // qDebug() << "reading payload";
-            switch (m_reader.type()) {
-                case QCborStreamReader::UnsignedInteger:
-                case QCborStreamReader::NegativeInteger: {
-                    m_receivedData.insert(m_lastMessageType, m_reader.toInteger());
-                    m_reader.next();
-                    break;
-                }
-                case QCborStreamReader::Float:
-                case QCborStreamReader::Double: {
-                    m_receivedData.insert(m_lastMessageType, m_reader.toDouble());
-                    m_reader.next();
-                    break;
-                }
-                case QCborStreamReader::ByteString: {
-                    m_receivedData.insert(m_lastMessageType, handleByteArray());
-                    break;
-                }
-                case QCborStreamReader::TextString: {
-                    m_receivedData.insert(m_lastMessageType, handleString());
-                    break;
-                }
-                case QCborStreamReader::Array: {
-                    m_receivedData.insert(m_lastMessageType, handleArray());
-                    break;
-                }
-                case QCborStreamReader::Map: {
-                    m_receivedData.insert(m_lastMessageType, handleMap());
-                    break;
-                }
-                case QCborStreamReader::SimpleType: { // treat as bool
-                    m_receivedData.insert(m_lastMessageType, m_reader.toBool());
-                    m_reader.next();
-                    break;
-                }
-                default: {
-                    // qDebug() << "Error: unknown message payload";
-                    m_reader.next(); // skip unknown value
-                    break;
-                }
-            }
-            m_leftToRead--;
-            // qDebug() << "read so far:"<<m_receivedData;
-            // qDebug() << "left to read:"<<m_leftToRead;
-
-            if (m_leftToRead == 0) {
-                m_reader.leaveContainer();
-                // qDebug() << "The total message data:"<<m_receivedData;
-                if (m_receivedData.contains(Type::Status)) {
-                    m_statusLock.lockForWrite();
-                    m_status = m_receivedData[Type::Status].toInt();
-                    m_statusLock.unlock();
-                }
-                emit dataReceived(m_receivedData);
-            }
-            m_lastMessageType = Unknown;
-        }
-    }
-
-    if (m_reader.lastError() != QCborError::NoError) {
-        emit logMessage(MessageType::Warning, QLatin1String("Invalid message: ") + m_reader.lastError().toString());
-    }
+    updateSession([&](SessionInfo *info) {
+        info->userName = userName;
+        info->uid = uid;
+    });
 }
 
-QByteArray ServerWorker::handleByteArray()
+int ServerWorker::status() const
 {
-    QByteArray result;
-    auto r = m_reader.readByteArray();
-    while (r.status == QCborStreamReader::Ok) {
-        result += r.data;
-        r = m_reader.readByteArray();
-    }
-
-    if (r.status == QCborStreamReader::Error)
-        result.clear();
-
-    return result;
+    return readSession(&SessionInfo::status);
 }
 
-QString ServerWorker::handleString()
+void ServerWorker::setStatus(int status)
 {
-    QString result;
-    auto r = m_reader.readString();
-    while (r.status == QCborStreamReader::Ok) {
-        result += r.data;
-        r = m_reader.readString();
-    }
-
-    if (r.status == QCborStreamReader::Error)
-        result.clear();
-
-    return result;
+    updateSession([status](SessionInfo *info) {
+        info->status = status;
+    });
 }
 
-QVariantList ServerWorker::handleArray()
+void ServerWorker::setSessionToken(const QString &token)
 {
-    QVariantList result;
-
-    if (m_reader.isLengthKnown())
-        result.reserve(m_reader.length());
+    updateSession([&token](SessionInfo *info) {
+        info->token = token;
+    });
+}
 
-    m_reader.enterContainer();
-    while (m_reader.lastError() == QCborError::NoError && m_reader.hasNext())
-        result.append(handleString());
+ThreadContext *ServerWorker::threadContext() const
+{
+    return m_threadContext.load(std::memory_order_acquire);
+}
 
-    if (m_reader.lastError() == QCborError::NoError)
-        m_reader.leaveContainer();
+void ServerWorker::setThreadContext(ThreadContext *context)
+{
+    m_threadContext.store(context, std::memory_order_release);
+    const int index = context ? context->index() : -1;
+    updateSession([index](SessionInfo *info) {
+        info->threadIndex = index;
+    });
+}
 
-    return result;
+// Returns the traffic since the last call, in the units of ThreadLoad::score()
+double ServerWorker::takeActivity()
+{
+    const quint64 bytes = m_bytesActivity.exchange(0, std::memory_order_relaxed);
+    const quint64 messages = m_messagesActivity.exchange(0, std::memory_order_relaxed);
+    return messages + bytes / 4096.0;
 }
 
-QVariantMap ServerWorker::handleMap()
+void ServerWorker::migrateTo(ThreadContext *target)
 {
-    QVariantMap result;
+    Q_ASSERT(thread() == QThread::currentThread());
+    ThreadContext *current = threadContext();
+    if (!target || target == current || m_socket.state() != QAbstractSocket::ConnectedState)
+        return;
+    // only a session with nothing in flight is moved, and not while a resume holds its output
+    if (m_socket.bytesAvailable() > 0 || m_socket.bytesToWrite() > 0 || !m_outputQueue.isEmpty() || !m_cork.isEmpty()
+            || m_holding.load(std::memory_order_acquire))
+        return;
+    // the frames posted to the new thread wait for those still in the mailbox of this one:
+    // its drain() forwards them, then the release marker queued last
+    holdOutput();
+    moveToThread(target->thread());
+    ThreadContext::moveClient(this, current, target);
+    current->postRelease(this);
+    // deleted with the threads when the server stops
+    disconnect(current->thread(), &QThread::finished, this, &QObject::deleteLater);
+    connect(target->thread(), &QThread::finished, this, &QObject::deleteLater);
+    CHAT_LOG(MessageType::Info, "%1 moved from thread %2 to thread %3", uid(), current->index(), target->index());
+}
 
-    m_reader.enterContainer();
-    while (m_reader.lastError() == QCborError::NoError && m_reader.hasNext()) {
-        QString key = handleString();
-        result.insert(key, handleString());
+void ServerWorker::receiveData()
+{
+    // Протокол:
+    // [
+    // {Type, Val}
+    // ...
+    // ]
+    const QByteArray chunk = m_socket.readAll();
+    m_bytesActivity.fetch_add(quint64(chunk.size()), std::memory_order_relaxed);
+    threadContext()->addReceived(chunk.size(), 0);
+    m_parser.append(chunk);
+    for (;;) {
+        switch (m_parser.next(&m_receivedData)) {
+            case MessageParser::Message:
+                if (m_receivedData.contains(Type::Status)) {
+                    const int status = int(m_receivedData.integer(Type::Status));
+                    if (status != this->status()) {
+                        updateSession([status](SessionInfo *info) {
+                            info->status = status;
+                        });
+                    }
+                }
+                m_messagesActivity.fetch_add(1, std::memory_order_relaxed);
+                threadContext()->addReceived(0, 1);
+                emit dataReceived(m_receivedData);
+                break;
+            case MessageParser::NeedMoreData:
+                return;
+            case MessageParser::EndOfStream:
+                // the client said goodbye, its session is not kept for a resume
+                if (!readSession(&SessionInfo::token).isEmpty())
+                    setSessionToken(QString());
+                disconnectFromClient();
+                return;
+            case MessageParser::Error:
+                CHAT_LOG(MessageType::Warning, "Invalid message from %1: %2", uid(), m_parser.errorString());
+                // the stream cannot be resynchronised
+                m_socket.disconnectFromHost();
+                return;
+        }
     }
-
-    if (m_reader.lastError() == QCborError::NoError)
-        m_reader.leaveContainer();
-
-    return result;
 }
-
-
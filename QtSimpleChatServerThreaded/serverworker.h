@@ -3,16 +3,35 @@
 
 #include <QObject>
 #include <QTcpSocket>
-#include <QReadWriteLock>
+#include <QMutex>
 #include <QUuid>
 #include <QSet>
 
 #include "enums.h"
+#include "chatmessage.h"
+#include "messageparser.h"
+#include "outputqueue.h"
+#include "offlinemailboxes.h"
 
-#include <QCborStreamReader>
 #include <QCborStreamWriter>
+#include <atomic>
+#include <deque>
 
 
+class ThreadContext;
+
+// What other threads know of a session. A record is never modified once published,
+// a change publishes a new one so a reader gets a consistent view with a single load.
+// The records stay inside ServerWorker, session() hands out a copy
+struct SessionInfo
+{
+    QString userName;
+    QString uid;
+    int status{0}; //offline
+    int threadIndex{-1};
+    QString token; // empty if the session cannot be resumed
+};
+
 class ServerWorker : public QObject
 {
     Q_OBJECT
@@ -21,47 +40,90 @@ public:
     explicit ServerWorker(QObject *parent = nullptr);
     ~ServerWorker();
     virtual bool setSocketDescriptor(qintptr socketDescriptor);
+    SessionInfo session() const;
     QString userName() const;
-    void setUserName(const QString &userName);
     QString uid() const;
-    void setUid(const QString &uid);
+    void setIdentity(const QString &userName, const QString &uid);
     int status() const;
-    void sendData(const QMap<int, QVariant> &data);
+    void setStatus(int status);
+    void setSessionToken(const QString &token);
+    ThreadContext *threadContext() const;
+    void setThreadContext(ThreadContext *context);
+    double takeActivity();
+    static QByteArray encodeData(const ChatMessage &message);
+    void setOutputLimits(const OutputLimits &limits);
+    void setMailboxes(OfflineMailboxes *mailboxes);
+    void sendFrame(const OutgoingFrame &frame, bool forwarded = false);
+    void flush();
+    bool replayFrom(quint64 received, QVector<QByteArray> *frames) const;
+    void holdOutput();
+    void releaseOutput();
+    void resume(quint64 received, const QVector<QByteArray> &frames);
+    void setSuccessor(ServerWorker *successor);
+    bool spillUndelivered();
+    void ref();
+    void deref();
 
     // bool messageProcessed(int messageID) const;
     // void addMessage(int messageID);
 public slots:
     void disconnectFromClient();
+    void migrateTo(ThreadContext *target);
 private slots:
     // void receiveJson();
     void receiveData();
+    void flushQueue();
 signals:
-    void dataReceived(const QMap<int, QVariant> &data);
+    void dataReceived(const ChatMessage &data);
     void disconnectedFromClient();
     void error(int errorCode);
-    void logMessage(MessageType type, const QString &msg);
 private:
-    QByteArray handleByteArray();
-    QString handleString();
-    QVariantList handleArray();
-    QVariantMap handleMap();
-
     QTcpSocket m_socket;
-    QCborStreamReader m_reader;
+    MessageParser m_parser;
     QCborStreamWriter m_writer;
 
-    QString m_userName;
-    QString m_uid;
-    int m_status{0}; //offline
-    mutable QReadWriteLock m_userNameLock;
-    mutable QReadWriteLock m_uidLock;
-    mutable QReadWriteLock m_statusLock;
+    // the server's from the connection to the end of the session, plus one per holder
+    // that may outlive it, see deref()
+    std::atomic<int> m_references{1};
+    std::atomic<const SessionInfo *> m_session;
+    // threads copying from a record, the replaced records are freed once no one is left,
+    // see updateSession()
+    mutable std::atomic<int> m_sessionReaders{0};
+    QVector<const SessionInfo *> m_retiredSessions;
+    QMutex m_retiredLock;
+    std::atomic<ThreadContext *> m_threadContext{nullptr};
+    std::atomic<quint64> m_bytesActivity{0};
+    std::atomic<quint64> m_messagesActivity{0};
 
-    Type m_lastMessageType {Type::Unknown};
-    QMap<int, QVariant> m_receivedData;
-    bool m_started{false};
+    ChatMessage m_receivedData;
     bool m_writeOpened{false};
-    int m_leftToRead{0};
+    OutputLimits m_outputLimits;
+    OutputQueue m_outputQueue;
+    OfflineMailboxes *m_mailboxes{nullptr};
+    QByteArray m_cork; // frames gathered until the next flush()
+
+    // the frames of the session are counted, the last ones are kept to be replayed
+    // on a new connection after a disconnection
+    struct Recorded {
+        QByteArray data;
+        bool undelivered; // a private message recorded while suspended
+    };
+    quint64 m_sentFrames{0};
+    std::deque<Recorded> m_replay;
+    qint64 m_replayBytes{0};
+    bool m_suspended{false};
+    std::atomic<bool> m_holding{false};
+    QVector<OutgoingFrame> m_held;
+    ServerWorker *m_successor{nullptr}; // referenced
+
+    void record(const QByteArray &data, bool undelivered = false);
+    void keepOffline(const QByteArray &data);
+    void suspend();
+    void cork(const QByteArray &data);
+    void writeFrame(const QByteArray &data);
+    void handleOverflow();
+    template <typename Change> void updateSession(Change change);
+    template <typename T> T readSession(T SessionInfo::*field) const;
 };
 
 #endif // SERVERWORKER_H
@@ -0,0 +1,50 @@
+#include "suspendedsessions.h"
+#include <QMutexLocker>
+
+void SuspendedSessions::insert(const QString &token, ServerWorker *worker, qint64 expires)
+{
+    QMutexLocker locker(&m_lock);
+    m_sessions.insert(token, Entry{worker, expires});
+}
+
+ServerWorker *SuspendedSessions::take(const QString &token)
+{
+    QMutexLocker locker(&m_lock);
+    return m_sessions.take(token).worker;
+}
+
+// Returns false if the session of worker is not, or no longer, suspended
+bool SuspendedSessions::remove(ServerWorker *worker, const QString &token)
+{
+    QMutexLocker locker(&m_lock);
+    const auto entry = m_sessions.constFind(token);
+    if (entry == m_sessions.cend() || entry->worker != worker)
+        return false;
+    m_sessions.erase(entry);
+    return true;
+}
+
+QVector<ServerWorker *> SuspendedSessions::takeExpired(qint64 now)
+{
+    QVector<ServerWorker *> result;
+    QMutexLocker locker(&m_lock);
+    for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+        if (it->expires <= now) {
+            result.append(it->worker);
+            it = m_sessions.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return result;
+}
+
+QVector<ServerWorker *> SuspendedSessions::takeAll()
+{
+    QVector<ServerWorker *> result;
+    QMutexLocker locker(&m_lock);
+    for (const Entry &entry : qAsConst(m_sessions))
+        result.append(entry.worker);
+    m_sessions.clear();
+    return result;
+}
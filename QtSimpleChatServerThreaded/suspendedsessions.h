@@ -0,0 +1,34 @@
+#ifndef SUSPENDEDSESSIONS_H
+#define SUSPENDEDSESSIONS_H
+
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+
+class ServerWorker;
+
+// Thread safe table of the sessions whose connection dropped, by resume token.
+// A session waits here until a new connection takes it over or its grace period ends,
+// whoever takes it out of the table owns it
+class SuspendedSessions
+{
+    Q_DISABLE_COPY(SuspendedSessions)
+public:
+    SuspendedSessions() = default;
+    void insert(const QString &token, ServerWorker *worker, qint64 expires);
+    ServerWorker *take(const QString &token);
+    bool remove(ServerWorker *worker, const QString &token);
+    QVector<ServerWorker *> takeExpired(qint64 now);
+    QVector<ServerWorker *> takeAll();
+private:
+    struct Entry {
+        ServerWorker *worker;
+        qint64 expires;
+    };
+
+    QMutex m_lock;
+    QHash<QString, Entry> m_sessions;
+};
+
+#endif // SUSPENDEDSESSIONS_H
@@ -0,0 +1,312 @@
+#include "threadcontext.h"
+#include "serverworker.h"
+#include <QThread>
+#include <QTimer>
+
+// frames delivered before control goes back to the event loop
+constexpr int MAX_BATCH_SIZE = 1024;
+// period of the timer used to measure the event loop latency
+constexpr int LATENCY_PROBE_INTERVAL = 100; // ms
+
+double ThreadLoad::score() const
+{
+    // a message costs roughly as much as routing 4 KiB, a millisecond of
+    // event loop latency is worth 100 messages per second
+    return messagesPerSecond + bytesPerSecond / 4096.0 + loopLatencyMs * 100.0 + clients;
+}
+
+ThreadContext::ThreadContext(int index, QObject *parent)
+    : QObject(parent)
+    , m_index(index)
+{
+}
+
+int ThreadContext::index() const
+{
+    return m_index;
+}
+
+void ThreadContext::start()
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    m_latencyTimer = new QTimer(this);
+    m_latencyTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_latencyTimer, &QTimer::timeout, this, &ThreadContext::measureLatency);
+    m_latencyTimer->start(LATENCY_PROBE_INTERVAL);
+    m_sinceLastTick.start();
+    m_flushTimer = new QTimer(this);
+    m_flushTimer->setSingleShot(true);
+    m_flushTimer->setTimerType(Qt::PreciseTimer);
+    connect(m_flushTimer, &QTimer::timeout, this, &ThreadContext::flushWorkers);
+}
+
+int ThreadContext::flushDelay() const
+{
+    return m_flushDelay;
+}
+
+// To be called before the thread starts
+void ThreadContext::setFlushDelay(int msec)
+{
+    m_flushDelay = qMax(0, msec);
+}
+
+// Called by a worker of this thread when it starts gathering frames
+void ThreadContext::scheduleFlush(ServerWorker *worker)
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    m_pendingFlush.append(worker);
+}
+
+void ThreadContext::flushWorkers()
+{
+    for (const QPointer<ServerWorker> &worker : qAsConst(m_pendingFlush)) {
+        // a worker that moved to another thread had nothing to flush
+        if (worker && worker->threadContext() == this)
+            worker->flush();
+    }
+    m_pendingFlush.clear();
+}
+
+// The caller keeps destination alive until the call returns, the mailbox then does.
+// destination is a worker of this thread: the caller runs in it or holds its shard lock
+void ThreadContext::post(ServerWorker *destination, const OutgoingFrame &frame)
+{
+    push(destination, frame, Delivery::Post);
+}
+
+// Posts to destination wherever it lives, from any thread. The shard lock keeps it from
+// migrating meanwhile: the frames posted to its previous thread are all queued before
+// the migration's release marker
+void ThreadContext::postTo(ServerWorker *destination, const OutgoingFrame &frame)
+{
+    for (;;) {
+        ThreadContext *context = destination->threadContext();
+        QReadLocker locker(&context->m_clientsLock);
+        if (destination->threadContext() == context) {
+            context->post(destination, frame);
+            return;
+        }
+    }
+}
+
+// Called by a migrated worker on its previous thread: once the frames posted here before
+// the migration are forwarded, the worker sends the ones it held meanwhile
+void ThreadContext::postRelease(ServerWorker *worker)
+{
+    push(worker, OutgoingFrame(), Delivery::Release);
+}
+
+void ThreadContext::push(ServerWorker *destination, const OutgoingFrame &frame, Delivery delivery)
+{
+    destination->ref();
+    m_mailbox.push(Envelope{destination, frame, delivery});
+    // only the first frame of a batch wakes the owning thread up
+    if (!m_wakeupPending.exchange(true, std::memory_order_acq_rel))
+        QMetaObject::invokeMethod(this, &ThreadContext::drain, Qt::QueuedConnection);
+}
+
+void ThreadContext::addClient(ServerWorker *worker)
+{
+    QWriteLocker locker(&m_clientsLock);
+    m_clients.insert(worker);
+    m_clientCount.store(m_clients.size(), std::memory_order_relaxed);
+}
+
+// Returns the channels the worker was a member of
+QStringList ThreadContext::removeClient(ServerWorker *worker)
+{
+    QWriteLocker locker(&m_clientsLock);
+    m_clients.remove(worker);
+    m_clientCount.store(m_clients.size(), std::memory_order_relaxed);
+    const QStringList channels = m_memberships.take(worker);
+    for (const QString &channel : channels) {
+        auto members = m_channels.find(channel);
+        members->remove(worker);
+        if (members->isEmpty())
+            m_channels.erase(members);
+    }
+    return channels;
+}
+
+// Moves the worker between two shards at once, a reader sees it in exactly one of them.
+// Its thread context changes under the same locks: once a shard lock is taken, a worker
+// that is not in that shard either left or has already been given its new context
+void ThreadContext::moveClient(ServerWorker *worker, ThreadContext *from, ThreadContext *to)
+{
+    Q_ASSERT(from != to);
+    // always locked in the same order
+    ThreadContext *first = from->m_index < to->m_index ? from : to;
+    ThreadContext *second = first == from ? to : from;
+    QWriteLocker firstLocker(&first->m_clientsLock);
+    QWriteLocker secondLocker(&second->m_clientsLock);
+    worker->setThreadContext(to);
+    relocate(worker, from, worker, to);
+}
+
+// The worker of a resumed session takes the place of the previous one, channels included.
+// Neither of them can move to another thread meanwhile: the previous one is disconnected,
+// and the new one only joins a shard here
+void ThreadContext::transferClient(ServerWorker *previous, ServerWorker *worker)
+{
+    ThreadContext *from = previous->threadContext();
+    ThreadContext *to = worker->threadContext();
+    if (from == to) {
+        QWriteLocker locker(&from->m_clientsLock);
+        relocate(previous, from, worker, to);
+        return;
+    }
+    ThreadContext *first = from->m_index < to->m_index ? from : to;
+    ThreadContext *second = first == from ? to : from;
+    QWriteLocker firstLocker(&first->m_clientsLock);
+    QWriteLocker secondLocker(&second->m_clientsLock);
+    relocate(previous, from, worker, to);
+}
+
+// Both shards must be locked
+void ThreadContext::relocate(ServerWorker *previous, ThreadContext *from, ServerWorker *worker, ThreadContext *to)
+{
+    from->m_clients.remove(previous);
+    to->m_clients.insert(worker);
+    const QStringList channels = from->m_memberships.take(previous);
+    for (const QString &channel : channels) {
+        auto members = from->m_channels.find(channel);
+        members->remove(previous);
+        if (members->isEmpty())
+            from->m_channels.erase(members);
+        to->m_channels[channel].insert(worker);
+    }
+    if (!channels.isEmpty())
+        to->m_memberships.insert(worker, channels);
+    from->m_clientCount.store(from->m_clients.size(), std::memory_order_relaxed);
+    to->m_clientCount.store(to->m_clients.size(), std::memory_order_relaxed);
+}
+
+ThreadContext::ChannelResult ThreadContext::joinChannel(ServerWorker *worker, const QString &channel)
+{
+    QWriteLocker locker(&m_clientsLock);
+    if (!m_clients.contains(worker))
+        return ChannelResult::NotHere;
+    QSet<ServerWorker *> &members = m_channels[channel];
+    if (members.contains(worker))
+        return ChannelResult::Unchanged;
+    members.insert(worker);
+    m_memberships[worker].append(channel);
+    return ChannelResult::Changed;
+}
+
+ThreadContext::ChannelResult ThreadContext::leaveChannel(ServerWorker *worker, const QString &channel)
+{
+    QWriteLocker locker(&m_clientsLock);
+    if (!m_clients.contains(worker))
+        return ChannelResult::NotHere;
+    auto members = m_channels.find(channel);
+    if (members == m_channels.end() || !members->remove(worker))
+        return ChannelResult::Unchanged;
+    if (members->isEmpty())
+        m_channels.erase(members);
+    auto memberships = m_memberships.find(worker);
+    memberships->removeOne(channel);
+    if (memberships->isEmpty())
+        m_memberships.erase(memberships);
+    return ChannelResult::Changed;
+}
+
+bool ThreadContext::isMember(ServerWorker *worker, const QString &channel) const
+{
+    QReadLocker locker(&m_clientsLock);
+    return m_memberships.value(worker).contains(channel);
+}
+
+int ThreadContext::clientCount() const
+{
+    return m_clientCount.load(std::memory_order_relaxed);
+}
+
+void ThreadContext::addReceived(qint64 bytes, int messages)
+{
+    m_bytesReceived.fetch_add(quint64(bytes), std::memory_order_relaxed);
+    m_messagesReceived.fetch_add(quint64(messages), std::memory_order_relaxed);
+}
+
+void ThreadContext::addSent(qint64 bytes)
+{
+    m_bytesSent.fetch_add(quint64(bytes), std::memory_order_relaxed);
+    m_framesSent.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ThreadContext::addDropped(int frames)
+{
+    m_framesDropped.fetch_add(quint64(frames), std::memory_order_relaxed);
+}
+
+void ThreadContext::addCoalesced()
+{
+    m_framesCoalesced.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ThreadContext::addSlowConsumer()
+{
+    m_slowConsumers.fetch_add(1, std::memory_order_relaxed);
+}
+
+ThreadCounters ThreadContext::counters() const
+{
+    ThreadCounters result;
+    result.bytesReceived = m_bytesReceived.load(std::memory_order_relaxed);
+    result.bytesSent = m_bytesSent.load(std::memory_order_relaxed);
+    result.messagesReceived = m_messagesReceived.load(std::memory_order_relaxed);
+    result.framesSent = m_framesSent.load(std::memory_order_relaxed);
+    result.framesDropped = m_framesDropped.load(std::memory_order_relaxed);
+    result.framesCoalesced = m_framesCoalesced.load(std::memory_order_relaxed);
+    result.slowConsumers = m_slowConsumers.load(std::memory_order_relaxed);
+    return result;
+}
+
+double ThreadContext::takeLoopLatency()
+{
+    return m_loopLatencyUs.exchange(0, std::memory_order_relaxed) / 1000.0;
+}
+
+void ThreadContext::measureLatency()
+{
+    const qint64 elapsed = m_sinceLastTick.nsecsElapsed() / 1000;
+    m_sinceLastTick.restart();
+    const qint64 lateness = qMax<qint64>(0, elapsed - LATENCY_PROBE_INTERVAL * 1000);
+    qint64 worst = m_loopLatencyUs.load(std::memory_order_relaxed);
+    while (lateness > worst && !m_loopLatencyUs.compare_exchange_weak(worst, lateness, std::memory_order_relaxed)) {}
+}
+
+void ThreadContext::drain()
+{
+    Q_ASSERT(thread() == QThread::currentThread());
+    m_wakeupPending.exchange(false, std::memory_order_acq_rel);
+    Envelope envelope{nullptr, OutgoingFrame(), Delivery::Post};
+    int delivered = 0;
+    while (m_mailbox.pop(&envelope)) {
+        // alive thanks to the envelope's reference, even if its session ended since
+        ServerWorker *destination = envelope.destination;
+        ThreadContext *current = destination->threadContext();
+        if (current != this) {
+            // the worker moved to another thread, it gets the frame before the newer ones
+            current->push(destination, envelope.frame,
+                          envelope.delivery == Delivery::Post ? Delivery::Forward : envelope.delivery);
+        } else if (envelope.delivery == Delivery::Release) {
+            destination->releaseOutput();
+        } else {
+            destination->sendFrame(envelope.frame, envelope.delivery == Delivery::Forward);
+        }
+        destination->deref();
+        if (++delivered == MAX_BATCH_SIZE) {
+            if (!m_wakeupPending.exchange(true, std::memory_order_acq_rel))
+                QMetaObject::invokeMethod(this, &ThreadContext::drain, Qt::QueuedConnection);
+            break;
+        }
+    }
+    if (m_pendingFlush.isEmpty())
+        return;
+    if (m_flushDelay == 0)
+        flushWorkers();
+    else if (!m_flushTimer->isActive())
+        m_flushTimer->start(m_flushDelay);
+}
@@ -0,0 +1,155 @@
+#ifndef THREADCONTEXT_H
+#define THREADCONTEXT_H
+
+#include <QObject>
+#include <QPointer>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QSet>
+#include <QHash>
+#include <QStringList>
+#include <QReadWriteLock>
+#include <atomic>
+
+#include "mailbox.h"
+#include "outputqueue.h"
+
+class QTimer;
+class ServerWorker;
+
+// Counters accumulated by a thread since it started
+struct ThreadCounters
+{
+    quint64 bytesReceived{0};
+    quint64 bytesSent{0};
+    quint64 messagesReceived{0};
+    quint64 framesSent{0};
+    quint64 framesDropped{0};   // presence updates dropped for slow clients
+    quint64 framesCoalesced{0}; // presence updates replaced by newer ones
+    quint64 slowConsumers{0};   // clients disconnected because they did not read
+};
+
+// Load of a thread over the last sampling period
+struct ThreadLoad
+{
+    int clients{0};
+    double messagesPerSecond{0};
+    double bytesPerSecond{0};
+    double loopLatencyMs{0};
+
+    double score() const;
+};
+
+// Lives in a worker thread and delivers the frames posted to the workers of that thread.
+// It also holds the shard of the client table made of these workers, and their channel
+// memberships, so connections and disconnections only lock the shard of their thread
+// and the readers never copy it. A worker stays alive as long as it is in a shard, so the
+// functions given to forEachClient() and forEachMember() may post to it; found any other way,
+// e.g. in the registry, it needs a reference.
+// post() is thread safe, the frames are written in batches, one event loop wake up per batch.
+// The workers gather the frames of a batch and the context flushes each of them once at the
+// end of it, or after flushDelay() ms when a small delay is preferred to more writes.
+// It also keeps the traffic counters and measures how late the thread's event loop runs
+class ThreadContext : public QObject
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(ThreadContext)
+public:
+    explicit ThreadContext(int index, QObject *parent = nullptr);
+    int index() const;
+    void post(ServerWorker *destination, const OutgoingFrame &frame);
+    static void postTo(ServerWorker *destination, const OutgoingFrame &frame);
+    void postRelease(ServerWorker *worker);
+
+    void addClient(ServerWorker *worker);
+    QStringList removeClient(ServerWorker *worker);
+    static void moveClient(ServerWorker *worker, ThreadContext *from, ThreadContext *to);
+    static void transferClient(ServerWorker *previous, ServerWorker *worker);
+    int clientCount() const;
+    template <typename Function>
+    void forEachClient(Function function) const
+    {
+        QReadLocker locker(&m_clientsLock);
+        for (ServerWorker *worker : m_clients)
+            function(worker);
+    }
+
+    enum class ChannelResult {
+        Changed,
+        Unchanged,
+        NotHere // the worker is not, or no longer, a client of this thread
+    };
+    ChannelResult joinChannel(ServerWorker *worker, const QString &channel);
+    ChannelResult leaveChannel(ServerWorker *worker, const QString &channel);
+    bool isMember(ServerWorker *worker, const QString &channel) const;
+    template <typename Function>
+    void forEachMember(const QString &channel, Function function) const
+    {
+        QReadLocker locker(&m_clientsLock);
+        const auto members = m_channels.constFind(channel);
+        if (members == m_channels.cend())
+            return;
+        for (ServerWorker *worker : *members)
+            function(worker);
+    }
+
+    void addReceived(qint64 bytes, int messages);
+    void addSent(qint64 bytes);
+    void addDropped(int frames);
+    void addCoalesced();
+    void addSlowConsumer();
+    ThreadCounters counters() const;
+    double takeLoopLatency();
+    int flushDelay() const;
+    void setFlushDelay(int msec);
+    void scheduleFlush(ServerWorker *worker);
+public slots:
+    void start();
+private:
+    // a frame forwarded by the previous thread of a migrated worker goes before the frames
+    // held by the worker meanwhile, the release marker follows the last forwarded one
+    enum class Delivery : quint8 {
+        Post,
+        Forward,
+        Release
+    };
+    void push(ServerWorker *destination, const OutgoingFrame &frame, Delivery delivery);
+    void drain();
+    void measureLatency();
+    void flushWorkers();
+    static void relocate(ServerWorker *previous, ThreadContext *from, ServerWorker *worker, ThreadContext *to);
+
+    // the envelope holds a reference to its destination until the frame is delivered.
+    // Those left when the thread ends are dropped with their workers
+    struct Envelope {
+        ServerWorker *destination;
+        OutgoingFrame frame;
+        Delivery delivery;
+    };
+
+    const int m_index;
+    Mailbox<Envelope> m_mailbox;
+    std::atomic<bool> m_wakeupPending{false};
+
+    mutable QReadWriteLock m_clientsLock;
+    QSet<ServerWorker *> m_clients;
+    QHash<QString, QSet<ServerWorker *>> m_channels;
+    QHash<ServerWorker *, QStringList> m_memberships;
+    std::atomic<int> m_clientCount{0};
+    std::atomic<quint64> m_bytesReceived{0};
+    std::atomic<quint64> m_bytesSent{0};
+    std::atomic<quint64> m_messagesReceived{0};
+    std::atomic<quint64> m_framesSent{0};
+    std::atomic<quint64> m_framesDropped{0};
+    std::atomic<quint64> m_framesCoalesced{0};
+    std::atomic<quint64> m_slowConsumers{0};
+    std::atomic<qint64> m_loopLatencyUs{0}; // worst lateness since the last sample
+    QTimer *m_latencyTimer{nullptr};
+    int m_flushDelay{0};
+    QTimer *m_flushTimer{nullptr};
+    QVector<QPointer<ServerWorker>> m_pendingFlush;
+    QElapsedTimer m_sinceLastTick;
+};
+
+#endif // THREADCONTEXT_H